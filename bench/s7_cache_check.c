@@ -0,0 +1,172 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+
+// 数据复用检查:两个group读同一地址,复用时间(1000ms)长于group周期(200ms).
+// group不能取用自己上一周期读到的数据,只能取用其他group在它上次读取之后读到的;
+// 超过复用时间的数据不再取用,包含在其他group较大地址段中的item也能命中
+//
+//   s7-cache-check,全部通过时返回0
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <neuron.h>
+
+#include "s7_cache.h"
+
+#define CHECK_WINDOW 1000
+
+struct check_group {
+    const char *        address;
+    neu_type_e          type;
+    s7_point_t          point;
+    s7_read_cmd_sort_t *cs;
+    int64_t             read_ms;
+};
+
+static int32_t check_db_size(void *ctx, uint16_t dbnumber)
+{
+    (void) ctx;
+    (void) dbnumber;
+    return 0;
+}
+
+static const s7_read_item_t *check_item(struct check_group *g)
+{
+    return &g->cs->cmd[0].item[0];
+}
+
+//group在now开始一个周期,查询缓存,返回0表示命中
+static int check_lookup(s7_cache_t *cache, struct check_group *g, int64_t now,
+                        uint8_t *bytes)
+{
+    return s7_cache_lookup(cache, check_item(g),
+                           s7_cache_since(now, CHECK_WINDOW, g->read_ms),
+                           bytes);
+}
+
+//group在now从PLC读到数据
+static void check_read(s7_cache_t *cache, struct check_group *g, int64_t now,
+                       const uint8_t *db)
+{
+    const s7_read_item_t *item = check_item(g);
+
+    s7_cache_store(cache, item, db + item->start_address, item->n_register,
+                   now);
+    g->read_ms = now;
+}
+
+static int check_expect(const char *name, int ret, int expect)
+{
+    printf("%-4s %-32s %s\n", ret == expect ? "ok" : "FAIL", name,
+           ret == 0 ? "hit" : "miss");
+    return ret != expect;
+}
+
+int main(void)
+{
+    struct check_group groups[] = {
+        { "DB1.DBW10", NEU_TYPE_INT32 },
+        { "DB1.DBW10", NEU_TYPE_INT32 },
+        { "DB1.DBW12", NEU_TYPE_INT16 },
+    };
+    struct check_group *a     = &groups[0];
+    struct check_group *b     = &groups[1];
+    struct check_group *c     = &groups[2];
+    s7_plan_param_t     param = {
+        .pdu_size = 240,
+        .gap      = 0,
+        .db_size  = check_db_size,
+    };
+    s7_cache_t *cache     = s7_cache_new();
+    uint8_t     db[64]    = { 0 };
+    uint8_t     bytes[64] = { 0 };
+    int         failed    = 0;
+
+    for (size_t i = 0; i < sizeof(db); i++) {
+        db[i] = (uint8_t)(i * 37 + 11);
+    }
+
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+        neu_datatag_t tag = {
+            .name    = "t",
+            .address = (char *) groups[i].address,
+            .type    = groups[i].type,
+        };
+        UT_array *tags = NULL;
+
+        if (s7_tag_to_point(&tag, &groups[i].point) != NEU_ERR_SUCCESS) {
+            printf("FAIL %-32s invalid address\n", groups[i].address);
+            return 1;
+        }
+        s7_point_t *p = &groups[i].point;
+        utarray_new(tags, &ut_ptr_icd);
+        utarray_push_back(tags, &p);
+        groups[i].cs = s7_tag_sort(tags, &param);
+        utarray_free(tags);
+        s7_cache_plan_add(cache, groups[i].cs);
+    }
+
+    //a每200ms一个周期,复用时间内也不能命中自己读到的数据
+    failed += check_expect("first cycle", check_lookup(cache, a, 10000, bytes),
+                           -1);
+    check_read(cache, a, 10005, db);
+    failed += check_expect("own data, next cycle",
+                           check_lookup(cache, a, 10200, bytes), -1);
+    check_read(cache, a, 10205, db);
+    failed += check_expect("own data, window > interval",
+                           check_lookup(cache, a, 10400, bytes), -1);
+    check_read(cache, a, 10405, db);
+
+    //b取用a刚读到的数据
+    memset(bytes, 0, sizeof(bytes));
+    int ret = check_lookup(cache, b, 10410, bytes);
+    if (ret == 0 && memcmp(bytes, db + check_item(b)->start_address,
+                           check_item(b)->n_register) != 0) {
+        ret = -2;
+    }
+    failed += check_expect("other group data", ret, 0);
+
+    //c的item包含在a的地址段中
+    memset(bytes, 0, sizeof(bytes));
+    ret = check_lookup(cache, c, 10420, bytes);
+    if (ret == 0 && memcmp(bytes, db + check_item(c)->start_address,
+                           check_item(c)->n_register) != 0) {
+        ret = -2;
+    }
+    failed += check_expect("covered by other group", ret, 0);
+
+    //b读了之后,a可以取用b的数据
+    check_read(cache, b, 10500, db);
+    failed += check_expect("newer data from other group",
+                           check_lookup(cache, a, 10600, bytes), 0);
+
+    //超过复用时间
+    failed += check_expect("window expired",
+                           check_lookup(cache, c, 11600, bytes), -1);
+
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+        s7_cache_plan_del(cache, groups[i].cs);
+        s7_tag_sort_free(groups[i].cs);
+    }
+    s7_cache_free(cache);
+    return failed > 0 ? 1 : 0;
+}
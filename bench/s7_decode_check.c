@@ -0,0 +1,541 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+
+// 读应答解码检查:按规划结果拼出固定的读应答,经s7_res_read_check/s7_res_read_next
+// 取出各item,再用s7_decode_exec/s7_decode_value解码,与DB内容逐个比较.
+// 覆盖奇数长度item后的填充字节、位长度(bits+7)>>3、INT8/UINT8在item中的偏移、
+// 全部字节序后缀,以及截断、超长、item数不符和单个item失败的应答.
+// 多tag写入按解码得到的值编码,写请求中各tag的字节应与DB一致.
+// 打开S7_ARRAY_TAG时另外检查数组tag:每种元素宽度和字节序逐个元素比较,以及截断的应答
+//
+//   s7-decode-check,全部通过时返回0
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <neuron.h>
+
+#include "s7.h"
+#include "s7_decode.h"
+
+struct check_tag {
+    const char *address;
+    neu_type_e  type;
+    uint8_t     perm[8]; // 值的第i个字节(高位在前)在PDU中的位置
+};
+
+// 四组地址互不相邻,各成一个item;每组长度都是奇数,应答中item后有填充字节.
+// 第三组的两个8位值不相邻,走逐个取值的路径
+static const struct check_tag check_tags[] = {
+    { "DB1.DBW1", NEU_TYPE_INT16, { 0, 1 } },
+    { "DB1.DBW3#B", NEU_TYPE_UINT16, { 0, 1 } },
+    { "DB1.DBW5#L", NEU_TYPE_INT16, { 1, 0 } },
+    { "DB1.DBW7", NEU_TYPE_UINT8, { 0 } },
+
+    { "DB1.DBW101", NEU_TYPE_INT32, { 0, 1, 2, 3 } },
+    { "DB1.DBW105#BL", NEU_TYPE_INT32, { 0, 1, 2, 3 } },
+    { "DB1.DBW109#BB", NEU_TYPE_UINT32, { 1, 0, 3, 2 } },
+    { "DB1.DBW113#LB", NEU_TYPE_FLOAT, { 2, 3, 0, 1 } },
+    { "DB1.DBW117#LL", NEU_TYPE_FLOAT, { 3, 2, 1, 0 } },
+    { "DB1.DBW121", NEU_TYPE_INT8, { 0 } },
+
+    { "DB1.DBW201", NEU_TYPE_DOUBLE, { 0, 1, 2, 3, 4, 5, 6, 7 } },
+    { "DB1.DBW209#B", NEU_TYPE_INT64, { 0, 1, 2, 3, 4, 5, 6, 7 } },
+    { "DB1.DBW217#L", NEU_TYPE_UINT64, { 7, 6, 5, 4, 3, 2, 1, 0 } },
+    { "DB1.DBW225", NEU_TYPE_UINT8, { 0 } },
+    { "DB1.DBW226.3", NEU_TYPE_BIT, { 0 } },
+    { "DB1.DBW227", NEU_TYPE_INT8, { 0 } },
+
+    { "DB1.DBW301.5", NEU_TYPE_BIT, { 0 } },
+};
+
+#define N_TAG (sizeof(check_tags) / sizeof(check_tags[0]))
+
+// 每个item的应答轮流使用的传输大小,只有octet/real的长度单位是字节
+static const uint8_t check_ts[] = { 0x04, 0x09, 0x05, 0x03 };
+
+static int32_t check_db_size(void *ctx, uint16_t dbnumber)
+{
+    (void) ctx;
+    (void) dbnumber;
+    return 0;
+}
+
+static uint16_t check_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+    return 2;
+}
+
+//按cmd拼读应答的参数和数据部分;fail_item的ReturnCode为0x0A且不带数据
+static uint16_t check_frame(const s7_read_cmd_t *cmd, const uint8_t *db,
+                            int fail_item, uint8_t *frame)
+{
+    uint16_t n = 0;
+
+    frame[n++] = 0x04;
+    frame[n++] = cmd->item_num;
+    for (uint8_t i = 0; i < cmd->item_num; i++) {
+        const s7_read_item_t *item = &cmd->item[i];
+        uint8_t               ts   = check_ts[i % sizeof(check_ts)];
+        uint16_t              len  = item->n_register;
+
+        if (i == fail_item) {
+            frame[n++] = 0x0A;
+            frame[n++] = 0x00;
+            n += check_be16(&frame[n], 0);
+            continue;
+        }
+        frame[n++] = 0xFF;
+        frame[n++] = ts;
+        //octet/real之外长度以位计;单字节的位item只给1位,(1+7)>>3仍是1字节
+        if (ts != 0x09 && ts != 0x07) {
+            len = ts == 0x03 && len == 1 ? 1 : len * 8;
+        }
+        n += check_be16(&frame[n], len);
+        memcpy(&frame[n], db + item->start_address, item->n_register);
+        n += item->n_register;
+        if ((item->n_register & 1) && i + 1 < cmd->item_num) {
+            frame[n++] = 0x00;
+        }
+    }
+    return n;
+}
+
+static int check_parse(const s7_read_cmd_t *cmd, uint8_t *frame,
+                       uint16_t n_frame, s7_read_res_t *res)
+{
+    neu_protocol_unpack_buf_t buf = { 0 };
+
+    neu_protocol_unpack_buf_init(&buf, frame, n_frame);
+    int ret = s7_res_read_check(&buf, cmd, res);
+    if (ret == 0 && buf.offset != n_frame) {
+        return -3;
+    }
+    return ret;
+}
+
+static uint64_t check_expect(const s7_point_t *point,
+                             const struct check_tag *tag, const uint8_t *db)
+{
+    const uint8_t *q = db + point->start_address;
+    uint64_t       v = 0;
+
+    if (point->type == NEU_TYPE_BIT) {
+        return (q[0] >> point->option.bit.bit) & 1;
+    }
+    for (uint16_t k = 0; k < point->n_register; k++) {
+        v = v << 8 | q[tag->perm[k]];
+    }
+    return v;
+}
+
+static uint64_t check_value(const s7_point_t *point, const neu_dvalue_t *dv)
+{
+    switch (point->n_register) {
+    case 8:
+        return dv->value.u64;
+    case 4:
+        return dv->value.u32;
+    case 2:
+        return dv->value.u16;
+    default:
+        return dv->value.u8;
+    }
+}
+
+//逐个item解码并比较,返回不一致的point数;fail_item的point应当跳过
+static int check_decode(s7_read_cmd_sort_t *cs, const s7_read_cmd_t *cmd,
+                        s7_read_res_t *res, const s7_point_t *points,
+                        const uint8_t *db, int fail_item, uint32_t *n_value)
+{
+    s7_read_view_t view = { 0 };
+    int            bad  = 0;
+
+    for (uint8_t i = 0; s7_res_read_next(res, &view); i++) {
+        const s7_read_item_t *item = &cmd->item[i];
+        s7_decode_op_t *      ops  = &cs->ops[item->first];
+        uint64_t *            raw  = &cs->raw[item->first];
+
+        if (i == fail_item) {
+            bad += view.ret == 0x0A && view.n_byte == 0 ? 0 : 1;
+            continue;
+        }
+        if (view.ret != 0xFF || view.n_byte != item->n_register) {
+            bad += item->n_point;
+            continue;
+        }
+
+        s7_decode_exec(ops, item->n_point, view.data, view.n_byte, raw);
+        for (uint32_t j = 0; j < item->n_point; j++) {
+            const s7_point_t *point = cs->points[ops[j].slot];
+            neu_dvalue_t      dv    = { 0 };
+
+            if (s7_decode_value(&ops[j], point, raw[j], view.data,
+                                view.n_byte, &dv) != NEU_ERR_SUCCESS ||
+                check_value(point, &dv) !=
+                    check_expect(point, &check_tags[point - points], db)) {
+                printf("FAIL %s\n", check_tags[point - points].address);
+                bad++;
+            }
+            *n_value += 1;
+        }
+    }
+    return bad;
+}
+
+#ifdef S7_ARRAY_TAG
+// 数组tag单独规划,perm为每个元素的字节在PDU中的位置
+static const struct check_tag check_array_tags[] = {
+    { "DB1.DBW331[5]", NEU_TYPE_ARRAY_INT8, { 0 } },
+    { "DB1.DBW341[3]", NEU_TYPE_ARRAY_UINT8, { 0 } },
+    { "DB1.DBW351[3]", NEU_TYPE_ARRAY_INT16, { 0, 1 } },
+    { "DB1.DBW361[3]#B", NEU_TYPE_ARRAY_UINT16, { 0, 1 } },
+    { "DB1.DBW371[3]#L", NEU_TYPE_ARRAY_INT16, { 1, 0 } },
+    { "DB1.DBW381[2]", NEU_TYPE_ARRAY_INT32, { 0, 1, 2, 3 } },
+    { "DB1.DBW391[2]#BL", NEU_TYPE_ARRAY_UINT32, { 0, 1, 2, 3 } },
+    { "DB1.DBW401[2]#BB", NEU_TYPE_ARRAY_INT32, { 1, 0, 3, 2 } },
+    { "DB1.DBW411[2]#LB", NEU_TYPE_ARRAY_FLOAT, { 2, 3, 0, 1 } },
+    { "DB1.DBW421[2]#LL", NEU_TYPE_ARRAY_UINT32, { 3, 2, 1, 0 } },
+    { "DB1.DBW431[2]", NEU_TYPE_ARRAY_DOUBLE, { 0, 1, 2, 3, 4, 5, 6, 7 } },
+    { "DB1.DBW451[2]#B", NEU_TYPE_ARRAY_INT64, { 0, 1, 2, 3, 4, 5, 6, 7 } },
+    { "DB1.DBW471[2]#L", NEU_TYPE_ARRAY_UINT64, { 7, 6, 5, 4, 3, 2, 1, 0 } },
+};
+
+#define N_ARRAY_TAG (sizeof(check_array_tags) / sizeof(check_array_tags[0]))
+
+static uint64_t check_elem_value(const neu_dvalue_t *dv, uint16_t width,
+                                 uint16_t k)
+{
+    switch (width) {
+    case 8:
+        return dv->value.u64s.u64s[k];
+    case 4:
+        return dv->value.u32s.u32s[k];
+    case 2:
+        return dv->value.u16s.u16s[k];
+    default:
+        return dv->value.u8s.u8s[k];
+    }
+}
+
+//每个元素按perm从DB中取出的值与解码结果比较,返回不一致的数组tag数;
+//short_by不为0时把item数据截短,解码应当失败
+static int check_array_decode(s7_read_cmd_sort_t *cs, const s7_read_cmd_t *cmd,
+                              s7_read_res_t *res, const s7_point_t *points,
+                              const uint8_t *db, uint16_t short_by,
+                              uint32_t *n_elem)
+{
+    s7_read_view_t view = { 0 };
+    int            bad  = 0;
+
+    for (uint8_t i = 0; s7_res_read_next(res, &view); i++) {
+        const s7_read_item_t *item = &cmd->item[i];
+        s7_decode_op_t *      ops  = &cs->ops[item->first];
+        uint64_t *            raw  = &cs->raw[item->first];
+
+        if (view.ret != 0xFF || view.n_byte != item->n_register) {
+            bad += item->n_point;
+            continue;
+        }
+
+        uint16_t n_byte = view.n_byte - short_by;
+        s7_decode_exec(ops, item->n_point, view.data, n_byte, raw);
+        for (uint32_t j = 0; j < item->n_point; j++) {
+            const s7_point_t *      point = cs->points[ops[j].slot];
+            const struct check_tag *tag   = &check_array_tags[point - points];
+            uint16_t                width = point->n_register / point->n_elem;
+            neu_dvalue_t            dv    = { 0 };
+            bool                    ok    = true;
+
+            //截短时最后一个数组的数据不完整
+            if (short_by > 0) {
+                int ret = s7_decode_value(&ops[j], point, raw[j], view.data,
+                                          n_byte, &dv);
+                bool last = ops[j].offset + point->n_register > n_byte;
+                if ((ret != NEU_ERR_SUCCESS) != last) {
+                    printf("FAIL %s short\n", tag->address);
+                    bad++;
+                }
+                continue;
+            }
+            if (s7_decode_value(&ops[j], point, raw[j], view.data, n_byte,
+                                &dv) != NEU_ERR_SUCCESS ||
+                dv.type != point->type || dv.value.u8s.length != point->n_elem) {
+                ok = false;
+            }
+            for (uint16_t k = 0; ok && k < point->n_elem; k++) {
+                const uint8_t *q = db + point->start_address + k * width;
+                uint64_t       v = 0;
+
+                for (uint16_t b = 0; b < width; b++) {
+                    v = v << 8 | q[tag->perm[b]];
+                }
+                ok = check_elem_value(&dv, width, k) == v;
+            }
+            if (!ok) {
+                printf("FAIL %s\n", tag->address);
+                bad++;
+            }
+            *n_elem += point->n_elem;
+        }
+    }
+    return bad;
+}
+
+static int check_arrays(const uint8_t *db, uint8_t *frame)
+{
+    s7_point_t      points[N_ARRAY_TAG] = { 0 };
+    s7_plan_param_t param               = {
+        .pdu_size = 240,
+        .gap      = 0,
+        .db_size  = check_db_size,
+        .split    = 1,
+    };
+    UT_array *tags   = NULL;
+    int       failed = 0;
+
+    utarray_new(tags, &ut_ptr_icd);
+    for (size_t i = 0; i < N_ARRAY_TAG; i++) {
+        neu_datatag_t tag = {
+            .name    = "t",
+            .address = (char *) check_array_tags[i].address,
+            .type    = check_array_tags[i].type,
+        };
+        if (s7_tag_to_point(&tag, &points[i]) != NEU_ERR_SUCCESS) {
+            printf("FAIL %-32s invalid address\n",
+                   check_array_tags[i].address);
+            failed++;
+            continue;
+        }
+        s7_point_t *p = &points[i];
+        utarray_push_back(tags, &p);
+    }
+
+    s7_read_cmd_sort_t *cs = s7_tag_sort(tags, &param);
+    for (uint16_t c = 0; c < cs->n_cmd; c++) {
+        const s7_read_cmd_t *cmd    = &cs->cmd[c];
+        s7_read_res_t        res    = { 0 };
+        uint32_t             n_elem = 0;
+        uint16_t             n_frame = check_frame(cmd, db, -1, frame);
+        int                  ret     = check_parse(cmd, frame, n_frame, &res);
+        int                  bad     = ret == 0
+            ? check_array_decode(cs, cmd, &res, points, db, 0, &n_elem)
+            : 1;
+
+        printf("%-4s %-32s items %" PRIu8 " elems %" PRIu32 "\n",
+               bad == 0 ? "ok" : "FAIL", "array response", cmd->item_num,
+               n_elem);
+        failed += bad > 0;
+
+        //数据少一个字节:应答本身不完整
+        ret = check_parse(cmd, frame, n_frame - 1, &res);
+        printf("%-4s %-32s ret %d\n", ret == -1 ? "ok" : "FAIL",
+               "truncated array response", ret);
+        failed += ret != -1;
+
+        //item数据比数组短:只有超出数据的数组解码失败
+        ret = check_parse(cmd, frame, n_frame, &res);
+        bad = ret == 0
+            ? check_array_decode(cs, cmd, &res, points, db, 1, &n_elem)
+            : 1;
+        printf("%-4s %-32s items %" PRIu8 "\n", bad == 0 ? "ok" : "FAIL",
+               "array longer than item data", cmd->item_num);
+        failed += bad > 0;
+    }
+
+    s7_tag_sort_free(cs);
+    utarray_free(tags);
+    return failed;
+}
+#endif
+
+//按DB内容给各tag赋值后合并成写请求,返回与DB不一致的tag数;位tag按整字节写入,不参与比较
+static int check_write(const s7_point_t *points, const uint8_t *db,
+                       uint16_t *n_cmd)
+{
+    s7_point_write_t writes[N_TAG] = { 0 };
+    UT_array *       tags          = NULL;
+    int              bad           = 0;
+
+    utarray_new(tags, &ut_ptr_icd);
+    for (size_t i = 0; i < N_TAG; i++) {
+        uint64_t v = check_expect(&points[i], &check_tags[i], db);
+
+        if (points[i].type == NEU_TYPE_BIT) {
+            continue;
+        }
+        writes[i].point = points[i];
+        switch (points[i].n_register) {
+        case 8:
+            writes[i].value.u64 = v;
+            break;
+        case 4:
+            writes[i].value.u32 = v;
+            break;
+        case 2:
+            writes[i].value.u16 = v;
+            break;
+        default:
+            writes[i].value.u8 = v;
+            break;
+        }
+        s7_point_write_t *w = &writes[i];
+        utarray_push_back(tags, &w);
+    }
+
+    s7_write_cmd_sort_t *ws = s7_write_tags_sort(tags);
+    for (uint16_t c = 0; c < ws->n_cmd; c++) {
+        const s7_write_cmd_t *cmd = &ws->cmd[c];
+
+        utarray_foreach(cmd->tags, s7_point_write_t **, w)
+        {
+            const s7_point_t *point = &(*w)->point;
+
+            if (cmd->n_byte != cmd->n_register ||
+                memcmp(cmd->bytes + (point->start_address - cmd->start_address),
+                       db + point->start_address, point->n_register) != 0) {
+                printf("FAIL %s write\n",
+                       check_tags[*w - writes].address);
+                bad++;
+            }
+        }
+        utarray_free(cmd->tags);
+        free(cmd->bytes);
+    }
+    *n_cmd = ws->n_cmd;
+    free(ws->cmd);
+    free(ws);
+    utarray_free(tags);
+    return bad;
+}
+
+int main(void)
+{
+    s7_point_t      points[N_TAG] = { 0 };
+    uint8_t         db[512]       = { 0 };
+    uint8_t         frame[1024]   = { 0 };
+    s7_plan_param_t param         = {
+        .pdu_size = 240,
+        .gap      = 0,
+        .db_size  = check_db_size,
+        .split    = 1,
+    };
+    UT_array *tags   = NULL;
+    int       failed = 0;
+
+    for (size_t i = 0; i < sizeof(db); i++) {
+        db[i] = (uint8_t)(i * 37 + 11);
+    }
+
+    utarray_new(tags, &ut_ptr_icd);
+    for (size_t i = 0; i < N_TAG; i++) {
+        neu_datatag_t tag = {
+            .name    = "t",
+            .address = (char *) check_tags[i].address,
+            .type    = check_tags[i].type,
+        };
+        if (s7_tag_to_point(&tag, &points[i]) != NEU_ERR_SUCCESS) {
+            printf("FAIL %-32s invalid address\n", check_tags[i].address);
+            failed++;
+            continue;
+        }
+        s7_point_t *p = &points[i];
+        utarray_push_back(tags, &p);
+    }
+
+    s7_read_cmd_sort_t *cs = s7_tag_sort(tags, &param);
+    for (uint16_t c = 0; c < cs->n_cmd; c++) {
+        const s7_read_cmd_t *cmd     = &cs->cmd[c];
+        s7_read_res_t        res     = { 0 };
+        uint32_t             n_value = 0;
+        uint16_t             n_frame = 0;
+        int                  ret     = 0;
+        int                  bad     = 0;
+
+        //完整应答:各item取出的数据与DB一致
+        n_frame = check_frame(cmd, db, -1, frame);
+        ret     = check_parse(cmd, frame, n_frame, &res);
+        bad     = ret == 0
+            ? check_decode(cs, cmd, &res, points, db, -1, &n_value)
+            : 1;
+        printf("%-4s %-32s items %" PRIu8 " values %" PRIu32 "\n",
+               bad == 0 ? "ok" : "FAIL", "read response", cmd->item_num,
+               n_value);
+        failed += bad > 0;
+
+        //第二个item失败:没有数据,其后的item照常取出
+        n_value = 0;
+        n_frame = check_frame(cmd, db, 1, frame);
+        ret     = check_parse(cmd, frame, n_frame, &res);
+        bad     = ret == 0
+            ? check_decode(cs, cmd, &res, points, db, 1, &n_value)
+            : 1;
+        printf("%-4s %-32s items %" PRIu8 " values %" PRIu32 "\n",
+               bad == 0 ? "ok" : "FAIL", "one item failed", cmd->item_num,
+               n_value);
+        failed += bad > 0;
+
+        //截断:少最后一个字节
+        n_frame = check_frame(cmd, db, -1, frame);
+        ret     = check_parse(cmd, frame, n_frame - 1, &res);
+        printf("%-4s %-32s ret %d\n", ret == -1 ? "ok" : "FAIL",
+               "truncated response", ret);
+        failed += ret != -1;
+
+        //item数与请求不一致
+        frame[1] = cmd->item_num + 1;
+        ret      = check_parse(cmd, frame, n_frame, &res);
+        printf("%-4s %-32s ret %d\n", ret == -2 ? "ok" : "FAIL",
+               "item count mismatch", ret);
+        failed += ret != -2;
+
+        //第一个item的数据比请求的长
+        n_frame = check_frame(cmd, db, -1, frame);
+        check_be16(&frame[4], (cmd->item[0].n_register + 2) * 8);
+        ret = check_parse(cmd, frame, n_frame, &res);
+        printf("%-4s %-32s ret %d\n", ret == -1 ? "ok" : "FAIL",
+               "item longer than requested", ret);
+        failed += ret != -1;
+    }
+
+    //四组地址应当排成一个cmd中的四个item,才能覆盖填充字节和每种传输大小
+    bool layout = cs->n_cmd == 1 && cs->cmd[0].item_num == sizeof(check_ts);
+    printf("%-4s %-32s cmds %" PRIu16 "\n", layout ? "ok" : "FAIL",
+           "plan layout", cs->n_cmd);
+    failed += !layout;
+
+    //多tag写入:各tag的值按字节序后缀编码到写请求中的偏移处
+    uint16_t n_write = 0;
+    int      bad     = check_write(points, db, &n_write);
+    printf("%-4s %-32s cmds %" PRIu16 "\n", bad == 0 ? "ok" : "FAIL",
+           "write encode", n_write);
+    failed += bad > 0;
+
+#ifdef S7_ARRAY_TAG
+    failed += check_arrays(db, frame);
+#endif
+
+    s7_tag_sort_free(cs);
+    utarray_free(tags);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,191 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+
+// 读请求规划耗时:生成分布在若干DB中的tag,统计s7_tag_sort的耗时和峰值内存
+// 每种规模在子进程中运行,峰值内存互不影响
+//
+//   s7-plan-bench [-p pdu_size] [-g gap] [-d dbs] [-r rounds] [n_tag ...]
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <neuron.h>
+
+#include "s7_point.h"
+
+static const uint32_t bench_default[] = { 1000, 10000, 100000, 500000 };
+
+static int64_t bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//DB大小未知时不跨空洞合并,bench中所有DB都按最大地址计
+static int32_t bench_db_size(void *ctx, uint16_t dbnumber)
+{
+    (void) ctx;
+    (void) dbnumber;
+    return 65535;
+}
+
+//tag按类型宽度依次排在各DB中,约1/8的tag前面留出空洞
+static s7_point_t *bench_points(uint32_t n_tag, uint16_t n_db)
+{
+    static const struct {
+        neu_type_e type;
+        uint16_t   n_byte;
+    } types[] = {
+        { NEU_TYPE_BIT, 1 },     { NEU_TYPE_INT16, 2 },
+        { NEU_TYPE_FLOAT, 4 },   { NEU_TYPE_INT32, 4 },
+        { NEU_TYPE_DOUBLE, 8 },  { NEU_TYPE_UINT16, 2 },
+    };
+    s7_point_t *points = calloc(n_tag, sizeof(s7_point_t));
+    uint32_t *  next   = calloc(n_db, sizeof(uint32_t));
+    unsigned    seed   = 1;
+
+    for (uint32_t i = 0; i < n_tag; i++) {
+        s7_point_t *p = &points[i];
+        int         t = rand_r(&seed) % (sizeof(types) / sizeof(types[0]));
+        uint16_t    db = rand_r(&seed) % n_db;
+
+        if (rand_r(&seed) % 8 == 0) {
+            next[db] += rand_r(&seed) % 64;
+        }
+        if (next[db] + types[t].n_byte > 65535) {
+            next[db] = 0;
+        }
+        p->area          = S7AreaDB;
+        p->dbnumber      = db + 1;
+        p->start_address = next[db];
+        p->n_register    = types[t].n_byte;
+        p->type          = types[t].type;
+        snprintf(p->name, sizeof(p->name), "tag%" PRIu32, i);
+        next[db] += types[t].n_byte;
+    }
+
+    free(next);
+    return points;
+}
+
+static void bench_run(uint32_t n_tag, const s7_plan_param_t *param,
+                      uint16_t n_db, int rounds)
+{
+    s7_point_t *points = bench_points(n_tag, n_db);
+    UT_array *  tags   = NULL;
+    int64_t     best   = INT64_MAX;
+    uint32_t    n_item = 0;
+    uint16_t    n_cmd  = 0;
+
+    utarray_new(tags, &ut_ptr_icd);
+    utarray_reserve(tags, n_tag);
+    for (uint32_t i = 0; i < n_tag; i++) {
+        s7_point_t *p = &points[i];
+        utarray_push_back(tags, &p);
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        int64_t             start = bench_now_us();
+        s7_read_cmd_sort_t *cs    = s7_tag_sort(tags, param);
+        int64_t             used  = bench_now_us() - start;
+
+        if (used < best) {
+            best = used;
+        }
+        n_cmd  = cs->n_cmd;
+        n_item = 0;
+        for (uint16_t i = 0; i < cs->n_cmd; i++) {
+            n_item += cs->cmd[i].item_num;
+        }
+        s7_tag_sort_free(cs);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%8" PRIu32 " tags  %6" PRIu16 " pdus  %7" PRIu32
+           " items  %10.3f ms  %8ld KB peak\n",
+           n_tag, n_cmd, n_item, best / 1000.0, usage.ru_maxrss);
+
+    utarray_free(tags);
+    free(points);
+}
+
+int main(int argc, char *argv[])
+{
+    s7_plan_param_t param  = { .pdu_size = 960, .db_size = bench_db_size };
+    uint16_t        n_db   = 16;
+    int             rounds = 3;
+    int             opt    = 0;
+
+    while ((opt = getopt(argc, argv, "p:g:d:r:")) != -1) {
+        switch (opt) {
+        case 'p':
+            param.pdu_size = atoi(optarg);
+            break;
+        case 'g':
+            param.gap = atoi(optarg);
+            break;
+        case 'd':
+            n_db = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-p pdu_size] [-g gap] [-d dbs] [-r rounds] "
+                    "[n_tag ...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (param.pdu_size < 240 || n_db == 0 || rounds <= 0) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    printf("pdu %" PRIu16 ", gap %" PRIu16 ", %" PRIu16 " dbs, best of %d\n",
+           param.pdu_size, param.gap, n_db, rounds);
+    fflush(stdout);
+
+    int      n_size = optind < argc ? argc - optind
+                                    : (int) (sizeof(bench_default) /
+                                             sizeof(bench_default[0]));
+    for (int i = 0; i < n_size; i++) {
+        uint32_t n_tag = optind < argc ? (uint32_t) strtoul(argv[optind + i],
+                                                            NULL, 10)
+                                       : bench_default[i];
+        pid_t    pid   = fork();
+
+        if (pid == 0) {
+            bench_run(n_tag, &param, n_db, rounds);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+
+// 读规划检查:同一DB中两个tag相距96字节,只有DB大小已知且不超过read_gap时
+// 才合并成一个item;DB大小未知(0)或PLC拒绝块信息查询(-1)时各自读取.
+// 增量规划:一个大DB中新增一个tag,只重排它附近的cmd.
+// 超出应答PDU的tag独占一个不发送的cmd
+//
+//   s7-plan-check,全部通过时返回0
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <neuron.h>
+
+#include "s7_point.h"
+
+struct check_case {
+    const char *name;
+    int32_t     db_size;
+    uint16_t    gap;
+    uint16_t    n_item; // 期望的item数
+    uint16_t    n_byte; // 期望读取的字节数
+};
+
+static const struct check_case check_cases[] = {
+    { "db size known, gap bridged", 200, 256, 1, 104 },
+    { "db size known, gap too small", 200, 64, 2, 8 },
+    { "db size unknown", 0, 256, 2, 8 },
+    { "block info rejected", -1, 256, 2, 8 },
+    { "db smaller than bridged range", 50, 256, 2, 8 },
+};
+
+static int32_t check_db_size(void *ctx, uint16_t dbnumber)
+{
+    (void) dbnumber;
+    return *(const int32_t *) ctx;
+}
+
+static int check_run(const struct check_case *c)
+{
+    s7_point_t points[2] = {
+        { .area = S7AreaDB, .dbnumber = 1, .start_address = 0,
+          .n_register = 4, .type = NEU_TYPE_FLOAT, .name = "t0" },
+        { .area = S7AreaDB, .dbnumber = 1, .start_address = 100,
+          .n_register = 4, .type = NEU_TYPE_FLOAT, .name = "t1" },
+    };
+    int32_t         db_size = c->db_size;
+    s7_plan_param_t param   = {
+        .pdu_size = 240,
+        .gap      = c->gap,
+        .db_size  = check_db_size,
+        .db_ctx   = &db_size,
+    };
+    UT_array *tags   = NULL;
+    uint16_t  n_item = 0;
+    uint16_t  n_byte = 0;
+    bool      fits   = true; // 缓存缓冲放得下每个item
+
+    utarray_new(tags, &ut_ptr_icd);
+    for (int i = 0; i < 2; i++) {
+        s7_point_t *p = &points[i];
+        utarray_push_back(tags, &p);
+    }
+
+    s7_read_cmd_sort_t *cs = s7_tag_sort(tags, &param);
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        for (uint8_t j = 0; j < cs->cmd[i].item_num; j++) {
+            n_item += 1;
+            n_byte += cs->cmd[i].item[j].n_register;
+            fits = fits && cs->cmd[i].item[j].n_register <= cs->n_scratch;
+        }
+    }
+    s7_tag_sort_free(cs);
+    utarray_free(tags);
+
+    bool ok = n_item == c->n_item && n_byte == c->n_byte && fits;
+    printf("%-4s %-32s items %" PRIu16 " bytes %" PRIu16 "\n",
+           ok ? "ok" : "FAIL", c->name, n_item, n_byte);
+    return ok ? 0 : 1;
+}
+
+static int check_update(void)
+{
+    enum { N_TAG = 4000 };
+    s7_point_t *points  = calloc(N_TAG + 1, sizeof(s7_point_t));
+    int32_t     db_size = 65535;
+    s7_plan_param_t param = {
+        .pdu_size = 240,
+        .gap      = 16,
+        .db_size  = check_db_size,
+        .db_ctx   = &db_size,
+    };
+    UT_array *tags = NULL, *removed = NULL, *added = NULL;
+
+    utarray_new(tags, &ut_ptr_icd);
+    utarray_new(removed, &ut_ptr_icd);
+    utarray_new(added, &ut_ptr_icd);
+    for (uint32_t i = 0; i <= N_TAG; i++) {
+        s7_point_t *p    = &points[i];
+        p->area          = S7AreaDB;
+        p->dbnumber      = 1;
+        p->start_address = i * 4;
+        p->n_register    = 4;
+        p->type          = NEU_TYPE_FLOAT;
+        if (i < N_TAG) {
+            utarray_push_back(tags, &p);
+        }
+    }
+    //新增的tag落在DB中间的空隙里
+    s7_point_t *p    = &points[N_TAG];
+    p->start_address = N_TAG * 2 + 1;
+    p->n_register    = 2;
+    p->type          = NEU_TYPE_INT16;
+    utarray_push_back(added, &p);
+
+    //reserve_id只用于日志,这里借来标记原有的cmd,原样保留的cmd会带着它
+    s7_read_cmd_sort_t *cs    = s7_tag_sort(tags, &param);
+    uint16_t            n_old = cs->n_cmd;
+    for (uint16_t i = 0; i < n_old; i++) {
+        cs->cmd[i].reserve_id = 1;
+    }
+
+    cs = s7_tag_sort_update(cs, removed, added, &param);
+
+    uint16_t n_keep    = 0;
+    uint16_t n_longest = 0;
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        n_keep += cs->cmd[i].reserve_id;
+        for (uint8_t j = 0; j < cs->cmd[i].item_num; j++) {
+            if (cs->cmd[i].item[j].n_register > n_longest) {
+                n_longest = cs->cmd[i].item[j].n_register;
+            }
+        }
+    }
+    //重排的范围是read_gap加一个PDU,两侧最多各涉及几个cmd;
+    //缓存缓冲要放得下保留的和新排的最长item
+    bool ok = cs->n_point == N_TAG + 1 && n_old - n_keep <= 4 &&
+        cs->n_scratch >= n_longest;
+    printf("%-4s %-32s cmds %" PRIu16 " kept %" PRIu16 " points %" PRIu32
+           "\n",
+           ok ? "ok" : "FAIL", "update replans nearby cmds only", n_old,
+           n_keep, cs->n_point);
+
+    s7_tag_sort_free(cs);
+    utarray_free(added);
+    utarray_free(removed);
+    utarray_free(tags);
+    free(points);
+    return ok ? 0 : 1;
+}
+
+//超出应答PDU的tag(大数组、长字符串)独占一个cmd并标记为oversize,不编码请求帧;
+//增量规划保留该标记,其余cmd照常编码
+static int check_oversize(void)
+{
+    s7_point_t points[4] = {
+        { .area = S7AreaDB, .dbnumber = 1, .start_address = 0,
+          .n_register = 4, .type = NEU_TYPE_FLOAT, .name = "t0" },
+        { .area = S7AreaDB, .dbnumber = 1, .start_address = 100,
+          .n_register = 300, .type = NEU_TYPE_BYTES, .name = "big" },
+        { .area = S7AreaDB, .dbnumber = 1, .start_address = 1000,
+          .n_register = 4, .type = NEU_TYPE_FLOAT, .name = "t1" },
+        { .area = S7AreaDB, .dbnumber = 1, .start_address = 2000,
+          .n_register = 2, .type = NEU_TYPE_INT16, .name = "t2" },
+    };
+    int32_t         db_size = 0;
+    s7_plan_param_t param   = {
+        .pdu_size = 240,
+        .gap      = 0,
+        .db_size  = check_db_size,
+        .db_ctx   = &db_size,
+        .split    = 1,
+    };
+    UT_array *tags = NULL, *removed = NULL, *added = NULL;
+    int       bad  = 0;
+
+    utarray_new(tags, &ut_ptr_icd);
+    utarray_new(removed, &ut_ptr_icd);
+    utarray_new(added, &ut_ptr_icd);
+    for (int i = 0; i < 3; i++) {
+        s7_point_t *p = &points[i];
+        utarray_push_back(tags, &p);
+    }
+    s7_point_t *p = &points[3];
+    utarray_push_back(added, &p);
+
+    s7_read_cmd_sort_t *cs = s7_tag_sort(tags, &param);
+    for (int round = 0; round < 2; round++) {
+        uint16_t n_oversize = 0;
+
+        for (uint16_t i = 0; i < cs->n_cmd; i++) {
+            const s7_read_cmd_t *cmd = &cs->cmd[i];
+            bool big = false;
+
+            for (uint8_t j = 0; j < cmd->item_num; j++) {
+                big = big || cmd->item[j].n_register >= 300;
+            }
+            n_oversize += cmd->oversize;
+            if (cmd->oversize != big || (big && cmd->item_num != 1) ||
+                (cmd->req == NULL) != cmd->oversize) {
+                bad++;
+            }
+        }
+        bad += n_oversize != 1;
+        printf("%-4s %-32s cmds %" PRIu16 " oversize %" PRIu16 "\n",
+               bad == 0 ? "ok" : "FAIL",
+               round == 0 ? "oversize tag not sent" : "oversize kept by update",
+               cs->n_cmd, n_oversize);
+        if (round == 0) {
+            cs = s7_tag_sort_update(cs, removed, added, &param);
+        }
+    }
+
+    s7_tag_sort_free(cs);
+    utarray_free(added);
+    utarray_free(removed);
+    utarray_free(tags);
+    return bad > 0 ? 1 : 0;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(check_cases) / sizeof(check_cases[0]); i++) {
+        failed += check_run(&check_cases[i]);
+    }
+    failed += check_update();
+    failed += check_oversize();
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,466 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+
+// epoll与io_uring收发对比:通过插件的会话、stack和s7_send_msg/s7_uring收发,
+// 向本地mock PLC发出读请求.mock PLC完成COTP和S7握手,协商的并行job数为depth,
+// 每条连接保持depth个在途请求,应答到达后在接收线程中续发,统计每秒完成的请求数
+// -s使用共享reactor,否则会话独占events线程
+//
+//   s7-transport-bench [-c connections] [-d depth] [-n requests] [-i items] [-s]
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <neuron.h>
+
+#include "s7_point.h"
+#include "s7_req.h"
+#include "s7_session.h"
+
+#define BENCH_BUF_SIZE 8192
+#define BENCH_PDU_SIZE 960
+#define BENCH_TIMEOUT_MS 5000
+
+struct bench_link {
+    s7_link_t *link;
+    uint64_t   sent;
+    uint64_t   done;
+};
+
+static int      n_conn   = 4;
+static int      depth    = 8;
+static uint64_t n_req    = 100000;
+static int      n_item   = 1;
+static bool     shared   = false;
+static uint16_t port     = 0;
+static int      listenfd = -1;
+
+static pthread_mutex_t   bench_mtx  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    bench_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t          bench_done = 0;
+static uint64_t          bench_errors = 0;
+static struct bench_link bench_links[S7_MAX_CONNECTIONS];
+
+static int64_t bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int read_full(int fd, uint8_t *buf, size_t n)
+{
+    size_t off = 0;
+    while (off < n) {
+        ssize_t ret = read(fd, buf + off, n - off);
+        if (ret <= 0) {
+            return -1;
+        }
+        off += ret;
+    }
+    return 0;
+}
+
+static void plc_header(uint8_t *out, const uint8_t *req, uint16_t len,
+                       uint16_t n_param, uint16_t n_data)
+{
+    memcpy(out, req, 7);
+    out[2]  = len >> 8;
+    out[3]  = len & 0xFF;
+    out[7]  = 0x32;
+    out[8]  = 0x03;
+    out[9]  = 0;
+    out[10] = 0;
+    out[11] = req[11];
+    out[12] = req[12];
+    out[13] = n_param >> 8;
+    out[14] = n_param & 0xFF;
+    out[15] = n_data >> 8;
+    out[16] = n_data & 0xFF;
+    out[17] = 0;
+    out[18] = 0;
+}
+
+//按请求生成应答,写入out,返回应答长度,不认识的请求返回0
+static uint16_t plc_answer(const uint8_t *req, uint16_t len, uint8_t *out)
+{
+    //COTP CR -> CC
+    if (len >= 6 && req[5] == 0xE0) {
+        memcpy(out, req, len);
+        out[5] = 0xD0;
+        return len;
+    }
+    if (len < 19 || req[5] != 0xF0 || req[7] != 0x32 || req[8] != 0x01) {
+        return 0;
+    }
+
+    //setup communication,并行job数即depth
+    if (req[17] == 0xF0) {
+        uint8_t *param = out + 19;
+        plc_header(out, req, 27, 8, 0);
+        param[0] = 0xF0;
+        param[1] = 0;
+        param[2] = 0;
+        param[3] = depth;
+        param[4] = 0;
+        param[5] = depth;
+        param[6] = BENCH_PDU_SIZE >> 8;
+        param[7] = BENCH_PDU_SIZE & 0xFF;
+        return 27;
+    }
+
+    //read var,item地址的数据为0
+    if (req[17] == 0x04) {
+        uint8_t  count = req[18];
+        uint16_t pos   = 21;
+
+        out[19] = 0x04;
+        out[20] = count;
+        for (uint8_t i = 0; i < count; i++) {
+            const uint8_t *item   = req + 19 + i * 12;
+            uint16_t       n_byte = (uint16_t) item[4] << 8 | item[5];
+
+            if (item + 12 > req + len || pos + 4 + n_byte + 1 > BENCH_BUF_SIZE) {
+                return 0;
+            }
+            out[pos]     = 0xFF;
+            out[pos + 1] = 0x04;
+            out[pos + 2] = (n_byte * 8) >> 8;
+            out[pos + 3] = (n_byte * 8) & 0xFF;
+            memset(out + pos + 4, 0, n_byte);
+            pos += 4 + n_byte;
+            if ((n_byte & 1) && i + 1 < count) {
+                out[pos++] = 0;
+            }
+        }
+        plc_header(out, req, pos, 2, pos - 21);
+        return pos;
+    }
+    return 0;
+}
+
+// mock PLC:每个连接一个线程,按TPKT收帧;同一批到达的请求合并成一次write
+static void *plc_conn(void *arg)
+{
+    int      fd    = (int) (intptr_t) arg;
+    uint8_t *frame = malloc(BENCH_BUF_SIZE);
+    uint8_t *out   = malloc(BENCH_BUF_SIZE * 2);
+
+    for (;;) {
+        size_t   n   = 0;
+        uint16_t len = 0;
+
+        do {
+            if (read_full(fd, frame, 4) < 0) {
+                goto done;
+            }
+            len = (frame[2] << 8) | frame[3];
+            if (len < 4 || len > BENCH_BUF_SIZE ||
+                read_full(fd, frame + 4, len - 4) < 0) {
+                goto done;
+            }
+            n += plc_answer(frame, len, out + n);
+        } while (n < BENCH_BUF_SIZE &&
+                 recv(fd, frame, 4, MSG_PEEK | MSG_DONTWAIT) == 4);
+
+        if (n > 0 && write(fd, out, n) != (ssize_t) n) {
+            break;
+        }
+    }
+done:
+    close(fd);
+    free(frame);
+    free(out);
+    return NULL;
+}
+
+static void *plc_accept(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        pthread_t tid;
+        int       fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+        pthread_create(&tid, NULL, plc_conn, (void *) (intptr_t) fd);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+static void plc_start(void)
+{
+    struct sockaddr_in addr = { 0 };
+    socklen_t          alen = sizeof(addr);
+    pthread_t          tid;
+    int                on = 1;
+
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listenfd, (struct sockaddr *) &addr, sizeof(addr));
+    listen(listenfd, S7_MAX_CONNECTIONS * 2);
+    getsockname(listenfd, (struct sockaddr *) &addr, &alen);
+    port = ntohs(addr.sin_port);
+
+    pthread_create(&tid, NULL, plc_accept, NULL);
+    pthread_detach(tid);
+}
+
+static int32_t bench_db_size(void *ctx, uint16_t dbnumber)
+{
+    (void) ctx;
+    (void) dbnumber;
+    return 0;
+}
+
+//n_item个互不相邻的DBW,规划为一个cmd
+static s7_read_cmd_sort_t *bench_plan(s7_point_t *points)
+{
+    s7_plan_param_t param = {
+        .pdu_size = BENCH_PDU_SIZE,
+        .gap      = 0,
+        .db_size  = bench_db_size,
+    };
+    UT_array *          tags = NULL;
+    s7_read_cmd_sort_t *cs   = NULL;
+
+    utarray_new(tags, &ut_ptr_icd);
+    for (int i = 0; i < n_item; i++) {
+        char          address[32] = { 0 };
+        neu_datatag_t tag         = {
+            .name    = "t",
+            .address = address,
+            .type    = NEU_TYPE_INT16,
+        };
+        s7_point_t *p = &points[i];
+
+        snprintf(address, sizeof(address), "DB1.DBW%d", 1 + i * 4);
+        if (s7_tag_to_point(&tag, p) != NEU_ERR_SUCCESS) {
+            utarray_free(tags);
+            return NULL;
+        }
+        utarray_push_back(tags, &p);
+    }
+    cs = s7_tag_sort(tags, &param);
+    utarray_free(tags);
+    return cs;
+}
+
+//在途请求尽量填满协商的并行job数,持会话锁调用
+static void bench_fill(struct bench_link *bl, s7_read_cmd_t *cmd)
+{
+    s7_stack_t *stack = bl->link->stack;
+
+    while (bl->sent < n_req && s7_stack_can_send(stack)) {
+        uint16_t response_size = 0;
+        if (s7_stack_read(stack, stack->ctx, cmd, bl, &response_size) <= 0) {
+            s7_link_fail(bl->link);
+            return;
+        }
+        bl->sent++;
+    }
+}
+
+//替换stack的value_fn,在接收线程(events或io_uring reaper)中续发
+static int bench_value(void *ctx, void *user, s7_read_cmd_t *cmd,
+                       uint8_t item_idx, uint16_t n_byte, uint8_t *bytes,
+                       int error)
+{
+    struct bench_link *bl = (struct bench_link *) user;
+    (void) ctx;
+    (void) n_byte;
+    (void) bytes;
+
+    if (bl == NULL || cmd == NULL || item_idx + 1 < cmd->item_num) {
+        return 0;
+    }
+
+    bl->done++;
+    bench_fill(bl, cmd);
+
+    pthread_mutex_lock(&bench_mtx);
+    bench_done++;
+    bench_errors += error != NEU_ERR_SUCCESS;
+    pthread_cond_signal(&bench_cond);
+    pthread_mutex_unlock(&bench_mtx);
+    return 0;
+}
+
+static bool bench_handshake(s7_session_t *session)
+{
+    int64_t deadline = neu_time_ms() + BENCH_TIMEOUT_MS;
+
+    while (neu_time_ms() < deadline) {
+        bool ready = true;
+
+        pthread_mutex_lock(&session->mtx);
+        for (uint8_t i = 0; i < session->n_link; i++) {
+            int ret = s7_stack_Handshake(session->links[i].stack);
+            if (ret < 0) {
+                s7_link_fail(&session->links[i]);
+            }
+            ready = ready && ret == 0;
+        }
+        pthread_mutex_unlock(&session->mtx);
+
+        if (ready) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+//返回每秒完成的请求数,io_uring不可用时返回0
+static double bench_run(s7_transport_e transport, s7_read_cmd_t *cmd)
+{
+    neu_plugin_t *   plugin = calloc(1, sizeof(neu_plugin_t));
+    neu_conn_param_t param  = { 0 };
+    s7_session_t *   session = NULL;
+    uint64_t         total   = n_req * n_conn;
+    int64_t          start   = 0;
+    int64_t          elapsed = 0;
+
+    param.type                      = NEU_CONN_TCP_CLIENT;
+    param.params.tcp_client.ip      = "127.0.0.1";
+    param.params.tcp_client.port    = port;
+    param.params.tcp_client.timeout = BENCH_TIMEOUT_MS;
+
+    session = s7_session_get(plugin, &param, n_conn, 0, 1, BENCH_PDU_SIZE,
+                             transport,
+                             shared ? S7_REACTOR_SHARED : S7_REACTOR_DEDICATED);
+    if (transport == S7_TRANSPORT_IO_URING && session->uring == NULL) {
+        s7_session_put(session, plugin);
+        free(plugin);
+        return 0;
+    }
+    s7_session_start(session);
+    if (!bench_handshake(session)) {
+        fprintf(stderr, "handshake with mock PLC failed\n");
+        exit(1);
+    }
+
+    bench_done   = 0;
+    bench_errors = 0;
+    start        = bench_now_us();
+    pthread_mutex_lock(&session->mtx);
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        bench_links[i] = (struct bench_link) { .link = &session->links[i] };
+        session->links[i].stack->value_fn = bench_value;
+        bench_fill(&bench_links[i], cmd);
+    }
+    s7_session_flush(session);
+    pthread_mutex_unlock(&session->mtx);
+
+    pthread_mutex_lock(&bench_mtx);
+    while (bench_done < total) {
+        struct timespec ts   = { 0 };
+        uint64_t        done = bench_done;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += BENCH_TIMEOUT_MS / 1000;
+        pthread_cond_timedwait(&bench_cond, &bench_mtx, &ts);
+        if (bench_done == done) {
+            fprintf(stderr, "no response for %d ms, %" PRIu64 "/%" PRIu64 "\n",
+                    BENCH_TIMEOUT_MS, done, total);
+            exit(1);
+        }
+    }
+    pthread_mutex_unlock(&bench_mtx);
+    elapsed = bench_now_us() - start;
+
+    if (bench_errors > 0) {
+        fprintf(stderr, "%" PRIu64 " requests failed\n", bench_errors);
+    }
+    s7_session_stop(session);
+    s7_session_put(session, plugin);
+    free(plugin);
+    return (double) total * 1000000 / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    s7_point_t *        points = NULL;
+    s7_read_cmd_sort_t *cs     = NULL;
+    int                 opt    = 0;
+
+    while ((opt = getopt(argc, argv, "c:d:n:i:s")) != -1) {
+        switch (opt) {
+        case 'c':
+            n_conn = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'n':
+            n_req = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            n_item = atoi(optarg);
+            break;
+        case 's':
+            shared = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c connections] [-d depth] "
+                            "[-n requests] [-i items] [-s]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (n_conn < 1 || n_conn > S7_MAX_CONNECTIONS || depth < 1 ||
+        depth > S7_MAX_PARALLEL_JOBS || n_item < 1 || n_item > MaxVars) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    points = calloc(n_item, sizeof(s7_point_t));
+    cs     = bench_plan(points);
+    if (cs == NULL || cs->n_cmd != 1) {
+        fprintf(stderr, "%d items do not fit one request\n", n_item);
+        return 1;
+    }
+
+    plc_start();
+    printf("connections: %d, depth: %d, items: %d, requests/conn: %" PRIu64
+           ", reactor: %s\n",
+           n_conn, depth, n_item, n_req, shared ? "shared" : "dedicated");
+    printf("epoll:    %.0f req/s\n", bench_run(S7_TRANSPORT_EPOLL, cs->cmd));
+    double uring = bench_run(S7_TRANSPORT_IO_URING, cs->cmd);
+    if (uring > 0) {
+        printf("io_uring: %.0f req/s\n", uring);
+    } else {
+        printf("io_uring: unavailable\n");
+    }
+
+    s7_tag_sort_free(cs);
+    free(points);
+    return 0;
+}
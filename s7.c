@@ -17,6 +17,7 @@
  * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  **/
 #include <assert.h>
+#include <stddef.h>
 #include <netinet/in.h>
 
 #include <neuron.h>
@@ -102,55 +103,60 @@ const longword IsoFrameSize    = IsoPayload_Size+DataHeaderSize;
 
 	// int BuildControlPDU(TIsoControlPDU *pIsoControlPDU);
 
-word SrcTSap = 0x0100;  // Source TSAP
-word DstTSap = 0x0100;  // Destination TSAP RemoteTSAP = (0x01<<8)+(Rack*0x20)+Slot;
-word SrcRef  = 0x0100;   // Source Reference
-word DstRef  = 0x0000;   // Destination Reference
-word cntword = 0x0001;   // Counter for PDU sequence
-
-bool LittleEndian = true; // Little Endian by default
-int IsoPDUSize = 1024;
-int LastIsoError;
-int LastTcpError;
-
+void s7_proto_ctx_init(s7_proto_ctx_t *ctx, uint8_t rack, uint8_t slot)
+{
+    ctx->SrcTSap      = 0x0100;
+    ctx->DstTSap      = (0x01 << 8) + (rack * 0x20) + slot;
+    ctx->SrcRef       = 0x0100;
+    ctx->DstRef       = 0x0000;
+    ctx->cntword      = 0x0001;
+    ctx->PDURequest   = 960;
+    ctx->IsoPDUSize   = 1024;
+    ctx->LastIsoError = 0;
+}
 
-void s7_cotp_con_warap(neu_protocol_pack_buf_t *buf,uint8_t *base)
+//以下wrap直接把请求帧编码进base,base的容量由buf初始化时的size给出
+//返回帧长度,<0表示容量或PDU不足,帧未生成
+int s7_cotp_con_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base)
 {
-    TIsoControlPDU pdu;
-    int ret_size = s7_stack_BuildControlPDU(&pdu);
-    // printf("cotp connection build size:%d\n",ret_size);
-    memcpy(base, &pdu, ret_size);
-    buf->size = ret_size;
-    buf->offset = 0;
+    int ret_size = s7_stack_BuildControlPDU(ctx,base,buf->size);
+    if (ret_size > 0) {
+        buf->size = ret_size;
+        buf->offset = 0;
+    }
+    return ret_size;
 }
 
-void s7_s7com_con_warap(neu_protocol_pack_buf_t *buf,uint8_t *base)
+int s7_s7com_con_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base)
 {
-    TIsoDataPDU pdu;
-    int ret_size = s7_stack_NegotiatePDU(&pdu);
-    // printf("cotp s7 comm build size:%d\n",ret_size);
-    memcpy(base, &pdu, ret_size);
-    buf->size = ret_size;
-    buf->offset = 0;
+    int ret_size = s7_stack_NegotiatePDU(ctx,base,buf->size);
+    if (ret_size > 0) {
+        buf->size = ret_size;
+        buf->offset = 0;
+    }
+    return ret_size;
 }
-void s7_s7com_multiread_warap(neu_protocol_pack_buf_t *buf,uint8_t *base,s7_read_cmd_t *cmd,uint16_t pdu_size)
+
+int s7_s7com_multiread_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base,s7_read_cmd_t *cmd,uint16_t pdu_size)
 {
-    TIsoDataPDU pdu;
-    int ret_size = s7_stack_ReadMultiVars(&pdu,cmd,pdu_size);
-    memcpy(base, &pdu, ret_size);
-    buf->size = ret_size;
-    buf->offset = 0;
+    int ret_size = s7_stack_ReadMultiVars(ctx,base,buf->size,cmd,pdu_size);
+    if (ret_size > 0) {
+        buf->size = ret_size;
+        buf->offset = 0;
+    }
+    return ret_size;
 }
 
-void s7_s7com_mutilwrite_warap(neu_protocol_pack_buf_t *buf,uint8_t *base,uint16_t dbnumber,
+int s7_s7com_mutilwrite_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base,uint16_t dbnumber,
                        enum s7_area area, uint16_t start_address,
                        uint16_t n_reg, uint8_t *bytes,uint16_t pdu_size)
 {
-    TIsoDataPDU pdu;
-    int ret_size = s7_stack_WriteMultiVars(&pdu,dbnumber,area,start_address,n_reg,bytes,pdu_size);
-    memcpy(base, &pdu, ret_size);
-    buf->size = ret_size;
-    buf->offset = 0;
+    int ret_size = s7_stack_WriteMultiVars(ctx,base,buf->size,dbnumber,area,start_address,n_reg,bytes,pdu_size);
+    if (ret_size > 0) {
+        buf->size = ret_size;
+        buf->offset = 0;
+    }
+    return ret_size;
 }
 
 static uint16_t calcrc(uint8_t *buf, int len)
@@ -289,33 +295,76 @@ int  s7_res_read_param_unwrap(neu_protocol_unpack_buf_t *buf, TResFunReadParams
     return 0;
 }
 
-int  s7_res_read_item_unwrap(neu_protocol_unpack_buf_t *buf, TResFunReadItem *param)
-{  
-    int item_header = 4; //读取数据的每个item的头部大小
-    TResFunReadItem *tmp = (TResFunReadItem *) neu_protocol_unpack_buf(buf, item_header);
-    if (tmp == NULL) {
-        return -1;
+//item数据的字节数:octet/real的长度单位是字节,其余是位,不足一字节按一字节
+static uint16_t s7_res_item_bytes(uint8_t transport_size, uint16_t length)
+{
+    if (transport_size == TS_ResOctet || transport_size == TS_ResReal) {
+        return length;
     }
+    return (length + 7) >> 3;
+}
 
-    param->DataLength = ntohs(tmp->DataLength);
-    param->ReturnCode = tmp->ReturnCode;
-    param->TransportSize = tmp->TransportSize;
+//先校验整条读应答再取数据:item数与请求一致,每个item的头和数据都在应答范围内,
+//成功数据的长度不超过请求;奇数长度的item后面有1字节填充(最后一个item除外)
+//校验通过后buf移到item之后,用s7_res_read_next按顺序取各item
+int s7_res_read_check(neu_protocol_unpack_buf_t *buf, const s7_read_cmd_t *cmd,
+                      s7_read_res_t *res)
+{
+    TResFunReadParams *param = (TResFunReadParams *) neu_protocol_unpack_buf(
+        buf, sizeof(TResFunReadParams));
+    if (param == NULL) {
+        return -1;
+    }
+    if (param->ItemCount != cmd->item_num) {
+        return -2;
+    }
 
-    int offset = 0;
-    if ((param->TransportSize != TS_ResOctet) && (param->TransportSize != TS_ResReal) && (param->TransportSize != TS_ResBit))
-        offset += (param->DataLength >> 3);
-    else
-    {
-        //TODO 检查,DataLength是bit数 
-        offset += (param->DataLength/8+param->DataLength%8?1:0);
+    uint8_t *pos = buf->base + buf->offset;
+    uint8_t *end = buf->base + buf->size;
+    for (uint8_t i = 0; i < cmd->item_num; i++) {
+        if (end - pos < 4) {
+            return -1;
+        }
+        uint16_t n_byte = s7_res_item_bytes(pos[1], (uint16_t) pos[2] << 8 | pos[3]);
+        if (pos[0] == 0xFF && n_byte > cmd->item[i].n_register) {
+            return -1;
+        }
+        pos += 4;
+        if (end - pos < n_byte) {
+            return -1;
+        }
+        pos += n_byte;
+        if ((n_byte & 1) && i + 1 < cmd->item_num) {
+            pos++;
+        }
     }
-        
-    memcpy(param->Data, tmp->Data, offset);
-    buf->offset += offset;
-        
+
+    res->pos  = buf->base + buf->offset;
+    res->left = cmd->item_num;
+    buf->offset = pos - buf->base;
     return 0;
 }
 
+//取下一个item的视图,数据直接指向接收缓冲;没有剩余item时返回false
+bool s7_res_read_next(s7_read_res_t *res, s7_read_view_t *view)
+{
+    if (res->left == 0) {
+        return false;
+    }
+
+    view->ret    = res->pos[0];
+    view->n_byte = s7_res_item_bytes(res->pos[1],
+                                     (uint16_t) res->pos[2] << 8 | res->pos[3]);
+    view->data   = res->pos + 4;
+
+    res->pos += 4 + view->n_byte;
+    res->left--;
+    if ((view->n_byte & 1) && res->left > 0) {
+        res->pos++;
+    }
+    return true;
+}
+
 int  s7_res_write_item_unwrap(neu_protocol_unpack_buf_t *buf, byte *param,int item_cnt)
 {
     int offset = item_cnt;
@@ -476,25 +525,11 @@ const char *s7_area_to_str(s7_area_e area)
 }
 
 
-//暂定rack 0/slot 1 DstTSap = 0x0100
-int s7_stack_BuildControlPDU(TIsoControlPDU *pIsoControlPDU)
+//TSAP由s7_proto_ctx_init按rack/slot计算
+int s7_stack_BuildControlPDU(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size)
 {
 	int ParLen, IsoLen;
-	pIsoControlPDU->COTP.Params.PduSizeCode=0xC0; // code that identifies TPDU size
-	pIsoControlPDU->COTP.Params.PduSizeLen =0x01; // 1 byte this field
-	pIsoControlPDU->COTP.Params.PduSizeVal =0x0A;
-	// Build TSAPs
-	pIsoControlPDU->COTP.Params.TSAP[0]=0xC1;   // code that identifies source TSAP
-	pIsoControlPDU->COTP.Params.TSAP[1]=2;      // source TSAP Len
-	pIsoControlPDU->COTP.Params.TSAP[2]=(SrcTSap>>8) & 0xFF; // HI part
-	pIsoControlPDU->COTP.Params.TSAP[3]=SrcTSap & 0xFF; // LO part
-
-    // word RemoteTSAP = (0x01<<8)+(Rack*0x20)+Slot;
-
-	pIsoControlPDU->COTP.Params.TSAP[4]=0xC2; // code that identifies dest TSAP
-	pIsoControlPDU->COTP.Params.TSAP[5]=2;    // dest TSAP Len
-	pIsoControlPDU->COTP.Params.TSAP[6]=(DstTSap>>8) & 0xFF; // HI part
-	pIsoControlPDU->COTP.Params.TSAP[7]=DstTSap & 0xFF; // LO part
+	PIsoControlPDU pIsoControlPDU = (PIsoControlPDU)frame;
 
 	// Params length
 	ParLen=11;            // 2 Src TSAP (Code+field Len)      +
@@ -506,6 +541,24 @@ int s7_stack_BuildControlPDU(TIsoControlPDU *pIsoControlPDU)
 	IsoLen=sizeof(TTPKT)+ // TPKT Header
 			7 +           // COTP Header Size without params
 			ParLen;       // COTP params
+	if (IsoLen>frame_size)
+		return -3;
+
+	pIsoControlPDU->COTP.Params.PduSizeCode=0xC0; // code that identifies TPDU size
+	pIsoControlPDU->COTP.Params.PduSizeLen =0x01; // 1 byte this field
+	pIsoControlPDU->COTP.Params.PduSizeVal =0x0A;
+	// Build TSAPs
+	pIsoControlPDU->COTP.Params.TSAP[0]=0xC1;   // code that identifies source TSAP
+	pIsoControlPDU->COTP.Params.TSAP[1]=2;      // source TSAP Len
+	pIsoControlPDU->COTP.Params.TSAP[2]=(ctx->SrcTSap>>8) & 0xFF; // HI part
+	pIsoControlPDU->COTP.Params.TSAP[3]=ctx->SrcTSap & 0xFF; // LO part
+
+    // word RemoteTSAP = (0x01<<8)+(Rack*0x20)+Slot;
+
+	pIsoControlPDU->COTP.Params.TSAP[4]=0xC2; // code that identifies dest TSAP
+	pIsoControlPDU->COTP.Params.TSAP[5]=2;    // dest TSAP Len
+	pIsoControlPDU->COTP.Params.TSAP[6]=(ctx->DstTSap>>8) & 0xFF; // HI part
+	pIsoControlPDU->COTP.Params.TSAP[7]=ctx->DstTSap & 0xFF; // LO part
 
 	pIsoControlPDU->TPKT.Version  =0x3; // RFC 1006
 	pIsoControlPDU->TPKT.Reserved =0;
@@ -515,130 +568,122 @@ int s7_stack_BuildControlPDU(TIsoControlPDU *pIsoControlPDU)
 
 	pIsoControlPDU->COTP.HLength  =ParLen + 6;  // <-- 6 = 7 - 1 (COTP Header size - 1)
 	pIsoControlPDU->COTP.PDUType  =pdu_type_CR; // Connection Request
-	pIsoControlPDU->COTP.DstRef   =DstRef;      // Destination reference
-	pIsoControlPDU->COTP.SrcRef   =SrcRef;      // Source reference
+	pIsoControlPDU->COTP.DstRef   =ctx->DstRef;      // Destination reference
+	pIsoControlPDU->COTP.SrcRef   =ctx->SrcRef;      // Source reference
 	pIsoControlPDU->COTP.CO_R     =0x00;        // Class + Option : RFC0983 states that it must be always 0x40
 											// but for some equipment (S7) must be 0 in disaccord of specifications !!!
 
-                                            
-    int pIsoControlPDU_size = pIsoControlPDU->TPKT.HI_Lenght*256+pIsoControlPDU->TPKT.LO_Lenght;
-    // printf("pIsoControlPDU pIsoControlPDU_size %d\n", pIsoControlPDU_size);
-	return pIsoControlPDU_size;
+	return IsoLen;
+}
+
+//TPKT+COTP DT头,IsoSize为整帧长度
+static void s7_iso_dt_header(PIsoDataPDU pIsoDataPDU,int IsoSize)
+{
+	pIsoDataPDU->TPKT.Version  = isoTcpVersion;
+	pIsoDataPDU->TPKT.Reserved = 0;
+	pIsoDataPDU->TPKT.HI_Lenght= ((u_short)(IsoSize)>> 8) & 0xFF;
+	pIsoDataPDU->TPKT.LO_Lenght= (u_short)(IsoSize) & 0xFF;
+	// COPT
+	pIsoDataPDU->COTP.HLength   =sizeof(S7_TCOTP_DT)-1;
+	pIsoDataPDU->COTP.PDUType   =pdu_type_DT;
+	pIsoDataPDU->COTP.EoT_Num   =pdu_EoT;
 }
 
-int s7_stack_NegotiatePDU(TIsoDataPDU *pIsoDataPDU)
+int s7_stack_NegotiatePDU(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size)
 {
-    word PDURequest = 960;
-    PReqFunNegotiateParams ReqNegotiate;
+    word PDURequest = ctx->PDURequest;
+    PIsoDataPDU pIsoDataPDU = (PIsoDataPDU)frame;
+    int S7pduSize = sizeof( TS7ResHeader17 ) + sizeof( TReqFunNegotiateParams );
+    int IsoSize = S7pduSize+DataHeaderSize;
+    if (IsoSize>frame_size)
+        return -3;
 
-    TS7Answer17 DUH_out;
-    // Setup Pointers
-    ReqNegotiate = (PReqFunNegotiateParams)((pbyte)(&DUH_out) + sizeof(TS7ResHeader17));
+    PS7ResHeader17 Header = (PS7ResHeader17)pIsoDataPDU->Payload;
+    PReqFunNegotiateParams ReqNegotiate =
+        (PReqFunNegotiateParams)(pIsoDataPDU->Payload + sizeof(TS7ResHeader17));
 
     // Header
-    DUH_out.Header.P        = 0x32;            // Always $32
-    DUH_out.Header.PDUType  = 0x01; // $01
-    DUH_out.Header.AB_EX    = 0x0000;          // Always $0000
-    DUH_out.Header.Sequence = GetNextWord();   // AutoInc
-    DUH_out.Header.ParLen   = SwapWord(sizeof(TReqFunNegotiateParams)); // 8 bytes
-    DUH_out.Header.DataLen  = 0x0000;
+    Header->P        = 0x32;            // Always $32
+    Header->PDUType  = 0x01; // $01
+    Header->AB_EX    = 0x0000;          // Always $0000
+    Header->Sequence = GetNextWord(ctx);   // AutoInc
+    Header->ParLen   = SwapWord(sizeof(TReqFunNegotiateParams)); // 8 bytes
+    Header->DataLen  = 0x0000;
     // Params
     ReqNegotiate->FunNegotiate = 0xF0;
     ReqNegotiate->Unknown = 0x00;
-    ReqNegotiate->ParallelJobs_1 = 0x0100;
-    ReqNegotiate->ParallelJobs_2 = 0x0100;
+    ReqNegotiate->ParallelJobs_1 = SwapWord(S7_MAX_PARALLEL_JOBS);
+    ReqNegotiate->ParallelJobs_2 = SwapWord(S7_MAX_PARALLEL_JOBS);
     ReqNegotiate->PDULength = SwapWord(PDURequest);
-    int S7pduSize = sizeof( TS7ResHeader17 ) + sizeof( TReqFunNegotiateParams );
 
-    u_int IsoSize =S7pduSize+DataHeaderSize;
-	if ((IsoSize>0) && (IsoSize<=IsoFrameSize))
-	{
-		pIsoDataPDU->TPKT.Version  = isoTcpVersion;
-		pIsoDataPDU->TPKT.Reserved = 0;
-		pIsoDataPDU->TPKT.HI_Lenght= ((u_short)(IsoSize)>> 8) & 0xFF;
-		pIsoDataPDU->TPKT.LO_Lenght= (u_short)(IsoSize) & 0xFF;
-		// COPT
-		pIsoDataPDU->COTP.HLength   =sizeof(S7_TCOTP_DT)-1;
-		pIsoDataPDU->COTP.PDUType   =pdu_type_DT;
-		pIsoDataPDU->COTP.EoT_Num   =pdu_EoT;
-		// Fill payload
-
-		memcpy(pIsoDataPDU->Payload, &DUH_out, IsoSize);
-	}
+    s7_iso_dt_header(pIsoDataPDU,IsoSize);
     return IsoSize;
 }
 
-int s7_stack_ReadMultiVars(TIsoDataPDU *pIsoDataPDU,s7_read_cmd_t *cmd,uint16_t pdu_size)
+//pdu_size为协商得到的S7 PDU长度,不含TPKT/COTP头
+int s7_stack_ReadMultiVars(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size,s7_read_cmd_t *cmd,uint16_t pdu_size)
 {
     int ItemsCount = cmd->item_num;
-    if (ItemsCount>MaxVars)
+    if (ItemsCount<=0)
     	return -1;
 
-    TReqFunReadParams ReqParams;
-    word       RPSize    = (word)(2 + ItemsCount * sizeof(TReqFunReadItem));
-    
+    word RPSize  = (word)(2 + ItemsCount * sizeof(TReqFunReadItem));
+    int  IsoSize = RPSize+sizeof(TS7ReqHeader)+DataHeaderSize;
+	if (IsoSize-(int)DataHeaderSize>pdu_size)
+		return -2;
+	if (IsoSize>frame_size)
+		return -3;
+
+    PIsoDataPDU       pIsoDataPDU = (PIsoDataPDU)frame;
+    PS7ReqHeader      ReqHeader   = (PS7ReqHeader)pIsoDataPDU->Payload;
+    PReqFunReadParams ReqParams   =
+        (PReqFunReadParams)(pIsoDataPDU->Payload + sizeof(TS7ReqHeader));
+
     // Fill Header
-    TS7ReqHeader ReqHeader;
-    ReqHeader.P=0x32;                    // Always 0x32
-    ReqHeader.PDUType=0x01;              // 0x01
-    ReqHeader.AB_EX=0x0000;              // Always 0x0000
-    ReqHeader.Sequence=GetNextWord();    // AutoInc
-    ReqHeader.ParLen=SwapWord(RPSize);   // Request params size
-    ReqHeader.DataLen=0x0000;            // No data in output
+    ReqHeader->P=0x32;                    // Always 0x32
+    ReqHeader->PDUType=0x01;              // 0x01
+    ReqHeader->AB_EX=0x0000;              // Always 0x0000
+    ReqHeader->Sequence=GetNextWord(ctx);    // AutoInc
+    ReqHeader->ParLen=SwapWord(RPSize);   // Request params size
+    ReqHeader->DataLen=0x0000;            // No data in output
 
     // Fill Params
-    ReqParams.FunRead=pduFuncRead;      // 0x04
-    ReqParams.ItemsCount=ItemsCount;
+    ReqParams->FunRead=pduFuncRead;      // 0x04
+    ReqParams->ItemsCount=ItemsCount;
 
     int c;
+    //item数可以超过MaxVars,按帧内偏移定位,不使用Items[MaxVars]数组下标
     for (c = 0; c < ItemsCount; c++)
     {
-        ReqParams.Items[c].ItemHead[0]=0x12;
-        ReqParams.Items[c].ItemHead[1]=0x0A;
-        ReqParams.Items[c].ItemHead[2]=0x10;
+        PReqFunReadItem Item = (PReqFunReadItem)((pbyte)ReqParams + 2 +
+                                                 c * sizeof(TReqFunReadItem));
 
-        ReqParams.Items[c].TransportSize=S7WLByte;
-        ReqParams.Items[c].Length=SwapWord(cmd->item[c].n_register);
-        ReqParams.Items[c].Area=cmd->item[c].area;
+        Item->ItemHead[0]=0x12;
+        Item->ItemHead[1]=0x0A;
+        Item->ItemHead[2]=0x10;
+
+        Item->TransportSize=S7WLByte;
+        Item->Length=SwapWord(cmd->item[c].n_register);
+        Item->Area=cmd->item[c].area;
         // TODO目前认为 dbnumber会拆tag
-        ReqParams.Items[c].DBNumber=SwapWord(cmd->item[c].dbnumber);
+        Item->DBNumber=SwapWord(cmd->item[c].dbnumber);
 
         // Adjusts the offset
         longword   Address = cmd->item[c].start_address*8;
 
         // Builds the offset
-        ReqParams.Items[c].Address[2]=Address & 0x000000FF;
+        Item->Address[2]=Address & 0x000000FF;
         Address=Address >> 8;
-        ReqParams.Items[c].Address[1]=Address & 0x000000FF;
+        Item->Address[1]=Address & 0x000000FF;
         Address=Address >> 8;
-        ReqParams.Items[c].Address[0]=Address & 0x000000FF;
-        // Item++;
+        Item->Address[0]=Address & 0x000000FF;
     };
 
-    int IsoSize = RPSize+sizeof(TS7ReqHeader)+DataHeaderSize;
-	if (IsoSize>pdu_size)
-		return -2;
-
-	if ((IsoSize>0) && (IsoSize<=(int)IsoFrameSize))
-	{
-		pIsoDataPDU->TPKT.Version  = isoTcpVersion;
-		pIsoDataPDU->TPKT.Reserved = 0;
-		pIsoDataPDU->TPKT.HI_Lenght= ((u_short)(IsoSize)>> 8) & 0xFF;
-		pIsoDataPDU->TPKT.LO_Lenght= (u_short)(IsoSize) & 0xFF;
-		// COPT
-		pIsoDataPDU->COTP.HLength   =sizeof(S7_TCOTP_DT)-1;
-		pIsoDataPDU->COTP.PDUType   =pdu_type_DT;
-		pIsoDataPDU->COTP.EoT_Num   =pdu_EoT;
-		// Fill payload
-
-		memcpy(pIsoDataPDU->Payload,(pbyte)&ReqHeader,sizeof(TS7ReqHeader));
-		memcpy(pIsoDataPDU->Payload+sizeof(TS7ReqHeader),(pbyte)&ReqParams, RPSize);
-	}
-
+    s7_iso_dt_header(pIsoDataPDU,IsoSize);
     return IsoSize;
 }
 
-int s7_stack_WriteMultiVars(TIsoDataPDU *pIsoDataPDU,uint16_t dbnumber,
+int s7_stack_WriteMultiVars(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size,uint16_t dbnumber,
                        enum s7_area area, uint16_t start_address,
                        uint16_t n_reg, uint8_t *bytes,uint16_t pdu_size)
 {
@@ -650,7 +695,6 @@ int s7_stack_WriteMultiVars(TIsoDataPDU *pIsoDataPDU,uint16_t dbnumber,
     Item.WordLen = S7WLByte;
     Item.pdata = bytes;
 
-    TReqFunWriteParams  ReqParams;
     uintptr_t          Offset;
     longword           Address;
     int                ItemsCount, c;
@@ -665,38 +709,53 @@ int s7_stack_WriteMultiVars(TIsoDataPDU *pIsoDataPDU,uint16_t dbnumber,
 
     RPSize    = (word)(2 + ItemsCount * sizeof(TReqFunWriteItem));
 
+    //先按数据长度算出整帧大小,PDU或缓冲不足时不生成
+    WordSize=DataSizeByte(Item.WordLen);
+    Size=Item.Amount * WordSize;
+    int IsoSize=RPSize+sizeof(TS7ReqHeader)+ItemsCount*4+Size+DataHeaderSize;
+	if (IsoSize-(int)DataHeaderSize>pdu_size)
+		return -2;
+	if (IsoSize>frame_size)
+		return -3;
+
+    PIsoDataPDU        pIsoDataPDU = (PIsoDataPDU)frame;
+    PS7ReqHeader       ReqHeader   = (PS7ReqHeader)pIsoDataPDU->Payload;
+    PReqFunWriteParams ReqParams   =
+        (PReqFunWriteParams)(pIsoDataPDU->Payload + sizeof(TS7ReqHeader));
+    pbyte              ReqData     =
+        pIsoDataPDU->Payload + sizeof(TS7ReqHeader) + RPSize;
+
     // Fill Header
-    TS7ReqHeader ReqHeader;
-    ReqHeader.P=0x32;                    // Always 0x32
-    ReqHeader.PDUType=PduType_request;              // 0x01
-    ReqHeader.AB_EX=0x0000;              // Always 0x0000
-    ReqHeader.Sequence=GetNextWord();    // AutoInc
-    ReqHeader.ParLen=SwapWord(RPSize);   // Request params size
-    ReqHeader.DataLen=0x0000;            // No data in output
+    ReqHeader->P=0x32;                    // Always 0x32
+    ReqHeader->PDUType=PduType_request;              // 0x01
+    ReqHeader->AB_EX=0x0000;              // Always 0x0000
+    ReqHeader->Sequence=GetNextWord(ctx);    // AutoInc
+    ReqHeader->ParLen=SwapWord(RPSize);   // Request params size
+    ReqHeader->DataLen=0x0000;            // No data in output
 
     // Fill Params
-    ReqParams.FunWrite=pduFuncWrite;      // 0x05
-    ReqParams.ItemsCount=ItemsCount;
+    ReqParams->FunWrite=pduFuncWrite;      // 0x05
+    ReqParams->ItemsCount=ItemsCount;
 
     Offset=0;
 
-    TReqFunWriteDataItem ReqData[MaxVars];
-
     for (c = 0; c < ItemsCount; c++)
     {
+        PReqFunWriteDataItem Data = (PReqFunWriteDataItem)(ReqData + Offset);
+
         // Items Params
-        ReqParams.Items[c].ItemHead[0]=0x12;
-        ReqParams.Items[c].ItemHead[1]=0x0A;
-        ReqParams.Items[c].ItemHead[2]=0x10;
+        ReqParams->Items[c].ItemHead[0]=0x12;
+        ReqParams->Items[c].ItemHead[1]=0x0A;
+        ReqParams->Items[c].ItemHead[2]=0x10;
 
-        ReqParams.Items[c].TransportSize=Item.WordLen;
-        ReqParams.Items[c].Length=SwapWord(Item.Amount);
-        ReqParams.Items[c].Area=Item.Area;
+        ReqParams->Items[c].TransportSize=Item.WordLen;
+        ReqParams->Items[c].Length=SwapWord(Item.Amount);
+        ReqParams->Items[c].Area=Item.Area;
 
         if (Item.Area==S7AreaDB)
-            ReqParams.Items[c].DBNumber=SwapWord(Item.DBNumber);
+            ReqParams->Items[c].DBNumber=SwapWord(Item.DBNumber);
         else
-            ReqParams.Items[c].DBNumber=0x0000;
+            ReqParams->Items[c].DBNumber=0x0000;
 
         // Adjusts the offset
         if ((Item.WordLen==S7WLBit) || (Item.WordLen==S7WLCounter) || (Item.WordLen==S7WLTimer))
@@ -704,38 +763,33 @@ int s7_stack_WriteMultiVars(TIsoDataPDU *pIsoDataPDU,uint16_t dbnumber,
         else
         	Address=Item.Start*8;
         // Builds the offset
-        ReqParams.Items[c].Address[2]=Address & 0x000000FF;
+        ReqParams->Items[c].Address[2]=Address & 0x000000FF;
         Address=Address >> 8;
-        ReqParams.Items[c].Address[1]=Address & 0x000000FF;
+        ReqParams->Items[c].Address[1]=Address & 0x000000FF;
         Address=Address >> 8;
-        ReqParams.Items[c].Address[0]=Address & 0x000000FF;
+        ReqParams->Items[c].Address[0]=Address & 0x000000FF;
 
         // Items Data
-        // pbyte P = sizeof(ReqParams)+RPSize;
-        // ReqData[c]=(PReqFunWriteDataItem)((pbyte)(P)+Offset);
-        ReqData[c].ReturnCode=0x00;
+        Data->ReturnCode=0x00;
 
         if (Item.WordLen == S7WLBit) {
-            ReqData[c].TransportSize = TS_ResBit;
+            Data->TransportSize = TS_ResBit;
         } else if (Item.WordLen == S7WLInt || Item.WordLen == S7WLDInt) {
-            ReqData[c].TransportSize = TS_ResInt;
+            Data->TransportSize = TS_ResInt;
         } else if (Item.WordLen == S7WLReal) {
-            ReqData[c].TransportSize = TS_ResReal;
+            Data->TransportSize = TS_ResReal;
         } else if (Item.WordLen == S7WLChar || Item.WordLen == S7WLCounter || Item.WordLen == S7WLTimer) {
-            ReqData[c].TransportSize = TS_ResOctet;
+            Data->TransportSize = TS_ResOctet;
         } else {
-            ReqData[c].TransportSize = TS_ResByte; // byte/word/dword etc.
+            Data->TransportSize = TS_ResByte; // byte/word/dword etc.
         }
 
-        WordSize=DataSizeByte(Item.WordLen);
-        Size=Item.Amount * WordSize;
-
-		if ((ReqData[c].TransportSize!=TS_ResOctet) && (ReqData[c].TransportSize!=TS_ResReal) && (ReqData[c].TransportSize!=TS_ResBit))
-           ReqData[c].DataLength=SwapWord(Size*8);
+		if ((Data->TransportSize!=TS_ResOctet) && (Data->TransportSize!=TS_ResReal) && (Data->TransportSize!=TS_ResBit))
+           Data->DataLength=SwapWord(Size*8);
         else
-           ReqData[c].DataLength=SwapWord(Size);
+           Data->DataLength=SwapWord(Size);
 
-        memcpy(ReqData[c].Data, Item.pdata, Size);
+        memcpy(Data->Data, Item.pdata, Size);
 
 		if ((Size % 2) != 0 && (ItemsCount - c != 1))
 			Size++; // Skip fill byte for Odd frame (except for the last one)
@@ -743,33 +797,102 @@ int s7_stack_WriteMultiVars(TIsoDataPDU *pIsoDataPDU,uint16_t dbnumber,
         Offset+=(4+Size); // next item
     };
 
-    ReqHeader.DataLen=SwapWord((word)(Offset));
+    ReqHeader->DataLen=SwapWord((word)(Offset));
 
-    int IsoSize=RPSize+sizeof(TS7ReqHeader)+(int)(Offset)+DataHeaderSize;
+    s7_iso_dt_header(pIsoDataPDU,IsoSize);
+    return IsoSize;
+}
 
-	if (IsoSize>pdu_size)
-		return -2;
+//userdata请求:读取DB块信息,应答中的MC7Len即DB的字节数
+int s7_stack_BlockInfo(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size,uint16_t dbnumber)
+{
+    int IsoSize = sizeof(TS7ReqHeader)+sizeof(TReqFunGetBlockInfo)+sizeof(TReqDataBlockInfo)+DataHeaderSize;
+    if (IsoSize>frame_size)
+        return -3;
 
-	if ((IsoSize>0) && (IsoSize<=(int)IsoFrameSize))
-	{
-		pIsoDataPDU->TPKT.Version  = isoTcpVersion;
-		pIsoDataPDU->TPKT.Reserved = 0;
-		pIsoDataPDU->TPKT.HI_Lenght= ((u_short)(IsoSize)>> 8) & 0xFF;
-		pIsoDataPDU->TPKT.LO_Lenght= (u_short)(IsoSize) & 0xFF;
-		// COPT
-		pIsoDataPDU->COTP.HLength   =sizeof(S7_TCOTP_DT)-1;
-		pIsoDataPDU->COTP.PDUType   =pdu_type_DT;
-		pIsoDataPDU->COTP.EoT_Num   =pdu_EoT;
-		// Fill payload
-
-		memcpy(pIsoDataPDU->Payload,(pbyte)&ReqHeader,sizeof(TS7ReqHeader));
-		memcpy(pIsoDataPDU->Payload+sizeof(TS7ReqHeader),(pbyte)&ReqParams, RPSize);
-        memcpy(pIsoDataPDU->Payload+sizeof(TS7ReqHeader)+RPSize,(pbyte)ReqData, Offset);
-	}
-    
+    PIsoDataPDU         pIsoDataPDU = (PIsoDataPDU)frame;
+    PS7ReqHeader        ReqHeader   = (PS7ReqHeader)pIsoDataPDU->Payload;
+    PReqFunGetBlockInfo ReqParams   =
+        (PReqFunGetBlockInfo)(pIsoDataPDU->Payload + sizeof(TS7ReqHeader));
+    PReqDataBlockInfo   ReqData     =
+        (PReqDataBlockInfo)(pIsoDataPDU->Payload + sizeof(TS7ReqHeader) + sizeof(TReqFunGetBlockInfo));
+
+    // Fill Header
+    ReqHeader->P=0x32;                    // Always 0x32
+    ReqHeader->PDUType=PduType_userdata;  // 0x07
+    ReqHeader->AB_EX=0x0000;              // Always 0x0000
+    ReqHeader->Sequence=GetNextWord(ctx);    // AutoInc
+    ReqHeader->ParLen=SwapWord(sizeof(TReqFunGetBlockInfo));
+    ReqHeader->DataLen=SwapWord(sizeof(TReqDataBlockInfo));
+    // Fill Params
+    ReqParams->Head[0]=0x00;
+    ReqParams->Head[1]=0x01;
+    ReqParams->Head[2]=0x12;
+    ReqParams->Plen   =0x04;
+    ReqParams->Uk     =0x11;
+    ReqParams->Tg     =S7_GR_BLOCKS_INFO;
+    ReqParams->SubFun =S7_SFUN_BLK_INFO;
+    ReqParams->Seq    =0x00;
+    // Fill Data
+    ReqData->RetVal =0xFF;
+    ReqData->TSize  =TS_ResOctet;
+    ReqData->DataLen=SwapWord(0x0008);
+    ReqData->BlkPrfx=0x30;
+    ReqData->BlkType=S7_BLOCK_DB;
+    for (int i = 4; i >= 0; i--) {
+        ReqData->AsciiBlk[i] = '0' + dbnumber % 10;
+        dbnumber /= 10;
+    }
+    ReqData->A=0x41;
+
+    s7_iso_dt_header(pIsoDataPDU,IsoSize);
     return IsoSize;
 }
 
+int s7_s7com_blockinfo_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base,uint16_t dbnumber)
+{
+    int ret_size = s7_stack_BlockInfo(ctx,base,buf->size,dbnumber);
+    if (ret_size > 0) {
+        buf->size = ret_size;
+        buf->offset = 0;
+    }
+    return ret_size;
+}
+
+//userdata应答头(10字节,没有Error字段)
+int s7_res_header17_unwrap(neu_protocol_unpack_buf_t *buf, TS7ResHeader17 *ps7res_header)
+{
+    TS7ResHeader17 *tmp = (TS7ResHeader17 *) neu_protocol_unpack_buf(buf, sizeof(TS7ResHeader17));
+    if (tmp == NULL) {
+        return -1;
+    }
+    *ps7res_header = *tmp;
+    return 0;
+}
+
+//块信息应答,成功时返回DB的字节数
+int s7_res_blockinfo_unwrap(neu_protocol_unpack_buf_t *buf)
+{
+    TResFunGetBlockInfo *param = (TResFunGetBlockInfo *) neu_protocol_unpack_buf(buf, sizeof(TResFunGetBlockInfo));
+    if (param == NULL) {
+        return -1;
+    }
+    //应答的type为8,group与请求相同
+    if ((param->Tg & 0x0F) != (S7_GR_BLOCKS_INFO & 0x0F)) {
+        return -2;
+    }
+    if (param->ErrNo != 0) {
+        return -3;
+    }
+
+    //只需要解析到MC7Len,之后的作者/版本等字段不同CPU长度不一
+    TResDataBlockInfo *data = (TResDataBlockInfo *) neu_protocol_unpack_buf(buf, offsetof(TResDataBlockInfo, Author));
+    if (data == NULL || data->RetVal != 0xFF) {
+        return -4;
+    }
+    return ntohs(data->MC7Len);
+}
+
 int DataSizeByte(int WordLength)
 {
 	if (WordLength == S7WLBit) {
@@ -797,26 +920,49 @@ int DataSizeByte(int WordLength)
     }
 }
 
-word GetNextWord()
+//取已组好的请求帧(TPKT+COTP+S7 header)中的Sequence,应答中原样返回
+word s7_pdu_sequence_get(uint8_t *frame)
+{
+    TS7ReqHeader *header = (TS7ReqHeader *) (frame + DataHeaderSize);
+    return header->Sequence;
+}
+
+void s7_pdu_sequence_set(uint8_t *frame, word sequence)
+{
+    TS7ReqHeader *header = (TS7ReqHeader *) (frame + DataHeaderSize);
+    header->Sequence     = sequence;
+}
+
+//把读cmd编码成完整的请求帧,Sequence留给发送时填写;不检查PDU,由发送时按协商结果检查
+int s7_read_template(s7_read_cmd_t *cmd, uint8_t *frame, uint16_t frame_size)
+{
+    s7_proto_ctx_t ctx = { 0 };
+    return s7_stack_ReadMultiVars(&ctx, frame, frame_size, cmd, UINT16_MAX);
+}
+
+word GetNextWord(s7_proto_ctx_t *ctx)
 {
-     if (cntword==0xFFFF)
-        cntword=0;
-     return cntword++;
+     if (ctx->cntword==0xFFFF)
+        ctx->cntword=0;
+     return ctx->cntword++;
 }
 
+//主机字节序在编译期确定,不再使用全局的LittleEndian
 word SwapWord(word Value)
 {
-	if (LittleEndian)
-		return  ((Value >> 8) & 0xFF) | ((Value << 8) & 0xFF00);
-	else
-	    return Value;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return  ((Value >> 8) & 0xFF) | ((Value << 8) & 0xFF00);
+#else
+	return Value;
+#endif
 }
 //---------------------------------------------------------------------------
 longword SwapDWord(longword Value)
 {
-	if (LittleEndian)
-		return (Value >> 24) | ((Value << 8) & 0x00FF0000) | ((Value >> 8) & 0x0000FF00) | (Value << 24);
-	else
-		return Value;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return (Value >> 24) | ((Value << 8) & 0x00FF0000) | ((Value >> 8) & 0x0000FF00) | (Value << 24);
+#else
+	return Value;
+#endif
 }
 
@@ -26,14 +26,25 @@
 #include "snap7_isotcp.h"
 #include "snap7_types.h"
 
-/* LL -> LE 1,2,3,4
-   LB -> LE 2,1,4,3
-   BB -> BE 3,4,1,2
-   BL -> BE 4,3,2,1
-   L64 -> 1,2,3,4,5,6,7,8
-   B64 -> 8,7,6,5,4,3,2,1
+/* 地址后缀#XX指定多字节值的字节序,数字为PDU中的字节在小端主机内存中的位置,
+   括号内为PDU中的字节顺序(A为最高字节),没有后缀时按S7默认的大端
+   LL -> LE 1,2,3,4 (DCBA)
+   LB -> LE 2,1,4,3 (CDAB)
+   BB -> BE 3,4,1,2 (BADC)
+   BL -> BE 4,3,2,1 (ABCD)
+   L64 -> 1,2,3,4,5,6,7,8, 地址后缀#L
+   B64 -> 8,7,6,5,4,3,2,1, 地址后缀#B
+   16位值同样用#L/#B
 */
 
+// 协商时请求的并行job数,实际数量以PLC应答为准
+#define S7_MAX_PARALLEL_JOBS 8
+
+// userdata块信息查询: 功能组(type 4 + group 3),子功能,DB块类型
+#define S7_GR_BLOCKS_INFO 0x43
+#define S7_SFUN_BLK_INFO 0x03
+#define S7_BLOCK_DB 0x41
+
 typedef enum s7_action {
     S7_ACTION_DEFAULT        = 0,
     S7_ACTION_HOLD_REG_WRITE = 1
@@ -86,16 +97,54 @@ typedef struct s7_read_item {
     s7_area_e     area;
     uint16_t      start_address;
     uint16_t      n_register;
+    uint32_t      first;   // 该item的tag在cmd->points中的起始下标
+    uint32_t      n_point;
 } s7_read_item_t;
 
+// 每个连接独立的协议上下文,原s7.c中的文件级全局变量
+// 多个S7节点运行在各自线程中,不再共享TSAP和PDU Sequence
+typedef struct s7_proto_ctx {
+    word SrcTSap;      // Source TSAP
+    word DstTSap;      // Destination TSAP (0x01<<8)+(Rack*0x20)+Slot
+    word SrcRef;       // Source Reference
+    word DstRef;       // Destination Reference
+    word cntword;      // Counter for PDU sequence
+    word PDURequest;   // 握手时请求的PDU大小
+    int  IsoPDUSize;   // 协商得到的PDU大小
+    int  LastIsoError; // 最近一次S7应答的错误码
+} s7_proto_ctx_t;
+
+// 一个读PDU,item数由规划时的PDU大小决定,不受MaxVars限制
 typedef struct s7_read_cmd {
     uint8_t       item_num;
     uint8_t       reserve_id;
-    s7_read_item_t item[MaxVars];
+    s7_read_item_t *item;
+
+    struct s7_point **points; // 所属规划的point数组,item按first/n_point取用
+    struct s7_decode_op *ops; // 与points等长,每个item的解码程序
+    uint64_t *           raw; // 与points等长,解码的中间结果
 
-    UT_array **tags; // s7_point_t ptr;
+    uint8_t *req;   // 规划时编码好的读请求帧,发送时只改Sequence;NULL时发送时编码
+    uint16_t n_req;
+    bool     oversize; // 唯一的item超出一个应答PDU,不发送,其tag每周期按读失败上报
 } s7_read_cmd_t;
 
+// 数据帧的TPKT+COTP DT头
+#define S7_ISO_DT_HEADER_SIZE 7
+
+// 读应答中一个item的视图,data指向接收缓冲,不拷贝
+typedef struct s7_read_view {
+    uint8_t  ret; // ReturnCode,0xFF为成功
+    uint16_t n_byte;
+    uint8_t *data;
+} s7_read_view_t;
+
+// 已校验的读应答中尚未取出的item
+typedef struct s7_read_res {
+    uint8_t *pos;
+    uint8_t  left;
+} s7_read_res_t;
+
 // struct S7_TPTK {
 //     uint16_t seq;
 //     uint16_t protocol;
@@ -110,10 +159,11 @@ struct S7_TPTK {
 } __attribute__((packed));
 
 void s7_header_wrap(neu_protocol_pack_buf_t *buf);
-void s7_cotp_con_warap(neu_protocol_pack_buf_t *buf,uint8_t *base);
-void s7_s7com_con_warap(neu_protocol_pack_buf_t *buf,uint8_t *base);
-void s7_s7com_multiread_warap(neu_protocol_pack_buf_t *buf,uint8_t *base,s7_read_cmd_t *cmd,uint16_t pdu_size);
-void s7_s7com_mutilwrite_warap(neu_protocol_pack_buf_t *buf,uint8_t *base,uint16_t dbnumber,
+void s7_proto_ctx_init(s7_proto_ctx_t *ctx, uint8_t rack, uint8_t slot);
+int s7_cotp_con_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base);
+int s7_s7com_con_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base);
+int s7_s7com_multiread_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base,s7_read_cmd_t *cmd,uint16_t pdu_size);
+int s7_s7com_mutilwrite_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base,uint16_t dbnumber,
                        enum s7_area area, uint16_t start_address,
                        uint16_t n_reg, uint8_t *bytes,uint16_t pdu_size);
 
@@ -134,8 +184,12 @@ u_char s7_res_funcode_get(neu_protocol_unpack_buf_t *buf);
 int  s7_res_header23_unwrap(neu_protocol_unpack_buf_t *buf, TS7ResHeader23 *ps7res_header);
 int  s7_res_nego_param_unwrap(neu_protocol_unpack_buf_t *buf, TResFunNegotiateParams *param);
 int  s7_res_read_param_unwrap(neu_protocol_unpack_buf_t *buf, TResFunReadParams *param);
-int  s7_res_read_item_unwrap(neu_protocol_unpack_buf_t *buf, TResFunReadItem *param);
+int  s7_res_read_check(neu_protocol_unpack_buf_t *buf, const s7_read_cmd_t *cmd,
+                       s7_read_res_t *res);
+bool s7_res_read_next(s7_read_res_t *res, s7_read_view_t *view);
 int  s7_res_write_item_unwrap(neu_protocol_unpack_buf_t *buf, byte *param,int item_cnt);
+int  s7_res_header17_unwrap(neu_protocol_unpack_buf_t *buf, TS7ResHeader17 *ps7res_header);
+int  s7_res_blockinfo_unwrap(neu_protocol_unpack_buf_t *buf);
 
 struct s7_address {
     uint16_t start_address;
@@ -165,15 +219,21 @@ void s7_crc_set(neu_protocol_pack_buf_t *buf);
 void s7_crc_wrap(neu_protocol_pack_buf_t *buf);
 int  s7_crc_unwrap(neu_protocol_unpack_buf_t *buf,
                        struct s7_crc *        out_crc);
-int s7_stack_BuildControlPDU(TIsoControlPDU *pIsoControlPDU);
-int s7_stack_NegotiatePDU(TIsoDataPDU *pIsoDataPDU);
-int s7_stack_ReadMultiVars(TIsoDataPDU *pIsoDataPDU,s7_read_cmd_t *cmd,uint16_t pdu_size);
-int s7_stack_WriteMultiVars(TIsoDataPDU *pIsoDataPDU,uint16_t dbnumber,
+// 请求直接编码到frame中,frame_size为frame的容量
+int s7_stack_BuildControlPDU(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size);
+int s7_stack_NegotiatePDU(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size);
+int s7_stack_ReadMultiVars(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size,s7_read_cmd_t *cmd,uint16_t pdu_size);
+int s7_stack_WriteMultiVars(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size,uint16_t dbnumber,
                        enum s7_area area, uint16_t start_address,
                        uint16_t n_reg, uint8_t *bytes, uint16_t pdu_size);
+int s7_stack_BlockInfo(s7_proto_ctx_t *ctx,uint8_t *frame,uint16_t frame_size,uint16_t dbnumber);
+int s7_s7com_blockinfo_warap(s7_proto_ctx_t *ctx,neu_protocol_pack_buf_t *buf,uint8_t *base,uint16_t dbnumber);
 
+word s7_pdu_sequence_get(uint8_t *frame);
+void s7_pdu_sequence_set(uint8_t *frame, word sequence);
+int  s7_read_template(s7_read_cmd_t *cmd, uint8_t *frame, uint16_t frame_size);
 int DataSizeByte(int WordLength);
-word GetNextWord();
+word GetNextWord(s7_proto_ctx_t *ctx);
 word SwapWord(word Value);
 longword SwapDWord(longword Value);
 const char *s7_area_to_str(s7_area_e area);
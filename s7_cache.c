@@ -0,0 +1,216 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "s7_cache.h"
+
+// 一个登记的地址段,refs为引用它的规划item数
+typedef struct s7_cache_entry {
+    uint32_t db; // area << 16 | dbnumber
+    uint16_t start;
+    uint16_t n_byte;
+    uint32_t refs;
+    int64_t  recv_ms; // 0表示还没有收到过数据
+    uint8_t *bytes;
+} s7_cache_entry_t;
+
+// entry按(db, start, n_byte)有序,查找和登记都用二分
+struct s7_cache {
+    pthread_mutex_t   mtx;
+    s7_cache_entry_t *entry;
+    uint32_t          n_entry;
+    uint32_t          size;
+};
+
+static uint32_t s7_cache_db(const s7_read_item_t *item)
+{
+    return (uint32_t) item->area << 16 | item->dbnumber;
+}
+
+static int s7_cache_key_cmp(const s7_cache_entry_t *e, uint32_t db,
+                            uint16_t start, uint16_t n_byte)
+{
+    if (e->db != db) {
+        return e->db < db ? -1 : 1;
+    }
+    if (e->start != start) {
+        return e->start < start ? -1 : 1;
+    }
+    if (e->n_byte != n_byte) {
+        return e->n_byte < n_byte ? -1 : 1;
+    }
+    return 0;
+}
+
+//第一个不小于key的entry下标
+static uint32_t s7_cache_lower(s7_cache_t *cache, uint32_t db, uint16_t start,
+                               uint16_t n_byte)
+{
+    uint32_t lo = 0;
+    uint32_t hi = cache->n_entry;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (s7_cache_key_cmp(&cache->entry[mid], db, start, n_byte) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+s7_cache_t *s7_cache_new(void)
+{
+    s7_cache_t *cache = calloc(1, sizeof(s7_cache_t));
+
+    pthread_mutex_init(&cache->mtx, NULL);
+    return cache;
+}
+
+void s7_cache_free(s7_cache_t *cache)
+{
+    for (uint32_t i = 0; i < cache->n_entry; i++) {
+        free(cache->entry[i].bytes);
+    }
+    free(cache->entry);
+    pthread_mutex_destroy(&cache->mtx);
+    free(cache);
+}
+
+void s7_cache_plan_add(s7_cache_t *cache, s7_read_cmd_sort_t *cs)
+{
+    pthread_mutex_lock(&cache->mtx);
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        for (uint8_t j = 0; j < cs->cmd[i].item_num; j++) {
+            const s7_read_item_t *item = &cs->cmd[i].item[j];
+            uint32_t              db   = s7_cache_db(item);
+            uint32_t              k    = s7_cache_lower(cache, db,
+                                          item->start_address,
+                                          item->n_register);
+
+            if (k < cache->n_entry &&
+                s7_cache_key_cmp(&cache->entry[k], db, item->start_address,
+                                 item->n_register) == 0) {
+                cache->entry[k].refs++;
+                continue;
+            }
+
+            if (cache->n_entry == cache->size) {
+                cache->size  = cache->size ? cache->size * 2 : 64;
+                cache->entry = realloc(cache->entry,
+                                       cache->size * sizeof(s7_cache_entry_t));
+            }
+            memmove(&cache->entry[k + 1], &cache->entry[k],
+                    (cache->n_entry - k) * sizeof(s7_cache_entry_t));
+            cache->n_entry++;
+
+            cache->entry[k] = (s7_cache_entry_t) {
+                .db     = db,
+                .start  = item->start_address,
+                .n_byte = item->n_register,
+                .refs   = 1,
+                .bytes  = calloc(item->n_register + 1, 1),
+            };
+        }
+    }
+    pthread_mutex_unlock(&cache->mtx);
+}
+
+void s7_cache_plan_del(s7_cache_t *cache, s7_read_cmd_sort_t *cs)
+{
+    pthread_mutex_lock(&cache->mtx);
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        for (uint8_t j = 0; j < cs->cmd[i].item_num; j++) {
+            const s7_read_item_t *item = &cs->cmd[i].item[j];
+            uint32_t              db   = s7_cache_db(item);
+            uint32_t              k    = s7_cache_lower(cache, db,
+                                          item->start_address,
+                                          item->n_register);
+
+            if (k == cache->n_entry ||
+                s7_cache_key_cmp(&cache->entry[k], db, item->start_address,
+                                 item->n_register) != 0) {
+                continue;
+            }
+            if (--cache->entry[k].refs > 0) {
+                continue;
+            }
+
+            free(cache->entry[k].bytes);
+            memmove(&cache->entry[k], &cache->entry[k + 1],
+                    (cache->n_entry - k - 1) * sizeof(s7_cache_entry_t));
+            cache->n_entry--;
+        }
+    }
+    pthread_mutex_unlock(&cache->mtx);
+}
+
+//应答中item的数据,只记录登记过的地址段
+void s7_cache_store(s7_cache_t *cache, const s7_read_item_t *item,
+                    const uint8_t *bytes, uint16_t n_byte, int64_t now)
+{
+    uint32_t db = s7_cache_db(item);
+
+    if (n_byte < item->n_register) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->mtx);
+    uint32_t k =
+        s7_cache_lower(cache, db, item->start_address, item->n_register);
+    if (k < cache->n_entry &&
+        s7_cache_key_cmp(&cache->entry[k], db, item->start_address,
+                         item->n_register) == 0) {
+        memcpy(cache->entry[k].bytes, bytes, item->n_register);
+        cache->entry[k].recv_ms = now;
+    }
+    pthread_mutex_unlock(&cache->mtx);
+}
+
+//找since之后收到、完整覆盖item的地址段,数据拷贝到bytes,返回0表示命中
+//一个item不超过一个PDU,只需向前查看起始地址相差不到IsoPayload_Size的entry
+int s7_cache_lookup(s7_cache_t *cache, const s7_read_item_t *item,
+                    int64_t since, uint8_t *bytes)
+{
+    uint32_t db  = s7_cache_db(item);
+    uint32_t end = (uint32_t) item->start_address + item->n_register;
+    int      ret = -1;
+
+    pthread_mutex_lock(&cache->mtx);
+    uint32_t k = s7_cache_lower(cache, db, item->start_address, UINT16_MAX);
+    while (k-- > 0) {
+        const s7_cache_entry_t *e = &cache->entry[k];
+
+        if (e->db != db || item->start_address - e->start > IsoPayload_Size) {
+            break;
+        }
+        if (e->recv_ms > since && (uint32_t) e->start + e->n_byte >= end) {
+            memcpy(bytes, e->bytes + (item->start_address - e->start),
+                   item->n_register);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->mtx);
+
+    return ret;
+}
@@ -0,0 +1,47 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#ifndef _NEU_M_PLUGIN_S7_CACHE_H_
+#define _NEU_M_PLUGIN_S7_CACHE_H_
+
+#include <stdint.h>
+
+#include "s7_point.h"
+
+// 节点内各group读到的地址段数据,其他group在新鲜期内直接取用,不再向PLC读取
+// 地址段来自各group规划中的item,按引用计数登记,规划释放时注销
+typedef struct s7_cache s7_cache_t;
+
+s7_cache_t *s7_cache_new(void);
+void        s7_cache_free(s7_cache_t *cache);
+void        s7_cache_plan_add(s7_cache_t *cache, s7_read_cmd_sort_t *cs);
+void        s7_cache_plan_del(s7_cache_t *cache, s7_read_cmd_sort_t *cs);
+void        s7_cache_store(s7_cache_t *cache, const s7_read_item_t *item,
+                           const uint8_t *bytes, uint16_t n_byte, int64_t now);
+int         s7_cache_lookup(s7_cache_t *cache, const s7_read_item_t *item,
+                            int64_t since, uint8_t *bytes);
+
+// group可复用的数据须在复用时间内收到,且晚于group自己最近一次从PLC收到数据(read_ms),
+// 否则复用时间不短于group周期时,group会一直取用自己上一周期读到的数据
+static inline int64_t s7_cache_since(int64_t now, int64_t window,
+                                     int64_t read_ms)
+{
+    return now - window > read_ms ? now - window : read_ms;
+}
+
+#endif
@@ -0,0 +1,135 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#include <math.h>
+#include <string.h>
+
+#include "s7_cost.h"
+
+static inline double s7_cost_pos(double v)
+{
+    return v > 0 ? v : 0;
+}
+
+// 遗忘因子,约最近200个样本起主要作用
+#define S7_COST_FORGET 0.995
+// 协方差初值,参数先验几乎不起作用
+#define S7_COST_P0 1e6
+// 每item和每字节系数的协方差小于该值才认为可辨识,
+// 所有请求形状都一样时两者分不开,不用于规划
+#define S7_COST_P_READY 1.0
+
+void s7_cost_init(s7_cost_t *cost)
+{
+    memset(cost, 0, sizeof(*cost));
+    for (int i = 0; i < 3; i++) {
+        cost->p[i][i] = S7_COST_P0;
+    }
+}
+
+//递推最小二乘,x = [1, n_item, n_byte], y = rtt
+void s7_cost_update(s7_cost_t *cost, uint16_t n_item, uint32_t n_byte,
+                    int64_t rtt_us)
+{
+    double x[3]  = { 1, n_item, n_byte };
+    double px[3] = { 0 };
+    double den   = S7_COST_FORGET;
+    double err   = (double) rtt_us;
+
+    if (rtt_us <= 0 || n_item == 0) {
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            px[i] += cost->p[i][j] * x[j];
+        }
+        den += x[i] * px[i];
+        err -= cost->theta[i] * x[i];
+    }
+
+    for (int i = 0; i < 3; i++) {
+        cost->theta[i] += px[i] / den * err;
+    }
+    //长期激励不足时协方差不再放大,避免参数漂移
+    double forget = cost->p[0][0] + cost->p[1][1] + cost->p[2][2] < S7_COST_P0
+        ? S7_COST_FORGET
+        : 1;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            cost->p[i][j] = (cost->p[i][j] - px[i] * px[j] / den) / forget;
+        }
+    }
+    cost->n_sample++;
+}
+
+bool s7_cost_ready(const s7_cost_t *cost)
+{
+    return cost->n_sample >= S7_COST_MIN_SAMPLES && cost->theta[0] > 0 &&
+        cost->p[1][1] < S7_COST_P_READY && cost->p[2][2] < S7_COST_P_READY &&
+        isfinite(cost->theta[1]) && isfinite(cost->theta[2]);
+}
+
+//各项系数按不小于0使用,噪声可能让拟合值略小于0
+double s7_cost_predict(const s7_cost_t *cost, double n_item, double n_byte)
+{
+    return cost->theta[0] + s7_cost_pos(cost->theta[1]) * n_item +
+        s7_cost_pos(cost->theta[2]) * n_byte;
+}
+
+//合并跨过的空洞多读的字节比多一个item便宜时才跨空洞合并
+uint16_t s7_cost_gap(const s7_cost_t *cost, uint16_t gap_max)
+{
+    double per_item = s7_cost_pos(cost->theta[1]);
+    double per_byte = s7_cost_pos(cost->theta[2]);
+
+    if (gap_max == 0 || !s7_cost_ready(cost) || per_byte <= 0) {
+        return gap_max;
+    }
+    if (per_item / per_byte >= gap_max) {
+        return gap_max;
+    }
+    return (uint16_t) (per_item / per_byte);
+}
+
+//并行job有空闲时,把每个cmd的应答容量拆成几份,用更多更小的PDU并行读取;
+//预计一轮的耗时至少缩短10%才拆分,cmd数已超过并行数时拆分只会增加轮数
+uint8_t s7_cost_split(const s7_cost_t *cost, uint16_t n_cmd, uint32_t n_item,
+                      uint32_t n_byte, uint16_t parallel)
+{
+    uint8_t split = 1;
+
+    if (!s7_cost_ready(cost) || n_cmd == 0 || n_cmd >= parallel) {
+        return split;
+    }
+
+    double best =
+        s7_cost_predict(cost, (double) n_item / n_cmd, (double) n_byte / n_cmd);
+    for (uint8_t k = 2; k <= S7_COST_SPLIT_MAX; k++) {
+        uint32_t n = (uint32_t) n_cmd * k;
+        if (n > parallel || n > n_item) {
+            break;
+        }
+        double t = s7_cost_predict(cost, (double) n_item / n, (double) n_byte / n);
+        if (t < best * 0.9) {
+            best  = t;
+            split = k;
+        }
+    }
+    return split;
+}
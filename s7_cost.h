@@ -0,0 +1,55 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#ifndef _NEU_M_PLUGIN_S7_COST_H_
+#define _NEU_M_PLUGIN_S7_COST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// 读请求耗时模型: rtt = 固定开销 + 每item开销 * item数 + 每字节开销 * 字节数
+// 每条连接用观测到的读请求rtt在线拟合(带遗忘因子的递推最小二乘),PLC负载变化后逐渐跟上
+typedef struct s7_cost {
+    double   theta[3]; // 固定开销、每item、每字节,微秒
+    double   p[3][3];  // 参数协方差
+    uint32_t n_sample;
+} s7_cost_t;
+
+// 样本数达到该值且各项系数合理后才用于规划
+#define S7_COST_MIN_SAMPLES 32
+// 一个cmd的应答容量最多拆成几份
+#define S7_COST_SPLIT_MAX 4
+
+void s7_cost_init(s7_cost_t *cost);
+void s7_cost_update(s7_cost_t *cost, uint16_t n_item, uint32_t n_byte,
+                    int64_t rtt_us);
+bool s7_cost_ready(const s7_cost_t *cost);
+double   s7_cost_predict(const s7_cost_t *cost, double n_item, double n_byte);
+uint16_t s7_cost_gap(const s7_cost_t *cost, uint16_t gap_max);
+uint8_t  s7_cost_split(const s7_cost_t *cost, uint16_t n_cmd, uint32_t n_item,
+                       uint32_t n_byte, uint16_t parallel);
+
+static inline int64_t s7_time_us(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
@@ -0,0 +1,480 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#include <byteswap.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "s7_decode.h"
+
+typedef void (*s7_decode_fn)(const s7_decode_op_t *ops, uint32_t n,
+                             const uint8_t *bytes, uint64_t *raw);
+
+static const uint8_t s7_decode_width[S7_DECODE_KIND_MAX] = {
+    [S7_DECODE_BIT] = 1, [S7_DECODE_8] = 1,  [S7_DECODE_16] = 2,
+    [S7_DECODE_32] = 4,  [S7_DECODE_64] = 8, [S7_DECODE_COPY] = 0,
+    [S7_DECODE_ARRAY] = 0,
+};
+
+typedef void (*s7_array_fn)(const uint8_t *src, uint16_t n, void *dst);
+
+static inline uint16_t s7_load16(const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return be16toh(v);
+}
+
+static inline uint32_t s7_load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static inline uint64_t s7_load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+//按大端取出后的字节重排,每种都是自身的逆,解码和编码共用
+static inline uint16_t s7_abcd16(uint16_t v)
+{
+    return v;
+}
+
+static inline uint32_t s7_abcd32(uint32_t v)
+{
+    return v;
+}
+
+static inline uint32_t s7_badc32(uint32_t v)
+{
+    return ((v >> 8) & 0x00ff00ffU) | ((v & 0x00ff00ffU) << 8);
+}
+
+static inline uint32_t s7_cdab32(uint32_t v)
+{
+    return v >> 16 | v << 16;
+}
+
+static inline uint32_t s7_dcba32(uint32_t v)
+{
+    return bswap_32(v);
+}
+
+static inline uint16_t s7_dcba16(uint16_t v)
+{
+    return bswap_16(v);
+}
+
+static inline uint64_t s7_abcd64(uint64_t v)
+{
+    return v;
+}
+
+static inline uint64_t s7_dcba64(uint64_t v)
+{
+    return bswap_64(v);
+}
+
+//按op的偏移逐个取值
+static void s7_gather_bit(const s7_decode_op_t *ops, uint32_t n,
+                          const uint8_t *bytes, uint64_t *raw)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        raw[i] = (bytes[ops[i].offset] >> ops[i].bit) & 1;
+    }
+}
+
+static void s7_gather8(const s7_decode_op_t *ops, uint32_t n,
+                       const uint8_t *bytes, uint64_t *raw)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        raw[i] = bytes[ops[i].offset];
+    }
+}
+
+//地址连续的一组值整块转换,循环体只有load+重排,编译器可以向量化
+static void s7_block8(const s7_decode_op_t *ops, uint32_t n,
+                      const uint8_t *bytes, uint64_t *raw)
+{
+    const uint8_t *src = bytes + ops[0].offset;
+    for (uint32_t i = 0; i < n; i++) {
+        raw[i] = src[i];
+    }
+}
+
+//数组tag按元素宽度直接写入neuron的数组值,不经过raw
+#ifdef S7_ARRAY_TAG
+#define S7_ARRAY_KERNEL(bits, order, fix)                                   \
+    static void s7_array##bits##_##order(const uint8_t *src, uint16_t n,    \
+                                         void *dst)                         \
+    {                                                                       \
+        uint##bits##_t *out = (uint##bits##_t *) dst;                       \
+        for (uint16_t i = 0; i < n; i++) {                                  \
+            out[i] = fix(s7_load##bits(src + (bits / 8) * i));              \
+        }                                                                   \
+    }
+#else
+#define S7_ARRAY_KERNEL(bits, order, fix)
+#endif
+
+//每种宽度和字节序生成一组kernel,字节序在规划时选定,循环中没有分支
+#define S7_DECODE_KERNEL(bits, order, fix)                                   \
+    static void s7_gather##bits##_##order(const s7_decode_op_t *ops,        \
+                                          uint32_t n, const uint8_t *bytes, \
+                                          uint64_t *raw)                    \
+    {                                                                       \
+        for (uint32_t i = 0; i < n; i++) {                                  \
+            raw[i] = fix(s7_load##bits(bytes + ops[i].offset));             \
+        }                                                                   \
+    }                                                                       \
+    static void s7_block##bits##_##order(const s7_decode_op_t *ops,         \
+                                         uint32_t n, const uint8_t *bytes,  \
+                                         uint64_t *raw)                     \
+    {                                                                       \
+        const uint8_t *src = bytes + ops[0].offset;                         \
+        for (uint32_t i = 0; i < n; i++) {                                  \
+            raw[i] = fix(s7_load##bits(src + (bits / 8) * i));              \
+        }                                                                   \
+    }                                                                       \
+    S7_ARRAY_KERNEL(bits, order, fix)
+
+S7_DECODE_KERNEL(16, abcd, s7_abcd16)
+S7_DECODE_KERNEL(16, dcba, s7_dcba16)
+S7_DECODE_KERNEL(32, abcd, s7_abcd32)
+S7_DECODE_KERNEL(32, badc, s7_badc32)
+S7_DECODE_KERNEL(32, cdab, s7_cdab32)
+S7_DECODE_KERNEL(32, dcba, s7_dcba32)
+S7_DECODE_KERNEL(64, abcd, s7_abcd64)
+S7_DECODE_KERNEL(64, dcba, s7_dcba64)
+
+#define S7_DECODE_PAIR(bits, order)                        \
+    {                                                      \
+        s7_gather##bits##_##order, s7_block##bits##_##order \
+    }
+
+// [kind][order][contig],16/64位只有ABCD和DCBA,单字节类型只用ABCD
+static const s7_decode_fn
+    s7_decode_kernels[S7_DECODE_KIND_MAX][S7_ORDER_MAX][2] = {
+        [S7_DECODE_BIT] = { [S7_ORDER_ABCD] = { s7_gather_bit,
+                                                s7_gather_bit } },
+        [S7_DECODE_8]   = { [S7_ORDER_ABCD] = { s7_gather8, s7_block8 } },
+        [S7_DECODE_16]  = { [S7_ORDER_ABCD] = S7_DECODE_PAIR(16, abcd),
+                           [S7_ORDER_DCBA] = S7_DECODE_PAIR(16, dcba) },
+        [S7_DECODE_32]  = { [S7_ORDER_ABCD] = S7_DECODE_PAIR(32, abcd),
+                           [S7_ORDER_BADC] = S7_DECODE_PAIR(32, badc),
+                           [S7_ORDER_CDAB] = S7_DECODE_PAIR(32, cdab),
+                           [S7_ORDER_DCBA] = S7_DECODE_PAIR(32, dcba) },
+        [S7_DECODE_64]  = { [S7_ORDER_ABCD] = S7_DECODE_PAIR(64, abcd),
+                           [S7_ORDER_DCBA] = S7_DECODE_PAIR(64, dcba) },
+    };
+
+#ifdef S7_ARRAY_TAG
+static void s7_array8_abcd(const uint8_t *src, uint16_t n, void *dst)
+{
+    memcpy(dst, src, n);
+}
+
+// [elem kind][order]
+static const s7_array_fn s7_array_kernels[S7_DECODE_KIND_MAX][S7_ORDER_MAX] = {
+    [S7_DECODE_8]  = { [S7_ORDER_ABCD] = s7_array8_abcd },
+    [S7_DECODE_16] = { [S7_ORDER_ABCD] = s7_array16_abcd,
+                       [S7_ORDER_DCBA] = s7_array16_dcba },
+    [S7_DECODE_32] = { [S7_ORDER_ABCD] = s7_array32_abcd,
+                       [S7_ORDER_BADC] = s7_array32_badc,
+                       [S7_ORDER_CDAB] = s7_array32_cdab,
+                       [S7_ORDER_DCBA] = s7_array32_dcba },
+    [S7_DECODE_64] = { [S7_ORDER_ABCD] = s7_array64_abcd,
+                       [S7_ORDER_DCBA] = s7_array64_dcba },
+};
+
+//设置neuron数组值的长度,返回元素的存放位置
+static void *s7_array_value(neu_dvalue_t *dvalue, uint16_t n)
+{
+    switch (dvalue->type) {
+    case NEU_TYPE_ARRAY_INT8:
+        dvalue->value.i8s.length = n;
+        return dvalue->value.i8s.i8s;
+    case NEU_TYPE_ARRAY_UINT8:
+        dvalue->value.u8s.length = n;
+        return dvalue->value.u8s.u8s;
+    case NEU_TYPE_ARRAY_INT16:
+        dvalue->value.i16s.length = n;
+        return dvalue->value.i16s.i16s;
+    case NEU_TYPE_ARRAY_UINT16:
+        dvalue->value.u16s.length = n;
+        return dvalue->value.u16s.u16s;
+    case NEU_TYPE_ARRAY_INT32:
+        dvalue->value.i32s.length = n;
+        return dvalue->value.i32s.i32s;
+    case NEU_TYPE_ARRAY_UINT32:
+        dvalue->value.u32s.length = n;
+        return dvalue->value.u32s.u32s;
+    case NEU_TYPE_ARRAY_INT64:
+        dvalue->value.i64s.length = n;
+        return dvalue->value.i64s.i64s;
+    case NEU_TYPE_ARRAY_UINT64:
+        dvalue->value.u64s.length = n;
+        return dvalue->value.u64s.u64s;
+    case NEU_TYPE_ARRAY_FLOAT:
+        dvalue->value.f32s.length = n;
+        return dvalue->value.f32s.f32s;
+    case NEU_TYPE_ARRAY_DOUBLE:
+        dvalue->value.f64s.length = n;
+        return dvalue->value.f64s.f64s;
+    default:
+        return NULL;
+    }
+}
+#endif
+
+//写入时的编码用同一组重排,16/64位的BADC/CDAB不会出现
+static uint16_t (*const s7_encode16[S7_ORDER_MAX])(uint16_t) = {
+    [S7_ORDER_ABCD] = s7_abcd16,
+    [S7_ORDER_BADC] = s7_abcd16,
+    [S7_ORDER_CDAB] = s7_abcd16,
+    [S7_ORDER_DCBA] = s7_dcba16,
+};
+
+static uint32_t (*const s7_encode32[S7_ORDER_MAX])(uint32_t) = {
+    [S7_ORDER_ABCD] = s7_abcd32,
+    [S7_ORDER_BADC] = s7_badc32,
+    [S7_ORDER_CDAB] = s7_cdab32,
+    [S7_ORDER_DCBA] = s7_dcba32,
+};
+
+static uint64_t (*const s7_encode64[S7_ORDER_MAX])(uint64_t) = {
+    [S7_ORDER_ABCD] = s7_abcd64,
+    [S7_ORDER_BADC] = s7_abcd64,
+    [S7_ORDER_CDAB] = s7_abcd64,
+    [S7_ORDER_DCBA] = s7_dcba64,
+};
+
+static uint8_t s7_decode_type_kind(neu_type_e type)
+{
+    switch (type) {
+    case NEU_TYPE_BIT:
+        return S7_DECODE_BIT;
+    case NEU_TYPE_INT8:
+    case NEU_TYPE_UINT8:
+        return S7_DECODE_8;
+    case NEU_TYPE_INT16:
+    case NEU_TYPE_UINT16:
+        return S7_DECODE_16;
+    case NEU_TYPE_INT32:
+    case NEU_TYPE_UINT32:
+    case NEU_TYPE_FLOAT:
+        return S7_DECODE_32;
+    case NEU_TYPE_INT64:
+    case NEU_TYPE_UINT64:
+    case NEU_TYPE_DOUBLE:
+        return S7_DECODE_64;
+    default:
+        return S7_DECODE_COPY;
+    }
+}
+
+static uint8_t s7_decode_kind(const s7_point_t *point)
+{
+    return point->n_elem > 0 ? S7_DECODE_ARRAY
+                             : s7_decode_type_kind(point->type);
+}
+
+//point的字节序后缀对应的重排,单字节和COPY类没有字节序,数组按元素类型
+uint8_t s7_decode_order(const s7_point_t *point)
+{
+    switch (s7_decode_type_kind(s7_array_elem_type(point->type))) {
+    case S7_DECODE_16:
+        return point->option.value16.endian == NEU_DATATAG_ENDIAN_L16
+            ? S7_ORDER_DCBA
+            : S7_ORDER_ABCD;
+    case S7_DECODE_32:
+        switch (point->option.value32.endian) {
+        case NEU_DATATAG_ENDIAN_LL32:
+            return S7_ORDER_DCBA;
+        case NEU_DATATAG_ENDIAN_LB32:
+            return S7_ORDER_CDAB;
+        case NEU_DATATAG_ENDIAN_BB32:
+            return S7_ORDER_BADC;
+        default:
+            return S7_ORDER_ABCD;
+        }
+    case S7_DECODE_64:
+        return point->option.value64.endian == NEU_DATATAG_ENDIAN_L64
+            ? S7_ORDER_DCBA
+            : S7_ORDER_ABCD;
+    default:
+        return S7_ORDER_ABCD;
+    }
+}
+
+static int s7_decode_op_cmp(const void *a, const void *b)
+{
+    const s7_decode_op_t *o1 = (const s7_decode_op_t *) a;
+    const s7_decode_op_t *o2 = (const s7_decode_op_t *) b;
+
+    if (o1->kind != o2->kind) {
+        return o1->kind < o2->kind ? -1 : 1;
+    }
+    if (o1->order != o2->order) {
+        return o1->order < o2->order ? -1 : 1;
+    }
+    if (o1->offset != o2->offset) {
+        return o1->offset < o2->offset ? -1 : 1;
+    }
+    return o1->bit < o2->bit ? -1 : o1->bit > o2->bit;
+}
+
+//ops与item的point一一对应,按kind、字节序和偏移排序后划分成组
+void s7_decode_compile(s7_decode_op_t *ops, s7_point_t **points,
+                       const s7_read_item_t *item)
+{
+    for (uint32_t k = 0; k < item->n_point; k++) {
+        const s7_point_t *p = points[item->first + k];
+
+        ops[k] = (s7_decode_op_t) {
+            .offset = p->start_address - item->start_address,
+            .kind   = s7_decode_kind(p),
+            .order  = s7_decode_order(p),
+            .slot   = item->first + k,
+        };
+        if (ops[k].kind == S7_DECODE_BIT) {
+            ops[k].bit = p->option.bit.bit & 7;
+        } else if (ops[k].kind == S7_DECODE_ARRAY) {
+            ops[k].elem = s7_decode_type_kind(s7_array_elem_type(p->type));
+        }
+    }
+    qsort(ops, item->n_point, sizeof(s7_decode_op_t), s7_decode_op_cmp);
+
+    for (uint32_t i = 0, j = 0; i < item->n_point; i = j) {
+        uint8_t width  = s7_decode_width[ops[i].kind];
+        bool    contig = ops[i].kind != S7_DECODE_BIT && width > 0;
+
+        for (j = i + 1; j < item->n_point && ops[j].kind == ops[i].kind &&
+             ops[j].order == ops[i].order;
+             j++) {
+            contig = contig && ops[j].offset == ops[j - 1].offset + width;
+        }
+        ops[i].run    = j - i;
+        ops[i].contig = contig;
+    }
+}
+
+//应答比请求短时,组内只转换完整落在应答中的op
+void s7_decode_exec(const s7_decode_op_t *ops, uint32_t n_op,
+                    const uint8_t *bytes, uint16_t n_byte, uint64_t *raw)
+{
+    for (uint32_t i = 0; i < n_op; i += ops[i].run) {
+        const s7_decode_op_t *op    = &ops[i];
+        s7_decode_fn          fn    = s7_decode_kernels[op->kind][op->order][op->contig];
+        uint8_t               width = s7_decode_width[op->kind];
+        uint32_t              n     = op->run;
+
+        if (fn == NULL) {
+            continue;
+        }
+        while (n > 0 && ops[i + n - 1].offset + width > n_byte) {
+            n--;
+        }
+        if (n > 0) {
+            fn(op, n, bytes, raw + i);
+        }
+    }
+}
+
+//按op的kind把raw放入dvalue,COPY类直接取应答中的字节;tag超出应答范围时返回错误
+int s7_decode_value(const s7_decode_op_t *op, const s7_point_t *point,
+                    uint64_t raw, const uint8_t *bytes, uint16_t n_byte,
+                    neu_dvalue_t *dvalue)
+{
+    if (op->offset + point->n_register > n_byte) {
+        return NEU_ERR_PLUGIN_READ_FAILURE;
+    }
+
+    dvalue->type = point->type;
+    switch (op->kind) {
+    case S7_DECODE_BIT:
+    case S7_DECODE_8:
+        dvalue->value.u8 = (uint8_t) raw;
+        break;
+    case S7_DECODE_16:
+        dvalue->value.u16 = (uint16_t) raw;
+        break;
+    case S7_DECODE_32:
+        dvalue->value.u32 = (uint32_t) raw;
+        break;
+    case S7_DECODE_64:
+        dvalue->value.u64 = raw;
+        break;
+#ifdef S7_ARRAY_TAG
+    case S7_DECODE_ARRAY: {
+        //整个数组一次转换,一个tag一次上报
+        void *dst = s7_array_value(dvalue, point->n_elem);
+        if (dst == NULL) {
+            return NEU_ERR_TAG_TYPE_NOT_SUPPORT;
+        }
+        s7_array_kernels[op->elem][op->order](bytes + op->offset,
+                                              point->n_elem, dst);
+        break;
+    }
+#endif
+    default:
+        memcpy(dvalue->value.bytes.bytes, bytes + op->offset,
+               point->n_register);
+        dvalue->value.bytes.length = point->n_register;
+        if (point->type != NEU_TYPE_STRING) {
+            break;
+        }
+        if (point->option.string.type == NEU_DATATAG_STRING_TYPE_L) {
+            neu_datatag_string_ltoh(dvalue->value.str,
+                                    strlen(dvalue->value.str));
+        }
+        if (!neu_datatag_string_is_utf8(dvalue->value.str,
+                                        strlen(dvalue->value.str))) {
+            dvalue->value.str[0] = '?';
+            dvalue->value.str[1] = 0;
+        }
+        break;
+    }
+    return NEU_ERR_SUCCESS;
+}
+
+//写入前把value按point的字节序转换成PDU中的字节,返回字节数;非数值类型原样返回0
+uint16_t s7_encode_value(const s7_point_t *point, neu_value_u *value)
+{
+    uint8_t order = s7_decode_order(point);
+
+    switch (s7_decode_kind(point)) {
+    case S7_DECODE_16:
+        value->u16 = htobe16(s7_encode16[order](value->u16));
+        return sizeof(uint16_t);
+    case S7_DECODE_32:
+        value->u32 = htobe32(s7_encode32[order](value->u32));
+        return sizeof(uint32_t);
+    case S7_DECODE_64:
+        value->u64 = htobe64(s7_encode64[order](value->u64));
+        return sizeof(uint64_t);
+    default:
+        return 0;
+    }
+}
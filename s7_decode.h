@@ -0,0 +1,74 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#ifndef _NEU_M_PLUGIN_S7_DECODE_H_
+#define _NEU_M_PLUGIN_S7_DECODE_H_
+
+#include <stdint.h>
+
+#include <neuron.h>
+
+#include "s7_point.h"
+
+// 读应答的批量解码:规划时把每个item编译成解码程序,op按宽度和字节序分组、组内按地址排序,
+// 收到应答后先对同宽度的一组值做字节序转换写入raw,再逐个tag上报
+typedef enum s7_decode_kind {
+    S7_DECODE_BIT = 0,
+    S7_DECODE_8,
+    S7_DECODE_16,
+    S7_DECODE_32,
+    S7_DECODE_64,
+    S7_DECODE_COPY,  // STRING/BYTES等按原始字节上报
+    S7_DECODE_ARRAY, // 数组tag,上报时整个数组一次转换
+    S7_DECODE_KIND_MAX,
+} s7_decode_kind_e;
+
+// 多字节值在PDU中的字节序,A为最高字节,见s7.h中地址后缀的说明
+typedef enum s7_decode_order {
+    S7_ORDER_ABCD = 0, // S7默认的大端
+    S7_ORDER_BADC,     // 字内字节交换
+    S7_ORDER_CDAB,     // 字交换
+    S7_ORDER_DCBA,     // 小端
+    S7_ORDER_MAX,
+} s7_decode_order_e;
+
+typedef struct s7_decode_op {
+    uint16_t offset; // 在item数据中的偏移
+    uint8_t  kind;
+    union {
+        uint8_t bit;  // BIT的位号
+        uint8_t elem; // ARRAY的元素kind
+    };
+    uint16_t run;    // 组内op数,只在每组第一个op上有效
+    uint8_t  contig; // 组内地址连续,按整块转换
+    uint8_t  order;  // 字节序,同kind同order的op才在一组
+    uint32_t slot;   // 对应的point在cmd->points中的下标
+} s7_decode_op_t;
+
+uint8_t  s7_decode_order(const s7_point_t *point);
+uint16_t s7_encode_value(const s7_point_t *point, neu_value_u *value);
+
+void s7_decode_compile(s7_decode_op_t *ops, s7_point_t **points,
+                       const s7_read_item_t *item);
+void s7_decode_exec(const s7_decode_op_t *ops, uint32_t n_op,
+                    const uint8_t *bytes, uint16_t n_byte, uint64_t *raw);
+int  s7_decode_value(const s7_decode_op_t *op, const s7_point_t *point,
+                     uint64_t raw, const uint8_t *bytes, uint16_t n_byte,
+                     neu_dvalue_t *dvalue);
+
+#endif
@@ -20,6 +20,7 @@
 
 #include <neuron.h>
 
+#include "s7_decode.h"
 #include "s7_point.h"
 
 struct s7_sort_ctx {
@@ -27,14 +28,132 @@ struct s7_sort_ctx {
     uint16_t end;
 };
 
-static __thread uint16_t s7_read_max_byte = 240;
-
-static int  tag_cmp(neu_tag_sort_elem_t *tag1, neu_tag_sort_elem_t *tag2);
-static bool tag_sort(neu_tag_sort_t *sort, void *tag, void *tag_to_be_sorted);
 static int  tag_cmp_write(neu_tag_sort_elem_t *tag1, neu_tag_sort_elem_t *tag2);
 static bool tag_sort_write(neu_tag_sort_t *sort, void *tag,
                            void *tag_to_be_sorted);
 
+//解析地址的字节序后缀,写入option.value16/32/64;没有后缀时为S7默认的大端
+static int s7_tag_order(const char *address, neu_type_e type,
+                        neu_datatag_addr_option_u *option)
+{
+    const char *op = strrchr(address, '#');
+
+    switch (type) {
+    case NEU_TYPE_UINT16:
+    case NEU_TYPE_INT16:
+        option->value16.endian = NEU_DATATAG_ENDIAN_B16;
+        if (op != NULL && strcmp(op, "#L") == 0) {
+            option->value16.endian = NEU_DATATAG_ENDIAN_L16;
+        } else if (op != NULL && strcmp(op, "#B") != 0) {
+            return -1;
+        }
+        break;
+    case NEU_TYPE_UINT32:
+    case NEU_TYPE_INT32:
+    case NEU_TYPE_FLOAT:
+        option->value32.endian = NEU_DATATAG_ENDIAN_BL32;
+        if (op == NULL || strcmp(op, "#BL") == 0) {
+            break;
+        } else if (strcmp(op, "#LL") == 0) {
+            option->value32.endian = NEU_DATATAG_ENDIAN_LL32;
+        } else if (strcmp(op, "#LB") == 0) {
+            option->value32.endian = NEU_DATATAG_ENDIAN_LB32;
+        } else if (strcmp(op, "#BB") == 0) {
+            option->value32.endian = NEU_DATATAG_ENDIAN_BB32;
+        } else {
+            return -1;
+        }
+        break;
+    case NEU_TYPE_UINT64:
+    case NEU_TYPE_INT64:
+    case NEU_TYPE_DOUBLE:
+        option->value64.endian = NEU_DATATAG_ENDIAN_B64;
+        if (op != NULL && strcmp(op, "#L") == 0) {
+            option->value64.endian = NEU_DATATAG_ENDIAN_L64;
+        } else if (op != NULL && strcmp(op, "#B") != 0) {
+            return -1;
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+#ifdef S7_ARRAY_TAG
+//CMakeLists.txt生成schema时按这些类型编号添加数组tag的地址格式
+_Static_assert(NEU_TYPE_ARRAY_INT8 == 24 && NEU_TYPE_ARRAY_UINT8 == 25 &&
+                   NEU_TYPE_ARRAY_INT16 == 26 && NEU_TYPE_ARRAY_UINT16 == 27 &&
+                   NEU_TYPE_ARRAY_INT32 == 28 && NEU_TYPE_ARRAY_UINT32 == 29 &&
+                   NEU_TYPE_ARRAY_INT64 == 30 && NEU_TYPE_ARRAY_UINT64 == 31 &&
+                   NEU_TYPE_ARRAY_FLOAT == 32 && NEU_TYPE_ARRAY_DOUBLE == 33,
+               "array type ids differ from the s7-tcp.json tag_regex entries");
+
+//neuron数组值能容纳的元素个数
+#define S7_ARRAY_CAP(m)                             \
+    (sizeof(((neu_value_u *) 0)->m.m) /             \
+     sizeof(((neu_value_u *) 0)->m.m[0]))
+
+static uint16_t s7_array_cap(neu_type_e type)
+{
+    switch (type) {
+    case NEU_TYPE_ARRAY_INT8:
+        return S7_ARRAY_CAP(i8s);
+    case NEU_TYPE_ARRAY_UINT8:
+        return S7_ARRAY_CAP(u8s);
+    case NEU_TYPE_ARRAY_INT16:
+        return S7_ARRAY_CAP(i16s);
+    case NEU_TYPE_ARRAY_UINT16:
+        return S7_ARRAY_CAP(u16s);
+    case NEU_TYPE_ARRAY_INT32:
+        return S7_ARRAY_CAP(i32s);
+    case NEU_TYPE_ARRAY_UINT32:
+        return S7_ARRAY_CAP(u32s);
+    case NEU_TYPE_ARRAY_INT64:
+        return S7_ARRAY_CAP(i64s);
+    case NEU_TYPE_ARRAY_UINT64:
+        return S7_ARRAY_CAP(u64s);
+    case NEU_TYPE_ARRAY_FLOAT:
+        return S7_ARRAY_CAP(f32s);
+    case NEU_TYPE_ARRAY_DOUBLE:
+        return S7_ARRAY_CAP(f64s);
+    default:
+        return 0;
+    }
+}
+#endif
+
+//数组tag的元素类型,非数组tag原样返回
+neu_type_e s7_array_elem_type(neu_type_e type)
+{
+    switch (type) {
+#ifdef S7_ARRAY_TAG
+    case NEU_TYPE_ARRAY_INT8:
+        return NEU_TYPE_INT8;
+    case NEU_TYPE_ARRAY_UINT8:
+        return NEU_TYPE_UINT8;
+    case NEU_TYPE_ARRAY_INT16:
+        return NEU_TYPE_INT16;
+    case NEU_TYPE_ARRAY_UINT16:
+        return NEU_TYPE_UINT16;
+    case NEU_TYPE_ARRAY_INT32:
+        return NEU_TYPE_INT32;
+    case NEU_TYPE_ARRAY_UINT32:
+        return NEU_TYPE_UINT32;
+    case NEU_TYPE_ARRAY_INT64:
+        return NEU_TYPE_INT64;
+    case NEU_TYPE_ARRAY_UINT64:
+        return NEU_TYPE_UINT64;
+    case NEU_TYPE_ARRAY_FLOAT:
+        return NEU_TYPE_FLOAT;
+    case NEU_TYPE_ARRAY_DOUBLE:
+        return NEU_TYPE_DOUBLE;
+#endif
+    default:
+        return type;
+    }
+}
+
 int s7_tag_to_point(const neu_datatag_t *tag, s7_point_t *point)
 {
     int      ret           = NEU_ERR_SUCCESS;
@@ -43,13 +162,29 @@ int s7_tag_to_point(const neu_datatag_t *tag, s7_point_t *point)
     if (ret != 0) {
         return NEU_ERR_TAG_ADDRESS_FORMAT_INVALID;
     }
+    neu_type_e elem = s7_array_elem_type(tag->type);
+    if (s7_tag_order(tag->address, elem, &point->option) != 0) {
+        return NEU_ERR_TAG_ADDRESS_FORMAT_INVALID;
+    }
 
-    //AREA ADDRESS[.BIT][.LEN]
+    //AREA ADDRESS[.BIT][.LEN][[COUNT]][#ENDIAN]
+    //数组tag在起始地址后用[COUNT]给出元素个数,整个数组作为一个point读取
 
-    int  n    = sscanf(tag->address, "DB%hu.DBW%u", &point->dbnumber,&start_address);
-    if (n != 2 || start_address == 0 || point->dbnumber <= 0) {
+    point->n_elem = 0;
+    int  n    = sscanf(tag->address, "DB%hu.DBW%u[%hu]", &point->dbnumber,
+                   &start_address, &point->n_elem);
+    if (n < 2 || start_address == 0 || point->dbnumber <= 0) {
+        return NEU_ERR_TAG_ADDRESS_FORMAT_INVALID;
+    }
+    if ((n == 3) != (elem != tag->type)) {
         return NEU_ERR_TAG_ADDRESS_FORMAT_INVALID;
     }
+#ifdef S7_ARRAY_TAG
+    if (n == 3 &&
+        (point->n_elem == 0 || point->n_elem > s7_array_cap(tag->type))) {
+        return NEU_ERR_TAG_ADDRESS_FORMAT_INVALID;
+    }
+#endif
 
     point->area = S7AreaDB;
     point->start_address = (uint16_t) start_address;
@@ -57,7 +192,7 @@ int s7_tag_to_point(const neu_datatag_t *tag, s7_point_t *point)
     point->start_address -= 1;
     point->type = tag->type;
 
-    switch (point->type) {
+    switch (elem) {
     case NEU_TYPE_BIT:
         point->n_register = 1;
         break;
@@ -104,6 +239,9 @@ int s7_tag_to_point(const neu_datatag_t *tag, s7_point_t *point)
     default:
         return NEU_ERR_TAG_TYPE_NOT_SUPPORT;
     }
+    if (point->n_elem > 0) {
+        point->n_register *= point->n_elem;
+    }
 
     strncpy(point->name, tag->name, sizeof(point->name));
     return ret;
@@ -118,95 +256,579 @@ int s7_write_tag_to_point(const neu_plugin_tag_value_t *tag,
     return ret;
 }
 
-int sorts_cmp(const void *a, const void *b) {
-    neu_tag_sort_t *sort_a = (neu_tag_sort_t *)a;
-    neu_tag_sort_t *sort_b = (neu_tag_sort_t *)b;
+//一段连续地址在应答中占用的字节数:item头+数据+奇数补齐
+//只有最后一个item不补齐,这里统一按补齐计算,保证计划一定不超PDU
+static uint16_t s7_read_res_cost(uint16_t n_byte)
+{
+    return S7_READ_RES_ITEM_SIZE + n_byte + (n_byte & 1);
+}
+
+//规划用的紧凑point,按DB和地址排序后一次线性扫描合并成地址段
+struct s7_plan_point {
+    uint32_t    db; // area << 16 | dbnumber
+    uint32_t    start;
+    uint32_t    end;
+    s7_point_t *point;
+};
+
+//合并得到的连续地址段,对应读PDU中的一个item
+struct s7_plan_range {
+    uint32_t db;
+    uint32_t start;
+    uint32_t end;
+    uint32_t first; // 在排序后point数组中的下标
+    uint32_t n_point;
+};
+
+static int s7_plan_point_cmp(const void *a, const void *b)
+{
+    const struct s7_plan_point *p1 = (const struct s7_plan_point *) a;
+    const struct s7_plan_point *p2 = (const struct s7_plan_point *) b;
 
-    if (sort_a->info.size < sort_b->info.size) return -1;
-    if (sort_a->info.size > sort_b->info.size) return 1;
+    if (p1->db != p2->db) {
+        return p1->db < p2->db ? -1 : 1;
+    }
+    if (p1->start != p2->start) {
+        return p1->start < p2->start ? -1 : 1;
+    }
+    if (p1->end != p2->end) {
+        return p1->end < p2->end ? -1 : 1;
+    }
     return 0;
 }
 
-s7_read_cmd_sort_t *s7_tag_sort(UT_array *tags, uint16_t max_byte)
+//长的地址段在前,长度相同时按地址,保证同样的tag得到同样的规划
+static int s7_range_cmp(const void *a, const void *b)
 {
-    s7_read_max_byte          = max_byte;
-    neu_tag_sort_result_t *result = neu_tag_sort(tags, tag_sort, tag_cmp);
+    const struct s7_plan_range *r1 = (const struct s7_plan_range *) a;
+    const struct s7_plan_range *r2 = (const struct s7_plan_range *) b;
+    uint32_t len1 = r1->end - r1->start;
+    uint32_t len2 = r2->end - r2->start;
 
-    //tag_sort再排序,按每个组的大小,由小到大排序
-    qsort(result->sorts, result->n_sort, sizeof(neu_tag_sort_t), sorts_cmp);
+    if (len1 != len2) {
+        return len1 > len2 ? -1 : 1;
+    }
+    if (r1->db != r2->db) {
+        return r1->db < r2->db ? -1 : 1;
+    }
+    return r1->start < r2->start ? -1 : r1->start > r2->start;
+}
 
-    s7_read_cmd_sort_t *sort_result = calloc(1, sizeof(s7_read_cmd_sort_t));
-    sort_result->cmd   = calloc(result->n_sort, sizeof(s7_read_cmd_t));
-    
-    for (uint16_t i = 0; i < result->n_sort; i++) {
-        sort_result->cmd[i].tags = calloc(MaxVars,sizeof(UT_array*));
-        for (size_t j = 0; j < MaxVars; j++) {
-            utarray_new(sort_result->cmd[i].tags[j], &ut_ptr_icd);
+//能否把p并入地址段r,db_size为r所在DB的字节数,<=0表示未知
+static bool s7_range_extend(struct s7_plan_range *r, const struct s7_plan_point *p,
+                            const s7_plan_param_t *param, int32_t db_size,
+                            uint32_t max_byte)
+{
+    uint32_t end = p->end > r->end ? p->end : r->end;
+
+    if (p->db != r->db) {
+        return false;
+    }
+    //不相邻的tag:空洞不超过gap且DB大小已知时一并读取
+    if (p->start > r->end && (p->start - r->end > param->gap || db_size <= 0)) {
+        return false;
+    }
+    //合并后的地址段不能越过DB末尾,越界的tag单独读取,不影响同段其他tag
+    if (db_size > 0 && end > (uint32_t) db_size) {
+        return false;
+    }
+    //合并后的地址段不能超过一个应答PDU能带回的数据
+    if (end - r->start > max_byte) {
+        return false;
+    }
+
+    r->end = end;
+    r->n_point++;
+    return true;
+}
+
+//每个cmd(一个读PDU)的剩余容量
+struct s7_read_bin {
+    uint16_t req_left;
+    uint16_t res_left;
+    uint8_t  n_item;
+};
+
+//一次分配规划的全部内存:头、cmd、point指针、解码结果、解码程序、item、请求帧、
+//缓存缓冲依次排列,计数由调用者填写
+static s7_read_cmd_sort_t *s7_plan_arena(uint32_t n_cmd, uint32_t n_item,
+                                         uint32_t n_point, uint16_t n_scratch)
+{
+    size_t   off_cmd   = sizeof(s7_read_cmd_sort_t);
+    size_t   off_point = off_cmd + n_cmd * sizeof(s7_read_cmd_t);
+    size_t   off_raw   = off_point + n_point * sizeof(s7_point_t *);
+    size_t   off_ops   = off_raw + n_point * sizeof(uint64_t);
+    size_t   off_item  = off_ops + n_point * sizeof(s7_decode_op_t);
+    size_t   off_frame = off_item + n_item * sizeof(s7_read_item_t);
+    size_t   n_frame   = n_cmd * S7_READ_REQ_FRAME_SIZE(0) +
+        n_item * S7_READ_REQ_ITEM_SIZE;
+    size_t   off_scratch = off_frame + n_frame;
+    uint8_t *arena       = calloc(1, off_scratch + n_scratch);
+
+    s7_read_cmd_sort_t *cs = (s7_read_cmd_sort_t *) arena;
+    cs->cmd                = (s7_read_cmd_t *) (arena + off_cmd);
+    cs->points             = (s7_point_t **) (arena + off_point);
+    cs->raw                = (uint64_t *) (arena + off_raw);
+    cs->ops                = (s7_decode_op_t *) (arena + off_ops);
+    cs->items              = (s7_read_item_t *) (arena + off_item);
+    cs->frames             = arena + off_frame;
+    cs->n_scratch          = n_scratch;
+    cs->scratch            = arena + off_scratch;
+    return cs;
+}
+
+//item填好后编码cmd的请求帧,每个周期发送时只改Sequence
+static void s7_plan_frame(s7_read_cmd_sort_t *cs, s7_read_cmd_t *cmd)
+{
+    if (cmd->oversize) {
+        return;
+    }
+
+    uint16_t size = S7_READ_REQ_FRAME_SIZE(cmd->item_num);
+    int      ret  = s7_read_template(cmd, cs->frames + cs->n_frame, size);
+
+    if (ret > 0) {
+        cmd->req   = cs->frames + cs->n_frame;
+        cmd->n_req = ret;
+        cs->n_frame += ret;
+    }
+}
+
+//把cmd连同它的item、point和解码程序追加到规划末尾,item的first改为在新规划中的下标
+static void s7_plan_append(s7_read_cmd_sort_t *cs, const s7_read_cmd_t *cmd)
+{
+    s7_read_cmd_t *dst = &cs->cmd[cs->n_cmd++];
+
+    dst->item_num   = cmd->item_num;
+    dst->reserve_id = cmd->reserve_id;
+    dst->oversize   = cmd->oversize;
+    dst->item       = &cs->items[cs->n_item];
+    dst->points     = cs->points;
+    dst->ops        = cs->ops;
+    dst->raw        = cs->raw;
+    for (uint8_t j = 0; j < cmd->item_num; j++) {
+        s7_read_item_t *item = &cs->items[cs->n_item++];
+
+        *item       = cmd->item[j];
+        item->first = cs->n_point;
+        memcpy(&cs->points[cs->n_point], &cmd->points[cmd->item[j].first],
+               item->n_point * sizeof(s7_point_t *));
+        //解码程序原样拷贝,只把slot平移到新的下标
+        memcpy(&cs->ops[item->first], &cmd->ops[cmd->item[j].first],
+               item->n_point * sizeof(s7_decode_op_t));
+        for (uint32_t k = 0; k < item->n_point; k++) {
+            cs->ops[item->first + k].slot =
+                cs->ops[item->first + k].slot - cmd->item[j].first +
+                item->first;
         }
+        cs->n_point += item->n_point;
     }
+    dst->req   = NULL;
+    dst->n_req = 0;
+    s7_plan_frame(cs, dst);
+}
 
-    int cmd_idx = 0,item_idx= 0,res_len = 0;
-    for (uint16_t i = 0; i < result->n_sort; i++) {
-        s7_point_t *tag = *(s7_point_t **) utarray_front(result->sorts[i].tags);
-        struct s7_sort_ctx *ctx = result->sorts[i].info.context;
-
-        //检测是否超过最大读取长度,超过则重新分配cmd
-        res_len += ctx->end - ctx->start;
-        if(res_len > s7_read_max_byte){
-            cmd_idx++;
-            item_idx = 0;
-            res_len = ctx->end - ctx->start;
+//first-fit查找:叶子为各cmd还能接受的应答字节数(item已满为-1),
+//内部节点取子节点最大值,O(log n)找到第一个装得下的cmd
+struct s7_bin_tree {
+    uint32_t size;
+    int32_t *node;
+};
+
+static void s7_bin_tree_set(struct s7_bin_tree *t, uint32_t bin, int32_t left)
+{
+    uint32_t i = t->size + bin;
+
+    t->node[i] = left;
+    for (i >>= 1; i > 0; i >>= 1) {
+        t->node[i] = t->node[2 * i] > t->node[2 * i + 1] ? t->node[2 * i]
+                                                         : t->node[2 * i + 1];
+    }
+}
+
+static int32_t s7_bin_tree_find(const struct s7_bin_tree *t, int32_t cost)
+{
+    uint32_t i = 1;
+
+    if (t->node[1] < cost) {
+        return -1;
+    }
+    while (i < t->size) {
+        i = t->node[2 * i] >= cost ? 2 * i : 2 * i + 1;
+    }
+    return (int32_t)(i - t->size);
+}
+
+//按协商的PDU规划读请求:先把相邻tag合并成连续地址段,
+//再按first-fit-decreasing把地址段装入尽量少的PDU.
+//请求方向每个item 12字节,应答方向每个item 4字节头加数据,两个方向都不能超过PDU
+//tag一次拷贝成紧凑数组排序,合并和装箱都是线性或O(log n)的,10万级tag的group也只需毫秒级
+s7_read_cmd_sort_t *s7_tag_sort(UT_array *tags, const s7_plan_param_t *param)
+{
+    uint16_t pdu_size  = param->pdu_size;
+    uint16_t req_space = pdu_size - S7_READ_REQ_HEADER_SIZE;
+    uint16_t res_space = pdu_size - S7_READ_RES_HEADER_SIZE;
+    //item数上限由PDU决定,应答中每个item至少占1字节数据
+    uint16_t max_items = req_space / S7_READ_REQ_ITEM_SIZE;
+    if (max_items > res_space / s7_read_res_cost(1)) {
+        max_items = res_space / s7_read_res_cost(1);
+    }
+    if (max_items > UINT8_MAX) {
+        max_items = UINT8_MAX;
+    }
+    //单个地址段最多占满一个应答PDU
+    uint32_t max_byte = res_space - S7_READ_RES_ITEM_SIZE;
+    //按耗时模型拆分时每个cmd的装箱容量,超过容量的地址段仍独占一个cmd
+    uint16_t bin_space =
+        param->split > 1 ? res_space / param->split : res_space;
+
+    uint32_t              n_point = utarray_len(tags);
+    uint32_t              n_range = 0;
+    struct s7_plan_point *points  = calloc(n_point + 1, sizeof(*points));
+    struct s7_plan_range *ranges  = calloc(n_point + 1, sizeof(*ranges));
+
+    for (uint32_t i = 0; i < n_point; i++) {
+        s7_point_t *p = *(s7_point_t **) utarray_eltptr(tags, i);
+
+        points[i].db    = (uint32_t) p->area << 16 | p->dbnumber;
+        points[i].start = p->start_address;
+        points[i].end   = (uint32_t) p->start_address + p->n_register;
+        points[i].point = p;
+    }
+    qsort(points, n_point, sizeof(*points), s7_plan_point_cmp);
+
+    //DB大小只在DB变化时查询一次
+    int32_t  db_size = 0;
+    uint32_t db      = UINT32_MAX;
+    for (uint32_t i = 0; i < n_point; i++) {
+        struct s7_plan_point *p = &points[i];
+
+        if (p->db != db) {
+            db      = p->db;
+            db_size = 0;
+            if (p->point->area == S7AreaDB && param->db_size != NULL) {
+                db_size = param->db_size(param->db_ctx, p->point->dbnumber);
+            }
+        }
+        if (n_range > 0 &&
+            s7_range_extend(&ranges[n_range - 1], p, param, db_size,
+                            max_byte)) {
+            continue;
         }
 
-        sort_result->cmd[cmd_idx].item_num = item_idx+1;
-        sort_result->cmd[cmd_idx].tags[item_idx] = utarray_clone(result->sorts[i].tags);
-        sort_result->cmd[cmd_idx].item[item_idx].dbnumber  = tag->dbnumber;
-        sort_result->cmd[cmd_idx].item[item_idx].area     = tag->area;
-        sort_result->cmd[cmd_idx].item[item_idx].start_address = tag->start_address;
-        sort_result->cmd[cmd_idx].item[item_idx].n_register    = ctx->end - ctx->start;
-        item_idx++;
+        ranges[n_range].db      = p->db;
+        ranges[n_range].start   = p->start;
+        ranges[n_range].end     = p->end;
+        ranges[n_range].first   = i;
+        ranges[n_range].n_point = 1;
+        n_range++;
+    }
 
-        free(result->sorts[i].info.context);
+    //合并时需要按地址有序,装箱时按长度降序
+    struct s7_plan_range *by_len = calloc(n_range + 1, sizeof(*by_len));
+    memcpy(by_len, ranges, n_range * sizeof(*by_len));
+    qsort(by_len, n_range, sizeof(*by_len), s7_range_cmp);
+
+    struct s7_read_bin *bins   = calloc(n_range + 1, sizeof(*bins));
+    uint32_t *          bin_of = calloc(n_range + 1, sizeof(uint32_t));
+    uint32_t            n_cmd  = 0;
+    struct s7_bin_tree  tree   = { .size = 1 };
+    while (tree.size < n_range) {
+        tree.size <<= 1;
+    }
+    tree.node = malloc(2 * tree.size * sizeof(int32_t));
+    for (uint32_t i = 0; i < 2 * tree.size; i++) {
+        tree.node[i] = -1;
     }
-    sort_result->n_cmd = cmd_idx+1;
 
-    neu_tag_sort_free(result);
+    //先装箱只记下每个地址段所在的cmd,cmd数确定后一次分配整个规划
+    for (uint32_t i = 0; i < n_range; i++) {
+        struct s7_plan_range *r        = &by_len[i];
+        uint16_t              n_byte   = r->end - r->start;
+        uint16_t              res_cost = s7_read_res_cost(n_byte);
+        int32_t               c        = s7_bin_tree_find(&tree, res_cost);
+
+        //放不进已有的cmd,新开一个;超出应答PDU的地址段(大数组或长字符串)独占一个cmd,
+        //标记为oversize,不发送,其tag每周期按读失败上报
+        if (c < 0) {
+            c                = n_cmd++;
+            bins[c].req_left = req_space;
+            bins[c].res_left = bin_space;
+        }
+
+        bins[c].n_item++;
+        bins[c].req_left -= S7_READ_REQ_ITEM_SIZE;
+        bins[c].res_left -= res_cost < bins[c].res_left ? res_cost
+                                                        : bins[c].res_left;
+        s7_bin_tree_set(&tree, c,
+                        bins[c].n_item < max_items &&
+                                bins[c].req_left >= S7_READ_REQ_ITEM_SIZE
+                            ? bins[c].res_left
+                            : -1);
+        bin_of[i] = c;
+    }
+
+    //by_len按长度降序,第一个就是最长的item
+    s7_read_cmd_sort_t *sort_result = s7_plan_arena(
+        n_cmd, n_range, n_point,
+        n_range > 0 ? by_len[0].end - by_len[0].start : 0);
+    sort_result->n_cmd              = n_cmd;
+    sort_result->n_item             = n_range;
+    sort_result->n_point            = n_point;
+
+    //每个cmd的item在items中连续存放
+    for (uint32_t c = 0, offset = 0; c < n_cmd; c++) {
+        sort_result->cmd[c].item   = &sort_result->items[offset];
+        sort_result->cmd[c].points = sort_result->points;
+        sort_result->cmd[c].ops    = sort_result->ops;
+        sort_result->cmd[c].raw    = sort_result->raw;
+        offset += bins[c].n_item;
+    }
+    //地址段的point在排序后的数组中本来就是连续的
+    for (uint32_t i = 0; i < n_point; i++) {
+        sort_result->points[i] = points[i].point;
+    }
+    for (uint32_t i = 0; i < n_range; i++) {
+        struct s7_plan_range *r   = &by_len[i];
+        s7_point_t *          tag = points[r->first].point;
+        s7_read_cmd_t *       cmd = &sort_result->cmd[bin_of[i]];
+        s7_read_item_t *      item = &cmd->item[cmd->item_num++];
+
+        item->dbnumber      = tag->dbnumber;
+        item->area          = tag->area;
+        item->start_address = r->start;
+        item->n_register    = r->end - r->start;
+        item->first         = r->first;
+        item->n_point       = r->n_point;
+        if (item->n_register > max_byte) {
+            cmd->oversize = true;
+        }
+    }
+    for (uint32_t c = 0; c < n_cmd; c++) {
+        s7_plan_frame(sort_result, &sort_result->cmd[c]);
+    }
+    for (uint32_t i = 0; i < n_range; i++) {
+        s7_read_item_t *item = &sort_result->items[i];
+        s7_decode_compile(&sort_result->ops[item->first], sort_result->points,
+                          item);
+    }
+
+    free(tree.node);
+    free(bin_of);
+    free(bins);
+    free(by_len);
+    free(ranges);
+    free(points);
     return sort_result;
 }
 
-int cal_n_byte(int type, neu_value_u *value, neu_datatag_addr_option_u option)
+static int s7_ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t p1 = (uintptr_t) *(void *const *) a;
+    uintptr_t p2 = (uintptr_t) *(void *const *) b;
+
+    return p1 < p2 ? -1 : p1 > p2;
+}
+
+//removed已按地址排序
+static bool s7_point_removed(UT_array *removed, s7_point_t *point)
+{
+    s7_point_t **base = (s7_point_t **) utarray_front(removed);
+
+    return base != NULL &&
+        bsearch(&point, base, utarray_len(removed), sizeof(s7_point_t *),
+                s7_ptr_cmp) != NULL;
+}
+
+//变化的tag前后各reach字节内的地址窗口,与窗口相交的item所在的cmd需要重新规划
+struct s7_plan_window {
+    uint32_t db; // area << 16 | dbnumber
+    uint32_t start;
+    uint32_t end;
+};
+
+static int s7_plan_window_cmp(const void *a, const void *b)
+{
+    const struct s7_plan_window *w1 = (const struct s7_plan_window *) a;
+    const struct s7_plan_window *w2 = (const struct s7_plan_window *) b;
+
+    if (w1->db != w2->db) {
+        return w1->db < w2->db ? -1 : 1;
+    }
+    return w1->start < w2->start ? -1 : w1->start > w2->start;
+}
+
+static void s7_plan_window_add(struct s7_plan_window *windows, uint32_t *n,
+                               UT_array *points, uint32_t reach)
+{
+    utarray_foreach(points, s7_point_t **, pp)
+    {
+        const s7_point_t *p = *pp;
+
+        windows[*n].db    = (uint32_t) p->area << 16 | p->dbnumber;
+        windows[*n].start = p->start_address > reach
+            ? p->start_address - reach
+            : 0;
+        windows[*n].end = (uint32_t) p->start_address + p->n_register + reach;
+        *n += 1;
+    }
+}
+
+//排序后合并重叠的窗口,合并后同一DB内的窗口互不相交,起止都递增
+static uint32_t s7_plan_window_merge(struct s7_plan_window *windows,
+                                     uint32_t               n)
+{
+    uint32_t m = 0;
+
+    qsort(windows, n, sizeof(*windows), s7_plan_window_cmp);
+    for (uint32_t i = 0; i < n; i++) {
+        if (m > 0 && windows[m - 1].db == windows[i].db &&
+            windows[i].start <= windows[m - 1].end) {
+            if (windows[i].end > windows[m - 1].end) {
+                windows[m - 1].end = windows[i].end;
+            }
+            continue;
+        }
+        windows[m++] = windows[i];
+    }
+    return m;
+}
+
+//二分查找第一个不在item之前的窗口,再判断是否与item相交
+static bool s7_plan_window_hit(const struct s7_plan_window *windows,
+                               uint32_t n, const s7_read_item_t *item)
+{
+    uint32_t db    = (uint32_t) item->area << 16 | item->dbnumber;
+    uint32_t start = item->start_address;
+    uint32_t end   = start + item->n_register;
+    uint32_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (windows[mid].db < db ||
+            (windows[mid].db == db && windows[mid].end < start)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n && windows[lo].db == db && windows[lo].start <= end;
+}
+
+//增量规划:只拆开地址在变化tag附近的cmd,连同新增的tag重新规划,其余cmd原样保留
+//附近指read_gap加一个应答PDU的数据量以内,更远的item不可能与变化的tag合并
+//返回新的规划,cs随之释放;removed中的point由调用者在返回后释放
+s7_read_cmd_sort_t *s7_tag_sort_update(s7_read_cmd_sort_t *cs, UT_array *removed,
+                                       UT_array *added,
+                                       const s7_plan_param_t *param)
+{
+    UT_array *tags     = NULL;
+    bool *    keep     = calloc(cs->n_cmd + 1, sizeof(bool));
+    uint32_t  n_keep   = 0;
+    uint32_t  n_item   = 0;
+    uint32_t  n_point  = 0;
+    uint32_t  n_window = 0;
+    uint16_t  n_scratch = 0;
+    uint32_t  reach    = (uint32_t) param->gap + param->pdu_size -
+        S7_READ_RES_HEADER_SIZE - S7_READ_RES_ITEM_SIZE;
+    struct s7_plan_window *windows = calloc(
+        utarray_len(removed) + utarray_len(added) + 1, sizeof(*windows));
+
+    utarray_new(tags, &ut_ptr_icd);
+    s7_plan_window_add(windows, &n_window, removed, reach);
+    s7_plan_window_add(windows, &n_window, added, reach);
+    n_window = s7_plan_window_merge(windows, n_window);
+    utarray_sort(removed, s7_ptr_cmp);
+
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        s7_read_cmd_t *cmd      = &cs->cmd[i];
+        bool           affected = false;
+
+        for (uint8_t j = 0; j < cmd->item_num && !affected; j++) {
+            affected = s7_plan_window_hit(windows, n_window, &cmd->item[j]);
+        }
+        if (!affected) {
+            keep[i] = true;
+            n_keep++;
+            n_item += cmd->item_num;
+            for (uint8_t j = 0; j < cmd->item_num; j++) {
+                n_point += cmd->item[j].n_point;
+                if (cmd->item[j].n_register > n_scratch) {
+                    n_scratch = cmd->item[j].n_register;
+                }
+            }
+            continue;
+        }
+
+        for (uint8_t j = 0; j < cmd->item_num; j++) {
+            for (uint32_t k = 0; k < cmd->item[j].n_point; k++) {
+                s7_point_t *p = cmd->points[cmd->item[j].first + k];
+                if (!s7_point_removed(removed, p)) {
+                    utarray_push_back(tags, &p);
+                }
+            }
+        }
+    }
+    utarray_concat(tags, added);
+
+    s7_read_cmd_sort_t *sub = NULL;
+    if (utarray_len(tags) > 0) {
+        sub = s7_tag_sort(tags, param);
+        n_keep += sub->n_cmd;
+        n_item += sub->n_item;
+        n_point += sub->n_point;
+        if (sub->n_scratch > n_scratch) {
+            n_scratch = sub->n_scratch;
+        }
+    }
+
+    //缓存缓冲要放得下保留的和新排的最长item
+    s7_read_cmd_sort_t *result =
+        s7_plan_arena(n_keep, n_item, n_point, n_scratch);
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        if (keep[i]) {
+            s7_plan_append(result, &cs->cmd[i]);
+        }
+    }
+    for (uint16_t i = 0; sub != NULL && i < sub->n_cmd; i++) {
+        s7_plan_append(result, &sub->cmd[i]);
+    }
+
+    free(sub);
+    free(keep);
+    free(cs);
+    free(windows);
+    utarray_free(tags);
+    return result;
+}
+
+//写入的value转换成PDU中的字节,返回字节数;数值按tag的字节序后缀编码,与读取时的解码互逆
+int cal_n_byte(const s7_point_t *point, neu_value_u *value)
 {
     int n = 0;
-    switch (type) {
+    switch (point->type) {
+    case NEU_TYPE_INT8:
+    case NEU_TYPE_UINT8:
+    case NEU_TYPE_BIT:
+        n = sizeof(uint8_t);
+        break;
     case NEU_TYPE_UINT16:
     case NEU_TYPE_INT16:
-        n          = sizeof(uint16_t);
-        value->u16 = htons(value->u16);
-        break;
     case NEU_TYPE_FLOAT:
     case NEU_TYPE_UINT32:
     case NEU_TYPE_INT32:
-        n          = sizeof(uint32_t);
-        value->u32 = htonl(value->u32);
-        break;
-
     case NEU_TYPE_DOUBLE:
     case NEU_TYPE_INT64:
     case NEU_TYPE_UINT64:
-        n          = sizeof(uint64_t);
-        value->u64 = neu_htonll(value->u64);
-        break;
-    case NEU_TYPE_BIT: {
-        n = sizeof(uint8_t);
+        n = s7_encode_value(point, value);
         break;
-    }
     case NEU_TYPE_STRING: {
-        n = option.string.length;
-        switch (option.string.type) {
+        n = point->option.string.length;
+        switch (point->option.string.type) {
         case NEU_DATATAG_STRING_TYPE_H:
             break;
         case NEU_DATATAG_STRING_TYPE_L:
-            neu_datatag_string_ltoh(value->str, option.string.length);
+            neu_datatag_string_ltoh(value->str, point->option.string.length);
             break;
         case NEU_DATATAG_STRING_TYPE_D:
             break;
@@ -216,7 +838,7 @@ int cal_n_byte(int type, neu_value_u *value, neu_datatag_addr_option_u option)
         break;
     }
     case NEU_TYPE_BYTES: {
-        n = option.bytes.length;
+        n = point->option.bytes.length;
         break;
     }
     default:
@@ -226,6 +848,7 @@ int cal_n_byte(int type, neu_value_u *value, neu_datatag_addr_option_u option)
     return n;
 }
 
+//相邻或重叠的tag合并成一条写请求,各tag的值编码后放到它在地址段中的偏移处
 s7_write_cmd_sort_t *s7_write_tags_sort(UT_array *tags)
 {
     neu_tag_sort_result_t *result =
@@ -238,45 +861,29 @@ s7_write_cmd_sort_t *s7_write_tags_sort(UT_array *tags)
     for (uint16_t i = 0; i < result->n_sort; i++) {
         s7_point_write_t *tag =
             *(s7_point_write_t **) utarray_front(result->sorts[i].tags);
-        struct s7_sort_ctx *ctx = result->sorts[i].info.context;
+        struct s7_sort_ctx *ctx    = result->sorts[i].info.context;
+        uint16_t            n_byte = ctx->end - ctx->start;
 
-        int num_tags              = utarray_len(result->sorts[i].tags);
-        sort_result->cmd[i].bytes = calloc(num_tags, sizeof(neu_value_u));
-        int      n_byte = 0;
-        uint8_t *data_bit = calloc((num_tags + 7) / 8, sizeof(uint8_t));
-        // int      k        = 0;
+        sort_result->cmd[i].bytes = calloc(n_byte, sizeof(uint8_t));
         utarray_foreach(result->sorts[i].tags, s7_point_write_t **, tag_s)
         {
-            // if ((*tag_s)->point.area == S7_AREA_COIL) {
-            //     n_byte_tag = cal_n_byte((*tag_s)->point.type, &(*tag_s)->value,
-            //                             (*tag_s)->point.option);
-            //     data_bit[k / 8] += ((*tag_s)->value.i8) << k % 8;
-            //     n_byte += n_byte_tag;
-            //     k++;
-            // } else {
-            //     n_byte_tag = cal_n_byte((*tag_s)->point.type, &(*tag_s)->value,
-            //                             (*tag_s)->point.option);
-            //     memcpy(sort_result->cmd[i].bytes +
-            //                2 *
-            //                    ((*tag_s)->point.start_address -
-            //                     tag->point.start_address),
-            //            &((*tag_s)->value), n_byte_tag);
-            //     n_byte += n_byte_tag;
-            // }
+            neu_value_u value  = (*tag_s)->value;
+            uint16_t    offset = (*tag_s)->point.start_address - ctx->start;
+            int         n      = cal_n_byte(&(*tag_s)->point, &value);
+
+            if (n > n_byte - offset) {
+                n = n_byte - offset;
+            }
+            memcpy(sort_result->cmd[i].bytes + offset, value.bytes.bytes, n);
         }
-        // if ((*(s7_point_write_t **) utarray_front(result->sorts[i].tags))
-        //         ->point.area == S7_AREA_COIL) {
-        //     memcpy(sort_result->cmd[i].bytes, data_bit, (k + 7) / 8);
-        // }
 
         sort_result->cmd[i].tags     = utarray_clone(result->sorts[i].tags);
         sort_result->cmd[i].dbnumber = tag->point.dbnumber;
         sort_result->cmd[i].area     = tag->point.area;
         sort_result->cmd[i].start_address = tag->point.start_address;
-        sort_result->cmd[i].n_register    = ctx->end - ctx->start;
+        sort_result->cmd[i].n_register    = n_byte;
         sort_result->cmd[i].n_byte        = n_byte;
 
-        free(data_bit);
         free(result->sorts[i].info.context);
     }
 
@@ -286,90 +893,9 @@ s7_write_cmd_sort_t *s7_write_tags_sort(UT_array *tags)
 
 void s7_tag_sort_free(s7_read_cmd_sort_t *cs)
 {
-    for (uint16_t i = 0; i < cs->n_cmd; i++) {
-        for (size_t j = 0; j < MaxVars; j++)
-        {
-            utarray_free(cs->cmd[i].tags[j]);
-        }
-        free(cs->cmd[i].tags);
-    }
-
-    free(cs->cmd);
     free(cs);
 }
 
-static int tag_cmp(neu_tag_sort_elem_t *tag1, neu_tag_sort_elem_t *tag2)
-{
-    s7_point_t *p_t1 = (s7_point_t *) tag1->tag;
-    s7_point_t *p_t2 = (s7_point_t *) tag2->tag;
-
-    if (p_t1->area > p_t2->area) {
-        return 1;
-    } else if (p_t1->area < p_t2->area) {
-        return -1;
-    }
-
-    if (p_t1->dbnumber > p_t2->dbnumber) {
-        return 1;
-    } else if (p_t1->dbnumber < p_t2->dbnumber) {
-        return -1;
-    }
-
-    if (p_t1->start_address > p_t2->start_address) {
-        return 1;
-    } else if (p_t1->start_address < p_t2->start_address) {
-        return -1;
-    }
-
-    if (p_t1->n_register > p_t2->n_register) {
-        return 1;
-    } else if (p_t1->n_register < p_t2->n_register) {
-        return -1;
-    }
-
-    return 0;
-}
-
-static bool tag_sort(neu_tag_sort_t *sort, void *tag, void *tag_to_be_sorted)
-{
-    s7_point_t *        t1  = (s7_point_t *) tag;
-    s7_point_t *        t2  = (s7_point_t *) tag_to_be_sorted;
-    struct s7_sort_ctx *ctx = NULL;
-
-    if (sort->info.context == NULL) {
-        sort->info.context = calloc(1, sizeof(struct s7_sort_ctx));
-        ctx                = (struct s7_sort_ctx *) sort->info.context;
-        ctx->start         = t1->start_address;
-        ctx->end           = t1->start_address + t1->n_register;
-        return true;
-    }
-
-    ctx = (struct s7_sort_ctx *) sort->info.context;
-
-    if (t1->area != t2->area) {
-        return false;
-    }
-
-    if (t1->dbnumber != t2->dbnumber) {
-        return false;
-    }
-
-    if (t2->start_address > ctx->end) {
-        return false;
-    }
-    //计算返回数据长度是否超过s7_read_max_byte
-    uint16_t res_len   = (ctx->end - ctx->start) + t2->n_register;
-    if (res_len >= s7_read_max_byte) {
-        return false;
-    }
-
-    if (t2->start_address + t2->n_register > ctx->end) {
-        ctx->end = t2->start_address + t2->n_register;
-    }
-
-    return true;
-}
-
 static int tag_cmp_write(neu_tag_sort_elem_t *tag1, neu_tag_sort_elem_t *tag2)
 {
     s7_point_write_t *p_t1 = (s7_point_write_t *) tag1->tag;
@@ -34,10 +34,13 @@ typedef struct s7_point {
     s7_area_e     area;
     uint16_t      start_address;
     uint16_t      n_register;
+    uint16_t      n_elem; // 数组tag的元素个数,非数组tag为0
 
     neu_type_e                type;
     neu_datatag_addr_option_u option;
     char                      name[NEU_TAG_NAME_LEN];
+
+    void *owner; // 所属的group,合并规划的读取结果按它分发
 } s7_point_t;
 
 typedef struct s7_point_write {
@@ -45,13 +48,50 @@ typedef struct s7_point_write {
     neu_value_u    value;
 } s7_point_write_t;
 
-int s7_tag_to_point(const neu_datatag_t *tag, s7_point_t *point);
+int        s7_tag_to_point(const neu_datatag_t *tag, s7_point_t *point);
+neu_type_e s7_array_elem_type(neu_type_e type);
 int s7_write_tag_to_point(const neu_plugin_tag_value_t *tag,
                               s7_point_write_t *        point);
 
+// 读请求在PDU中的开销,用于规划每个读PDU能装下的item
+// 请求: S7头10字节 + 功能码/item数2字节 + 每个item 12字节
+// 应答: S7头12字节 + 功能码/item数2字节 + 每个item 4字节头 + 数据(奇数补1字节)
+#define S7_READ_REQ_HEADER_SIZE 12
+#define S7_READ_REQ_ITEM_SIZE 12
+#define S7_READ_RES_HEADER_SIZE 14
+#define S7_READ_RES_ITEM_SIZE 4
+// 完整读请求帧的大小,含TPKT/COTP头
+#define S7_READ_REQ_FRAME_SIZE(n_item)                         \
+    (S7_ISO_DT_HEADER_SIZE + S7_READ_REQ_HEADER_SIZE + \
+     (n_item) * S7_READ_REQ_ITEM_SIZE)
+// 跨空洞合并允许的最大空洞字节数
+#define S7_READ_GAP_MAX 256
+
+// 读请求规划参数
+typedef struct s7_plan_param {
+    uint16_t pdu_size; // 协商得到的S7 PDU大小
+    uint16_t gap;      // 同一DB中相距不超过gap字节的tag合并读取,中间空洞一并读回
+    // 返回DB的字节数,<=0表示未知;未知大小的DB不跨空洞合并
+    int32_t (*db_size)(void *ctx, uint16_t dbnumber);
+    void *db_ctx;
+    uint8_t split; // 每个cmd只装满应答容量的1/split,>1时用更多更小的PDU并行读取
+} s7_plan_param_t;
+
+// 读规划:cmd、point指针、解码程序、item、预编码的请求帧和缓存缓冲放在一次分配的arena中,释放时一次free
+// 同一item的point在points中连续,同一cmd的item在items中连续
 typedef struct s7_read_cmd_sort {
-    uint16_t      n_cmd;
-    s7_read_cmd_t *cmd;
+    uint16_t        n_cmd;
+    s7_read_cmd_t * cmd;
+    uint32_t        n_item;
+    s7_read_item_t *items;
+    uint32_t        n_point;
+    s7_point_t **   points;
+    struct s7_decode_op *ops;
+    uint64_t *           raw;
+    uint32_t        n_frame; // frames中已使用的字节数
+    uint8_t *       frames;
+    uint16_t        n_scratch; // 最长item的字节数
+    uint8_t *       scratch;   // 缓存命中时取出item数据的缓冲,同一规划同一时刻只有一个周期使用
 } s7_read_cmd_sort_t;
 
 typedef struct s7_write_cmd {
@@ -59,7 +99,7 @@ typedef struct s7_write_cmd {
     s7_area_e     area;
     uint16_t      start_address;
     uint16_t      n_register;
-    uint8_t       n_byte;
+    uint16_t      n_byte;
     uint8_t *     bytes;
 
     UT_array *tags;
@@ -70,7 +110,10 @@ typedef struct s7_write_cmd_sort {
     s7_write_cmd_t *cmd;
 } s7_write_cmd_sort_t;
 
-s7_read_cmd_sort_t * s7_tag_sort(UT_array *tags, uint16_t max_byte);
+s7_read_cmd_sort_t * s7_tag_sort(UT_array *tags, const s7_plan_param_t *param);
+s7_read_cmd_sort_t * s7_tag_sort_update(s7_read_cmd_sort_t *cs,
+                                        UT_array *removed, UT_array *added,
+                                        const s7_plan_param_t *param);
 s7_write_cmd_sort_t *s7_write_tags_sort(UT_array *tags);
 void                     s7_tag_sort_free(s7_read_cmd_sort_t *cs);
 
@@ -16,311 +16,844 @@
  * along with this program; if not, write to the Free Software Foundation,
  * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  **/
-#include <time.h>
-
 #include "s7_req.h"
 
 static void plugin_group_free(neu_plugin_group_t *pgp);
-static int  process_protocol_buf(neu_plugin_t *plugin, uint8_t reserve_id,
-                                 uint16_t response_size);
+static int  s7_write_submit(neu_plugin_t *plugin, void *req, bool response,
+                            uint16_t dbnumber, s7_area_e area,
+                            uint16_t start_address, uint16_t n_register,
+                            uint8_t *bytes, uint16_t n_byte);
+static int  s7_group_plan(neu_plugin_t *plugin, struct s7_group_data *gd);
+static void s7_merge_done(struct s7_group_data *mgd);
+static void s7_merge_drop(neu_plugin_t *plugin, struct s7_group_data *gd);
+static void s7_merge_free(struct s7_group_data *mgd);
+static void s7_group_start(struct s7_group_data *gd);
+static const char *s7_point_group(const s7_point_t *point);
+static s7_read_cmd_t *s7_group_cached(struct s7_group_data *gd, uint16_t idx);
+
+//按空闲job数发送排队的写请求和各group本周期未发送的读请求
+//group的cmd由各连接从同一队列按空闲程度领取,慢连接不会拖住整个周期
+//会话内所有节点的group共用同一队列,不同节点的请求交替占用空闲job
+void s7_stack_pump(s7_session_t *session)
+{
+    s7_link_t *link = NULL;
+
+    while (utarray_len(session->writes) > 0 &&
+           (link = s7_links_idle(session)) != NULL) {
+        struct s7_write_pending w =
+            *(struct s7_write_pending *) utarray_front(session->writes);
+        uint16_t response_size = 0;
+
+        utarray_erase(session->writes, 0, 1);
+        int ret = s7_stack_write(link->stack, w.plugin, w.req, w.dbnumber,
+                                 w.area, w.start_address, w.n_register,
+                                 w.bytes, w.n_byte, &response_size, w.response);
+        free(w.bytes);
+        if (ret <= 0 && ret != S7_STACK_ENCODE_ERR) {
+            s7_link_fail(link);
+        }
+    }
+
+    //规划读请求前查询DB大小,查询排在读请求前面
+    s7_session_db_query(session);
+
+    utarray_foreach(session->groups, struct s7_group_data **, p_gd)
+    {
+        struct s7_group_data *gd = *p_gd;
+
+        //合并读取中的成员由合并规划代为发送
+        if (gd->cmd_sort == NULL || gd->merged != NULL) {
+            continue;
+        }
+
+        while (gd->busy && gd->next_cmd < gd->cmd_sort->n_cmd &&
+               (link = s7_links_idle(session)) != NULL) {
+            uint16_t response_size = 0;
+            //缓存命中每个cmd只处理一次,发送失败重试时沿用上次剩下的部分
+            if (gd->next_read == NULL) {
+                gd->next_read = &gd->cmd_sort->cmd[gd->next_cmd];
+                if (gd->plugin->cache_ms > 0 && !gd->next_read->oversize &&
+                    (gd->next_read = s7_group_cached(gd, gd->next_cmd)) ==
+                        NULL) {
+                    gd->next_cmd++;
+                    continue;
+                }
+            }
+            s7_read_cmd_t *cmd = gd->next_read;
+            int            ret = cmd->oversize
+                ? S7_STACK_ENCODE_ERR
+                : s7_stack_read(link->stack, gd->plugin, cmd, gd,
+                                &response_size);
+            //规划时已超出应答PDU的cmd,以及PDU变小后规划更新前请求或应答超出PDU的cmd,
+            //都不发送,其tag按读失败上报
+            if (ret == S7_STACK_ENCODE_ERR) {
+                for (uint8_t i = 0; i < cmd->item_num; i++) {
+                    s7_value_handle(gd->plugin, gd, cmd, i, 0, NULL,
+                                    NEU_ERR_PLUGIN_READ_FAILURE);
+                }
+            } else if (ret <= 0) {
+                //发送失败的cmd留在队列中,由其余连接重新领取
+                s7_link_fail(link);
+                continue;
+            }
+            gd->next_cmd++;
+            gd->next_read = NULL;
+        }
+
+        //全部cmd已发送且应答(或超时)完毕,本周期结束
+        if (gd->busy && gd->next_cmd >= gd->cmd_sort->n_cmd &&
+            s7_links_jobs_count(session, gd) == 0) {
+            gd->busy = false;
+            gd->rtt  = neu_time_ms() - gd->cycle_ms;
+            if (gd->members != NULL) {
+                s7_merge_done(gd);
+            }
+        }
+    }
 
-void s7_conn_connected(void *data, int fd)
+    s7_session_flush(session);
+}
+
+static int32_t s7_plan_db_size(void *ctx, uint16_t dbnumber)
 {
-    struct neu_plugin *plugin = (struct neu_plugin *) data;
-    (void) fd;
+    return s7_session_db_size((s7_session_t *) ctx, dbnumber);
+}
 
-    plugin->common.link_state = NEU_NODE_LINK_STATE_CONNECTED;
+//按PLC应答的PDU规划,多条连接时取最小值,未协商时按S7最小PDU 240
+//跨空洞上限在read_gap以内由耗时模型决定,模型未就绪时按read_gap
+static void s7_plan_param_init(neu_plugin_t *plugin, uint16_t pdu_size,
+                               s7_plan_param_t *param)
+{
+    uint16_t         parallel = 0;
+    const s7_cost_t *cost     = s7_links_cost(plugin->session, &parallel);
+
+    param->pdu_size = pdu_size != 0 ? pdu_size : 240;
+    param->gap      = cost != NULL ? s7_cost_gap(cost, plugin->read_gap)
+                                   : plugin->read_gap;
+    param->db_size  = s7_plan_db_size;
+    param->db_ctx   = plugin->session;
+    param->split    = 1;
 }
 
-void s7_conn_disconnected(void *data, int fd)
+//按耗时模型决定应答容量拆成几份,n_cmd为不拆分时的cmd数
+static uint8_t s7_plan_split(neu_plugin_t *plugin, s7_read_cmd_sort_t *cs,
+                             uint16_t n_cmd)
 {
-    struct neu_plugin *plugin = (struct neu_plugin *) data;
-    (void) fd;
+    uint16_t         parallel = 0;
+    const s7_cost_t *cost     = s7_links_cost(plugin->session, &parallel);
+    uint32_t         n_item   = 0;
+    uint32_t         n_byte   = 0;
 
-    plugin->common.link_state = NEU_NODE_LINK_STATE_DISCONNECTED;
+    if (cost == NULL) {
+        return 1;
+    }
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        n_item += cs->cmd[i].item_num;
+        for (uint8_t j = 0; j < cs->cmd[i].item_num; j++) {
+            n_byte += cs->cmd[i].item[j].n_register;
+        }
+    }
+    return s7_cost_split(cost, n_cmd, n_item, n_byte, parallel);
 }
 
-void s7_tcp_server_listen(void *data, int fd)
+static int s7_point_name_cmp(const void *a, const void *b)
 {
-    struct neu_plugin *  plugin = (struct neu_plugin *) data;
-    neu_event_io_param_t param  = {
-        .cb       = s7_tcp_server_io_callback,
-        .fd       = fd,
-        .usr_data = (void *) plugin,
-    };
+    return strcmp((*(s7_point_t *const *) a)->name,
+                  (*(s7_point_t *const *) b)->name);
+}
+
+static int s7_tag_name_cmp(const void *a, const void *b)
+{
+    return strcmp((*(neu_datatag_t *const *) a)->name,
+                  (*(neu_datatag_t *const *) b)->name);
+}
 
-    plugin->tcp_server_io = neu_event_add_io(plugin->events, param);
+static bool s7_point_same(const s7_point_t *p1, const s7_point_t *p2)
+{
+    return p1->area == p2->area && p1->dbnumber == p2->dbnumber &&
+        p1->start_address == p2->start_address &&
+        p1->n_register == p2->n_register && p1->type == p2->type &&
+        memcmp(&p1->option, &p2->option, sizeof(p1->option)) == 0;
 }
 
-void s7_tcp_server_stop(void *data, int fd)
+static void s7_group_point_free(struct s7_group_data *gd, s7_point_t *point)
 {
-    struct neu_plugin *plugin = (struct neu_plugin *) data;
-    (void) fd;
+    if (point < gd->points || point >= gd->points + gd->n_point) {
+        free(point);
+    }
+}
+
+//规划登记到节点的数据缓存,释放时注销
+static void s7_group_residual_free(struct s7_group_data *gd);
 
-    neu_event_del_io(plugin->events, plugin->tcp_server_io);
+static void s7_group_plan_set(struct s7_group_data *gd, s7_read_cmd_sort_t *cs)
+{
+    gd->cmd_sort = cs;
+    s7_cache_plan_add(gd->plugin->cache, cs);
+
+    //超出应答PDU的tag不会读取,规划时提示一次
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        if (cs->cmd[i].oversize) {
+            plog_warn(gd->plugin,
+                      "group %s: %s DB%hu %hu+%hu exceeds pdu, not read",
+                      gd->group, cs->points[cs->cmd[i].item[0].first]->name,
+                      cs->cmd[i].item[0].dbnumber,
+                      cs->cmd[i].item[0].start_address,
+                      cs->cmd[i].item[0].n_register);
+        }
+    }
 }
 
-int s7_tcp_server_io_callback(enum neu_event_io_type type, int fd,
-                                  void *usr_data)
+static void s7_group_residual_free(struct s7_group_data *gd)
 {
-    neu_plugin_t *plugin = (neu_plugin_t *) usr_data;
+    free(gd->residual);
+    gd->residual   = NULL;
+    gd->n_residual = 0;
+    gd->next_read  = NULL;
+}
 
-    switch (type) {
-    case NEU_EVENT_IO_READ: {
-        int client_fd = neu_conn_tcp_server_accept(plugin->conn);
-        if (client_fd > 0) {
-            plugin->client_fd = client_fd;
+//合并规划收到的数据也算作各成员自己读到的
+static void s7_group_read_set(struct s7_group_data *gd, int64_t now)
+{
+    gd->read_ms = now;
+    if (gd->members != NULL) {
+        utarray_foreach(gd->members, struct s7_group_data **, p_gd)
+        {
+            (*p_gd)->read_ms = now;
         }
+    }
+}
 
-        break;
+static int64_t s7_group_read_ms(struct s7_group_data *gd)
+{
+    int64_t read_ms = gd->read_ms;
+
+    if (gd->members != NULL) {
+        utarray_foreach(gd->members, struct s7_group_data **, p_gd)
+        {
+            if ((*p_gd)->read_ms > read_ms) {
+                read_ms = (*p_gd)->read_ms;
+            }
+        }
     }
-    case NEU_EVENT_IO_CLOSED:
-    case NEU_EVENT_IO_HUP:
-        plog_warn(plugin, "tcp server recv: %d, conn closed, fd: %d", type, fd);
-        neu_event_del_io(plugin->events, plugin->tcp_server_io);
-        neu_conn_disconnect(plugin->conn);
-        break;
+    return read_ms;
+}
+
+static void s7_group_plan_free(struct s7_group_data *gd)
+{
+    if (gd->cmd_sort == NULL) {
+        return;
     }
 
-    return 0;
+    s7_cache_plan_del(gd->plugin->cache, gd->cmd_sort);
+    s7_group_residual_free(gd);
+    s7_tag_sort_free(gd->cmd_sort);
+    gd->cmd_sort = NULL;
 }
 
-int s7_send_msg(void *ctx, uint16_t n_byte, uint8_t *bytes)
+//新鲜期内由其他group在本group上次读取之后读到的item直接上报,
+//返回剩下需要读取的cmd,全部命中时返回NULL
+//剩下的item放在该cmd对应的residual中,同一group同一时刻只有一个周期,不会相互覆盖
+static s7_read_cmd_t *s7_group_cached(struct s7_group_data *gd, uint16_t idx)
 {
-    neu_plugin_t *plugin = (neu_plugin_t *) ctx;
-    int           ret    = 0;
+    neu_plugin_t * plugin = gd->plugin;
+    s7_read_cmd_t *cmd    = &gd->cmd_sort->cmd[idx];
+    s7_read_cmd_t *rest   = NULL;
+    int64_t        since  = s7_cache_since(neu_time_ms(), plugin->cache_ms,
+                                    s7_group_read_ms(gd));
+    uint8_t *      bytes  = gd->cmd_sort->scratch; // 放在规划的arena中,不占reactor线程的栈
+    uint8_t        hits   = 0;
+
+    //residual的cmd和item一次分配,item与规划中的item一一对应
+    if (gd->residual == NULL) {
+        s7_read_cmd_sort_t *cs = gd->cmd_sort;
+
+        gd->n_residual = cs->n_cmd;
+        gd->residual   = calloc(1, cs->n_cmd * sizeof(s7_read_cmd_t) +
+                                     cs->n_item * sizeof(s7_read_item_t));
+        s7_read_item_t *items = (s7_read_item_t *) &gd->residual[cs->n_cmd];
+        for (uint16_t i = 0; i < cs->n_cmd; i++) {
+            gd->residual[i].item   = items + (cs->cmd[i].item - cs->items);
+            gd->residual[i].points = cs->points;
+            gd->residual[i].ops    = cs->ops;
+            gd->residual[i].raw    = cs->raw;
+        }
+    }
+    rest           = &gd->residual[idx];
+    rest->item_num = 0;
+
+    for (uint8_t i = 0; i < cmd->item_num; i++) {
+        if (s7_cache_lookup(plugin->cache, &cmd->item[i], since, bytes) == 0) {
+            s7_value_handle(plugin, gd, cmd, i, cmd->item[i].n_register, bytes,
+                            NEU_ERR_SUCCESS);
+            hits++;
+            continue;
+        }
+        rest->item[rest->item_num++] = cmd->item[i];
+    }
 
-    plog_send_protocol(plugin, bytes, n_byte);
+    plugin->cache_hits += hits;
+    if (hits == 0) {
+        return cmd;
+    }
+    return rest->item_num > 0 ? rest : NULL;
+}
 
-    if (plugin->is_server) {
-        ret = neu_conn_tcp_server_send(plugin->conn, plugin->client_fd, bytes,
-                                       n_byte);
-    } else {
-        ret = neu_conn_send(plugin->conn, bytes, n_byte);
+static void s7_group_data_free(struct s7_group_data *gd)
+{
+    s7_group_plan_free(gd);
+
+    utarray_foreach(gd->tags, s7_point_t **, tag)
+    {
+        s7_group_point_free(gd, *tag);
     }
+    free(gd->points);
 
-    return ret;
+    utarray_free(gd->tags);
+    free(gd->group);
+
+    free(gd);
 }
 
-int s7_stack_read_retry(neu_plugin_t *plugin, struct s7_group_data *gd,
-                            uint16_t i, uint16_t j, uint16_t *response_size)
+void s7_plan_init(neu_plugin_t *plugin)
 {
-    struct timespec t3 = { .tv_sec = plugin->retry_interval / 1000,
-                           .tv_nsec =
-                               1000 * 1000 * (plugin->retry_interval % 1000) };
-    struct timespec t4 = { 0 };
-    nanosleep(&t3, &t4);
-    plog_notice(plugin, "Resend read req. Times:%hu", j + 1);
-    int ret = s7_stack_read(plugin->stack, &(gd->cmd_sort->cmd[i]), response_size);
-    return ret;
+    pthread_mutex_init(&plugin->plan_mtx, NULL);
+    utarray_new(plugin->plan_edited, &ut_str_icd);
+    utarray_new(plugin->plan_retired, &ut_ptr_icd);
+    utarray_new(plugin->merges, &ut_ptr_icd);
+    plugin->cache = s7_cache_new();
 }
 
-int s7_stack_connect(neu_plugin_t *plugin)
+void s7_plan_uninit(neu_plugin_t *plugin)
 {
-    clock_t start_time = clock();
-    while (1)
+    utarray_foreach(plugin->plan_retired, struct s7_group_data **, p_gd)
+    {
+        s7_group_data_free(*p_gd);
+    }
+    utarray_free(plugin->plan_retired);
+    utarray_foreach(plugin->merges, struct s7_group_data **, p_gd)
     {
-        int ret = s7_stack_Handshake(plugin->stack);
-        if (ret == 0)
+        s7_merge_free(*p_gd);
+    }
+    utarray_free(plugin->merges);
+    utarray_free(plugin->plan_edited);
+    s7_cache_free(plugin->cache);
+    pthread_mutex_destroy(&plugin->plan_mtx);
+}
+
+//记录tag有变化的group,group为NULL时表示不确定是哪个group
+void s7_plan_edited(neu_plugin_t *plugin, const char *group)
+{
+    pthread_mutex_lock(&plugin->plan_mtx);
+    if (group == NULL) {
+        plugin->plan_edit_ms = neu_time_ms();
+    } else {
+        bool found = false;
+        utarray_foreach(plugin->plan_edited, char **, name)
         {
+            if (strcmp(*name, group) == 0) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            utarray_push_back(plugin->plan_edited, &group);
+        }
+    }
+    pthread_mutex_unlock(&plugin->plan_mtx);
+}
+
+//group因编辑tag被释放时暂存其规划,返回false表示不需要暂存
+static bool s7_plan_retire(neu_plugin_t *plugin, struct s7_group_data *gd)
+{
+    int64_t now = neu_time_ms();
+
+    pthread_mutex_lock(&plugin->plan_mtx);
+    bool retire = now - plugin->plan_edit_ms < S7_PLAN_RETIRE_MS;
+    utarray_foreach(plugin->plan_edited, char **, name)
+    {
+        if (strcmp(*name, gd->group) == 0) {
+            utarray_erase(plugin->plan_edited,
+                          utarray_eltidx(plugin->plan_edited, name), 1);
+            retire = true;
+            break;
+        }
+    }
+
+    if (retire) {
+        gd->retire_ms = now;
+        gd->session   = NULL;
+        gd->busy      = false;
+        utarray_push_back(plugin->plan_retired, &gd);
+    }
+
+    //释放没有被取回的旧规划(group已删除)
+    for (unsigned i = 0; i < utarray_len(plugin->plan_retired);) {
+        struct s7_group_data *old = *(struct s7_group_data **) utarray_eltptr(
+            plugin->plan_retired, i);
+        if (now - old->retire_ms >= S7_PLAN_RETIRE_MS) {
+            utarray_erase(plugin->plan_retired, i, 1);
+            s7_group_data_free(old);
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&plugin->plan_mtx);
+
+    return retire;
+}
+
+static struct s7_group_data *s7_plan_take(neu_plugin_t *plugin,
+                                          const char *  group)
+{
+    struct s7_group_data *gd = NULL;
+
+    pthread_mutex_lock(&plugin->plan_mtx);
+    utarray_foreach(plugin->plan_retired, struct s7_group_data **, p_gd)
+    {
+        if (strcmp((*p_gd)->group, group) == 0) {
+            gd = *p_gd;
+            utarray_erase(plugin->plan_retired,
+                          utarray_eltidx(plugin->plan_retired, p_gd), 1);
             break;
         }
-        else
+    }
+    pthread_mutex_unlock(&plugin->plan_mtx);
+
+    return gd;
+}
+
+//新旧tag按名称归并比较,地址/类型没变的tag沿用旧point,只重排变化涉及的cmd
+static void s7_group_tags_update(neu_plugin_t *plugin, struct s7_group_data *gd,
+                                 neu_plugin_group_t *group)
+{
+    unsigned        n_new   = utarray_len(group->tags);
+    unsigned        n_old   = utarray_len(gd->tags);
+    s7_point_t **   old     = (s7_point_t **) utarray_front(gd->tags);
+    neu_datatag_t **sorted  = calloc(n_new + 1, sizeof(neu_datatag_t *));
+    UT_array *      tags    = NULL;
+    UT_array *      removed = NULL;
+    UT_array *      added   = NULL;
+    unsigned        i = 0, j = 0;
+
+    for (unsigned k = 0; k < n_new; k++) {
+        sorted[k] = (neu_datatag_t *) utarray_eltptr(group->tags, k);
+    }
+    qsort(sorted, n_new, sizeof(neu_datatag_t *), s7_tag_name_cmp);
+
+    utarray_new(tags, &ut_ptr_icd);
+    utarray_new(removed, &ut_ptr_icd);
+    utarray_new(added, &ut_ptr_icd);
+    utarray_reserve(tags, n_new);
+
+    while (i < n_old || j < n_new) {
+        int cmp = i == n_old ? 1
+            : j == n_new     ? -1
+                             : strcmp(old[i]->name, sorted[j]->name);
+
+        if (cmp < 0) {
+            utarray_push_back(removed, &old[i++]);
+            continue;
+        }
+
+        s7_point_t     point = { 0 };
+        neu_datatag_t *tag   = sorted[j++];
+        int            ret   = s7_tag_to_point(tag, &point);
+        if (ret == NEU_ERR_SUCCESS && cmp == 0 &&
+            s7_point_same(old[i], &point)) {
+            utarray_push_back(tags, &old[i++]);
+            continue;
+        }
+        if (cmp == 0) {
+            utarray_push_back(removed, &old[i++]);
+        }
+        //地址无法解析的tag不参与规划,与全量规划一致
+        if (ret != NEU_ERR_SUCCESS) {
+            plog_error(plugin, "invalid tag: %s, address: %s", tag->name,
+                       tag->address);
+            continue;
+        }
+
+        s7_point_t *p = calloc(1, sizeof(s7_point_t));
+        *p            = point;
+        p->owner      = gd;
+        utarray_push_back(added, &p);
+        utarray_push_back(tags, &p);
+    }
+    free(sorted);
+
+    plog_notice(plugin, "group %s: %u tags, %u removed, %u added", gd->group,
+                n_new, utarray_len(removed), utarray_len(added));
+
+    if (gd->cmd_sort != NULL &&
+        (utarray_len(removed) > 0 || utarray_len(added) > 0)) {
+        s7_plan_param_t param = { 0 };
+        s7_plan_param_init(plugin, gd->plan_pdu_size, &param);
+        param.gap   = gd->plan_gap;
+        param.split = gd->plan_split;
+        if (plugin->read_gap > 0) {
+            //新DB的大小还未知,本次不跨空洞合并,之后全量规划时生效
+            s7_session_db_discover(plugin->session, added);
+        }
+        //cmd的下标会变化,residual随旧规划一起作废
+        s7_cache_plan_del(plugin->cache, gd->cmd_sort);
+        s7_group_residual_free(gd);
+        s7_group_plan_set(
+            gd, s7_tag_sort_update(gd->cmd_sort, removed, added, &param));
+    }
+
+    utarray_foreach(removed, s7_point_t **, p) { s7_group_point_free(gd, *p); }
+    utarray_free(removed);
+    utarray_free(added);
+    utarray_free(gd->tags);
+    gd->tags = tags;
+}
+
+static const char *s7_point_group(const s7_point_t *point)
+{
+    return ((struct s7_group_data *) point->owner)->group;
+}
+
+static void s7_group_start(struct s7_group_data *gd)
+{
+    gd->busy     = true;
+    gd->due      = false;
+    gd->next_cmd  = 0;
+    gd->next_read = NULL;
+    gd->cycle_ms  = neu_time_ms();
+}
+
+static int s7_gd_cmp(const void *a, const void *b)
+{
+    uintptr_t p1 = (uintptr_t) *(void *const *) a;
+    uintptr_t p2 = (uintptr_t) *(void *const *) b;
+
+    return p1 < p2 ? -1 : p1 > p2;
+}
+
+//释放合并规划,成员恢复为各自读取;持会话锁调用
+static void s7_merge_free(struct s7_group_data *mgd)
+{
+    s7_session_t *session = mgd->session;
+
+    if (session != NULL) {
+        for (uint8_t i = 0; i < session->n_link; i++) {
+            s7_stack_jobs_drop(session->links[i].stack, mgd);
+        }
+        utarray_foreach(session->groups, struct s7_group_data **, p_gd)
         {
-            process_protocol_buf(plugin, 0, 0);
+            if (*p_gd == mgd) {
+                utarray_erase(session->groups,
+                              utarray_eltidx(session->groups, p_gd), 1);
+                break;
+            }
+        }
+    }
+    utarray_foreach(mgd->members, struct s7_group_data **, p_gd)
+    {
+        if ((*p_gd)->merged == mgd) {
+            (*p_gd)->merged = NULL;
+            (*p_gd)->busy   = false;
         }
-        
-        // Check if 3 seconds have passed
-        double time_passed_in_seconds = ((double)(clock() - start_time)) / CLOCKS_PER_SEC;
-        if (time_passed_in_seconds >= 3.0)
+    }
+
+    s7_group_plan_free(mgd);
+    //tags中的point属于各成员
+    utarray_free(mgd->tags);
+    utarray_free(mgd->members);
+    free(mgd->group);
+    free(mgd);
+}
+
+//group释放时丢弃包含它的合并规划
+static void s7_merge_drop(neu_plugin_t *plugin, struct s7_group_data *gd)
+{
+    pthread_mutex_lock(&plugin->plan_mtx);
+    for (unsigned i = 0; i < utarray_len(plugin->merges);) {
+        struct s7_group_data *mgd =
+            *(struct s7_group_data **) utarray_eltptr(plugin->merges, i);
+        bool member = false;
+
+        utarray_foreach(mgd->members, struct s7_group_data **, p_gd)
         {
-            return -1;
+            member = member || *p_gd == gd;
+        }
+        if (member) {
+            utarray_erase(plugin->merges, i, 1);
+            s7_merge_free(mgd);
+        } else {
+            i++;
         }
     }
-    return 0;
+    pthread_mutex_unlock(&plugin->plan_mtx);
 }
 
-//sS7 数据交互
-int64_t s7_stack_datacom(neu_plugin_t *plugin,struct s7_group_data *gd)
+//合并规划本周期结束,成员随之结束
+static void s7_merge_done(struct s7_group_data *mgd)
 {
-    int64_t                rtt = NEU_METRIC_LAST_RTT_MS_MAX;
-    for (uint16_t i = 0; i < gd->cmd_sort->n_cmd; i++) {
-        plugin->cmd_idx        = i;
-        uint16_t response_size = 0;
-        uint64_t read_tms      = neu_time_ms();
-        int      ret_buf       = 0;
-        int      ret_r         = s7_stack_read(plugin->stack,&(gd->cmd_sort->cmd[i]), &response_size);
-        if (ret_r > 0) {
-            ret_buf = process_protocol_buf(
-                plugin, gd->cmd_sort->cmd[i].reserve_id, response_size);
-            if (ret_buf > 0) {
-                rtt = neu_time_ms() - read_tms;
-            } else if (ret_buf == 0) {
-                for (uint16_t j = 0; j < plugin->max_retries; j++) {
-                    ret_r = s7_stack_read_retry(plugin, gd, i, j,
-                                                    &response_size);
-                    if (ret_r > 0) {
-                        ret_buf = process_protocol_buf(
-                            plugin, gd->cmd_sort->cmd[i].reserve_id,
-                            response_size);
-                        if (ret_buf > 0) {
-                            rtt = neu_time_ms() - read_tms;
-                            break;
-                        } else if (ret_buf < 0) {
-                            if (ret_buf == -1) {
-                                s7_value_handle(
-                                    plugin, gd->cmd_sort->cmd[i].reserve_id, 0,
-                                    NULL,
-                                    NEU_ERR_PLUGIN_PROTOCOL_DECODE_FAILURE);
-                                plog_error(
-                                    plugin,
-                                    "modbus message error, skip, %hhu!%hu",
-                                    gd->cmd_sort->cmd[i].reserve_id,
-                                    gd->cmd_sort->cmd[i].item_num);
-                            } else if (ret_buf == -2) {
-                                s7_value_handle(
-                                    plugin, gd->cmd_sort->cmd[i].reserve_id, 0,
-                                    NULL, NEU_ERR_PLUGIN_READ_FAILURE);
-                                plog_error(
-                                    plugin,
-                                    "modbus device response error, skip, "
-                                    "%hhu!%hu",
-                                    gd->cmd_sort->cmd[i].reserve_id,
-                                    gd->cmd_sort->cmd[i].item_num);
-                            }
-                            rtt = neu_time_ms() - read_tms;
-                            break;
-                        }
-                    } else {
-                        s7_value_handle(plugin,
-                                            gd->cmd_sort->cmd[i].reserve_id, 0,
-                                            NULL, NEU_ERR_PLUGIN_DISCONNECTED);
-                        rtt = NEU_METRIC_LAST_RTT_MS_MAX;
-                        neu_conn_disconnect(plugin->conn);
-                        break;
-                    }
-                }
-                if (ret_r > 0 && ret_buf == 0) {
-                    s7_value_handle(plugin, gd->cmd_sort->cmd[i].reserve_id,
-                                        0, NULL,
-                                        NEU_ERR_PLUGIN_DEVICE_NOT_RESPONSE);
-                    plog_warn(plugin,
-                              "no modbus response received, skip, %hhu!%hu",
-                              gd->cmd_sort->cmd[i].reserve_id,
-                              gd->cmd_sort->cmd[i].item_num);
-                }
-            } else if (ret_buf < 0) {
-                if (ret_buf == -1) {
-                    s7_value_handle(plugin, gd->cmd_sort->cmd[i].reserve_id,
-                                        0, NULL,
-                                        NEU_ERR_PLUGIN_PROTOCOL_DECODE_FAILURE);
-                    plog_error(plugin, "s7 message error, skip, %hhu!%hu",
-                               gd->cmd_sort->cmd[i].reserve_id,
-                               gd->cmd_sort->cmd[i].item_num);
-                } else if (ret_buf == -2) {
-                    s7_value_handle(plugin, gd->cmd_sort->cmd[i].reserve_id,
-                                        0, NULL, NEU_ERR_PLUGIN_READ_FAILURE);
-                    plog_error(plugin,
-                               "s7 device response error, skip, %hhu!%hu",
-                               gd->cmd_sort->cmd[i].reserve_id,
-                               gd->cmd_sort->cmd[i].item_num);
+    utarray_foreach(mgd->members, struct s7_group_data **, p_gd)
+    {
+        if ((*p_gd)->merged == mgd) {
+            (*p_gd)->merged = NULL;
+            (*p_gd)->busy   = false;
+            (*p_gd)->rtt    = mgd->rtt;
+        }
+    }
+}
+
+//两个按地址排序的group集合是否相同
+static bool s7_merge_same(UT_array *members, UT_array *due)
+{
+    if (utarray_len(members) != utarray_len(due)) {
+        return false;
+    }
+    for (unsigned i = 0; i < utarray_len(due); i++) {
+        if (*(void **) utarray_eltptr(members, i) !=
+            *(void **) utarray_eltptr(due, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//取成员与due完全相同的合并规划,没有时新建,缓存满时淘汰最久未用的
+static struct s7_group_data *s7_merge_get(neu_plugin_t *plugin,
+                                          s7_session_t *session, UT_array *due)
+{
+    struct s7_group_data *mgd = NULL;
+
+    utarray_sort(due, s7_gd_cmp);
+    utarray_foreach(plugin->merges, struct s7_group_data **, p_gd)
+    {
+        if (s7_merge_same((*p_gd)->members, due)) {
+            mgd = *p_gd;
+            break;
+        }
+    }
+
+    if (mgd == NULL) {
+        if (utarray_len(plugin->merges) >= S7_MERGE_CACHE) {
+            struct s7_group_data **victim = NULL;
+            utarray_foreach(plugin->merges, struct s7_group_data **, p_gd)
+            {
+                if (!(*p_gd)->busy &&
+                    (victim == NULL || (*p_gd)->used_ms < (*victim)->used_ms)) {
+                    victim = p_gd;
                 }
-                rtt = neu_time_ms() - read_tms;
             }
-        } else {
-            for (uint16_t j = 0; j < plugin->max_retries; j++) {
-                ret_r =
-                    s7_stack_read_retry(plugin, gd, i, j, &response_size);
-                if (ret_r > 0) {
-                    ret_buf = process_protocol_buf(
-                        plugin, gd->cmd_sort->cmd[i].reserve_id, response_size);
-                    if (ret_buf > 0) {
-                        rtt = neu_time_ms() - read_tms;
-                        break;
-                    } else if (ret_buf < 0) {
-                        if (ret_buf == -1) {
-                            s7_value_handle(
-                                plugin, gd->cmd_sort->cmd[i].reserve_id, 0, NULL,
-                                NEU_ERR_PLUGIN_PROTOCOL_DECODE_FAILURE);
-                            plog_error(plugin,
-                                       "modbus message error, skip, %hhu!%hu",
-                                       gd->cmd_sort->cmd[i].reserve_id,
-                                       gd->cmd_sort->cmd[i].item_num);
-                        } else if (ret_buf == -2) {
-                            s7_value_handle(
-                                plugin, gd->cmd_sort->cmd[i].reserve_id, 0, NULL,
-                                NEU_ERR_PLUGIN_READ_FAILURE);
-                            plog_error(plugin,
-                                       "modbus device response error, skip, "
-                                       "%hhu!%hu",
-                                       gd->cmd_sort->cmd[i].reserve_id,
-                                       gd->cmd_sort->cmd[i].item_num);
-                        }
-                        rtt = neu_time_ms() - read_tms;
-                        break;
-                    } else if (ret_buf == 0) {
-                        s7_value_handle(
-                            plugin, gd->cmd_sort->cmd[i].reserve_id, 0, NULL,
-                            NEU_ERR_PLUGIN_DEVICE_NOT_RESPONSE);
-                        plog_warn(plugin,
-                                  "no modbus response received, skip, %hhu!%hu",
-                                  gd->cmd_sort->cmd[i].reserve_id,
-                                  gd->cmd_sort->cmd[i].item_num);
-                        continue;
-                    }
-                }
+            if (victim == NULL) {
+                return NULL;
             }
-            if (ret_r <= 0) {
-                s7_value_handle(plugin, gd->cmd_sort->cmd[i].reserve_id, 0,
-                                    NULL, NEU_ERR_PLUGIN_DISCONNECTED);
-                rtt = NEU_METRIC_LAST_RTT_MS_MAX;
-                neu_conn_disconnect(plugin->conn);
-                break;
+            s7_merge_free(*victim);
+            utarray_erase(plugin->merges,
+                          utarray_eltidx(plugin->merges, victim), 1);
+        }
+
+        mgd        = calloc(1, sizeof(struct s7_group_data));
+        mgd->group = strdup("merged");
+        mgd->plugin = plugin;
+        mgd->rtt    = NEU_METRIC_LAST_RTT_MS_MAX;
+        utarray_new(mgd->members, &ut_ptr_icd);
+        utarray_new(mgd->tags, &ut_ptr_icd);
+        utarray_concat(mgd->members, due);
+        utarray_foreach(due, struct s7_group_data **, p_gd)
+        {
+            utarray_concat(mgd->tags, (*p_gd)->tags);
+        }
+        utarray_push_back(plugin->merges, &mgd);
+        plog_notice(plugin, "merged plan for %u groups, %u tags",
+                    utarray_len(due), utarray_len(mgd->tags));
+    }
+
+    if (mgd->busy) {
+        return NULL;
+    }
+    if (mgd->session != session) {
+        mgd->session = session;
+        utarray_push_back(session->groups, &mgd);
+    }
+    if (s7_group_plan(plugin, mgd) > 0) {
+        return NULL;
+    }
+    mgd->used_ms = neu_time_ms();
+    return mgd;
+}
+
+//合并模式下到期的group在会话tick中统一下发,
+//同一tick内到期的多个group按tag并集规划一次,结果按tag所属group分发
+void s7_groups_dispatch(s7_session_t *session)
+{
+    UT_array *due = NULL;
+
+    utarray_new(due, &ut_ptr_icd);
+    utarray_foreach(session->plugins, neu_plugin_t **, p_plugin)
+    {
+        neu_plugin_t *        plugin = *p_plugin;
+        struct s7_group_data *mgd    = NULL;
+
+        if (!plugin->group_merge) {
+            continue;
+        }
+
+        utarray_clear(due);
+        utarray_foreach(session->groups, struct s7_group_data **, p_gd)
+        {
+            if ((*p_gd)->plugin == plugin && (*p_gd)->due) {
+                utarray_push_back(due, p_gd);
             }
         }
-        if (plugin->interval > 0) {
-            struct timespec t1 = { .tv_sec  = plugin->interval / 1000,
-                                   .tv_nsec = 1000 * 1000 *
-                                       (plugin->interval % 1000) };
-            struct timespec t2 = { 0 };
-            nanosleep(&t1, &t2);
+        if (utarray_len(due) > 1) {
+            pthread_mutex_lock(&plugin->plan_mtx);
+            mgd = s7_merge_get(plugin, session, due);
+            pthread_mutex_unlock(&plugin->plan_mtx);
+        }
+
+        if (mgd != NULL) {
+            s7_group_start(mgd);
+        }
+        utarray_foreach(due, struct s7_group_data **, p_gd)
+        {
+            s7_group_start(*p_gd);
+            (*p_gd)->merged = mgd;
+        }
+    }
+    utarray_free(due);
+}
+
+//连接断开,未完成的周期直接结束,排队的写请求按error应答
+void s7_cycles_abort(s7_session_t *session, int error)
+{
+    utarray_foreach(session->groups, struct s7_group_data **, p_gd)
+    {
+        struct s7_group_data *gd = *p_gd;
+        gd->merged               = NULL;
+        if (gd->busy) {
+            gd->busy = false;
+            gd->rtt  = NEU_METRIC_LAST_RTT_MS_MAX;
+            s7_value_handle(gd->plugin, gd, NULL, 0, 0, NULL, error);
+        }
+    }
+
+    utarray_foreach(session->writes, struct s7_write_pending *, w)
+    {
+        if (w->response) {
+            s7_write_resp(w->plugin, w->req, error);
         }
+        free(w->bytes);
     }
-    return rtt;
+    utarray_clear(session->writes);
 }
 
 int s7_group_sort(neu_plugin_t *plugin,neu_plugin_group_t *group,struct s7_group_data **gd)
 {
+    if (group->user_data == NULL &&
+        (*gd = s7_plan_take(plugin, group->group_name)) != NULL) {
+        group->user_data  = (*gd);
+        group->group_free = plugin_group_free;
+        s7_group_tags_update(plugin, *gd, group);
+    }
+
     if (group->user_data == NULL) {
         *gd = calloc(1, sizeof(struct s7_group_data));
 
         group->user_data  = (*gd);
         group->group_free = plugin_group_free;
         utarray_new((*gd)->tags, &ut_ptr_icd);
+        utarray_reserve((*gd)->tags, utarray_len(group->tags));
 
+        //group的point一次分配,编辑tag时新增的point单独分配
+        (*gd)->n_point = utarray_len(group->tags);
+        (*gd)->points  = calloc((*gd)->n_point + 1, sizeof(s7_point_t));
         utarray_foreach(group->tags, neu_datatag_t *, tag)
         {
-            s7_point_t *p   = calloc(1, sizeof(s7_point_t));
-            int             ret = s7_tag_to_point(tag, p);
+            s7_point_t *p = &(*gd)->points[utarray_eltidx(group->tags, tag)];
+            int         ret = s7_tag_to_point(tag, p);
+            p->owner        = *gd;
+            //地址无法解析的tag不参与规划,否则会按DB0地址0读取
             if (ret != NEU_ERR_SUCCESS) {
-                // plog_error(plugin, "invalid tag: %s, address: %s", tag->name,
-                //            tag->address);
+                plog_error(plugin, "invalid tag: %s, address: %s", tag->name,
+                           tag->address);
+                continue;
             }
             utarray_push_back((*gd)->tags, &p);
         }
+        //按名称排序,编辑tag时与新的tag列表归并比较
+        utarray_sort((*gd)->tags, s7_point_name_cmp);
 
         (*gd)->group    = strdup(group->group_name);
+        (*gd)->plugin   = plugin;
+        (*gd)->rtt      = NEU_METRIC_LAST_RTT_MS_MAX;
+    }
+    (*gd) = (struct s7_group_data *) group->user_data;
+
+    //新建的group或节点切换到了新的会话,加入会话的group队列
+    if ((*gd)->session != plugin->session) {
+        (*gd)->session = plugin->session;
+        (*gd)->busy    = false;
+        (*gd)->due     = false;
+        (*gd)->merged  = NULL;
+        utarray_push_back(plugin->session->groups, gd);
+    }
 
-        uint16_t max_byte = 0xF0 - 18 - 7; //240-header-tptk&cotp
-        if (plugin->stack->pdu_size > 0)
-        {
-            max_byte    = plugin->stack->pdu_size- 18 - 7; 
+    return s7_group_plan(plugin, *gd);
+}
+
+//按当前PDU规划gd,PDU重新协商后丢弃旧规划,返回>0表示需要等DB大小
+static int s7_group_plan(neu_plugin_t *plugin, struct s7_group_data *gd)
+{
+
+    //PDU重新协商后丢弃旧规划,等本周期的请求全部结束再重建
+    uint16_t pdu_size = s7_links_pdu_size(plugin->session);
+    if (gd->cmd_sort != NULL && pdu_size != 0 &&
+        gd->plan_pdu_size != pdu_size && !gd->busy &&
+        s7_links_jobs_count(plugin->session, gd) == 0) {
+        plog_notice(plugin, "group %s: pdu size %hu -> %hu, replan",
+                    gd->group, gd->plan_pdu_size, pdu_size);
+        s7_group_plan_free(gd);
+    }
+
+    //耗时模型更新后跨空洞上限或拆分可能变化,定期检查,空闲时重新规划
+    int64_t now = neu_time_ms();
+    if (gd->cmd_sort != NULL && now - gd->cost_ms >= S7_COST_REPLAN_MS &&
+        !gd->busy && s7_links_jobs_count(plugin->session, gd) == 0) {
+        s7_plan_param_t param = { 0 };
+        s7_plan_param_init(plugin, pdu_size, &param);
+        uint16_t n_cmd =
+            (gd->cmd_sort->n_cmd + gd->plan_split - 1) / gd->plan_split;
+        uint8_t split = s7_plan_split(plugin, gd->cmd_sort, n_cmd);
+
+        gd->cost_ms = now;
+        if (param.gap != gd->plan_gap || split != gd->plan_split) {
+            plog_notice(plugin, "group %s: gap %hu -> %hu, split %hhu -> %hhu, replan",
+                        gd->group, gd->plan_gap, param.gap, gd->plan_split,
+                        split);
+            s7_group_plan_free(gd);
+        }
+    }
+
+    if (gd->cmd_sort == NULL) {
+        //跨空洞合并需要DB大小,查询完成前不规划,group本周期不读
+        if (plugin->read_gap > 0 &&
+            !s7_session_db_discover(plugin->session, gd->tags)) {
+            return 1;
+        }
+
+        s7_plan_param_t param = { 0 };
+        s7_plan_param_init(plugin, pdu_size, &param);
+        s7_read_cmd_sort_t *cs = s7_tag_sort(gd->tags, &param);
+
+        //并行job有空闲时拆成更小的PDU重新规划
+        param.split = s7_plan_split(plugin, cs, cs->n_cmd);
+        if (param.split > 1) {
+            s7_tag_sort_free(cs);
+            cs = s7_tag_sort(gd->tags, &param);
         }
-        
-        (*gd)->cmd_sort = s7_tag_sort((*gd)->tags, max_byte);
+        s7_group_plan_set(gd, cs);
+        gd->plan_pdu_size = param.pdu_size;
+        gd->plan_gap      = param.gap;
+        gd->plan_split    = param.split;
+        gd->cost_ms       = now;
     }
-    (*gd)                     = (struct s7_group_data *) group->user_data;
-    plugin->plugin_group_data = (*gd);
     return 0;
 }
 
@@ -329,47 +862,114 @@ int s7_group_timer(neu_plugin_t *plugin, neu_plugin_group_t *group)
     neu_conn_state_t               state = { 0 };
     neu_adapter_update_metric_cb_t update_metric =
         plugin->common.adapter_callbacks->update_metric;
+    s7_session_t *session = plugin->session;
 
-    //S7 数据交互之前需要先进行2次握手 成功后才能进行数据交互
-    int cnt_ret = s7_stack_connect(plugin);
-    if (cnt_ret < 0)
-    {
-        plog_error(plugin, "s7 stack connect failed");
+    if (session == NULL) {
         return -1;
     }
+    pthread_mutex_lock(&session->mtx);
+
+    //S7 数据交互之前需要先进行2次握手 成功后才能进行数据交互
+    //握手应答在events线程中处理,这里只发送请求,不等待
+    //连接池中每条连接各自握手,至少一条完成即可开始周期
+    bool ready = false;
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        s7_link_t *link = &session->links[i];
+
+        int cnt_ret = s7_stack_Handshake(link->stack);
+        if (cnt_ret < 0) {
+            plog_error(plugin, "s7 link %d connect failed", link->index);
+            s7_link_fail(link);
+        } else if (cnt_ret == 0) {
+            ready = true;
+        }
+    }
+    if (!ready) {
+        pthread_mutex_unlock(&session->mtx);
+        return 0;
+    }
 
     //初始化group_data tag sort
     struct s7_group_data *gd  = NULL;
-    s7_group_sort(plugin,group,&gd);
+    if (s7_group_sort(plugin,group,&gd) > 0) {
+        s7_stack_pump(session);
+        pthread_mutex_unlock(&session->mtx);
+        plog_debug(plugin, "group %s: waiting for DB sizes", group->group_name);
+        return 0;
+    }
 
-    //S7 数据交互
-    int64_t rtt = s7_stack_datacom(plugin,gd);
+    //S7 数据交互:上一周期未结束时不重复下发
+    if (gd->busy) {
+        plog_debug(plugin, "group %s: previous cycle still running",
+                   gd->group);
+    } else if (plugin->group_merge) {
+        //在会话tick中与同时到期的group一起下发
+        gd->due = true;
+    } else {
+        s7_group_start(gd);
+    }
+    s7_stack_pump(session);
+    int64_t  rtt        = gd->rtt;
+    uint64_t cache_hits = plugin->cache_hits;
+    uint64_t orphans    = 0;
+    uint64_t send_bytes = 0;
+    uint64_t recv_bytes = 0;
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        state = neu_conn_state(session->links[i].conn);
+        send_bytes += state.send_bytes + session->links[i].send_bytes;
+        recv_bytes += session->links[i].recv_bytes;
+        orphans += session->links[i].stack->orphans;
+    }
+    pthread_mutex_unlock(&session->mtx);
 
-    state = neu_conn_state(plugin->conn);
-    update_metric(plugin->common.adapter, NEU_METRIC_SEND_BYTES,
-                  state.send_bytes, NULL);
-    update_metric(plugin->common.adapter, NEU_METRIC_RECV_BYTES,
-                  state.recv_bytes, NULL);
+    update_metric(plugin->common.adapter, NEU_METRIC_SEND_BYTES, send_bytes,
+                  NULL);
+    update_metric(plugin->common.adapter, NEU_METRIC_RECV_BYTES, recv_bytes,
+                  NULL);
     update_metric(plugin->common.adapter, NEU_METRIC_LAST_RTT_MS, rtt, NULL);
+    update_metric(plugin->common.adapter, S7_METRIC_ORPHAN_RESPONSES, orphans,
+                  NULL);
+    update_metric(plugin->common.adapter, S7_METRIC_CACHE_HITS, cache_hits,
+                  NULL);
     update_metric(plugin->common.adapter, NEU_METRIC_GROUP_LAST_SEND_MSGS,
                   gd->cmd_sort->n_cmd, group->group_name);
     return 0;
 }
 
-int s7_value_handle(void *ctx, uint8_t tag_item_idx, uint16_t n_byte,
-                        uint8_t *bytes, int error)
+//PLC的读应答,开启复用时记下item数据供其他group在新鲜期内使用
+int s7_value_recv(void *ctx, void *user, s7_read_cmd_t *cmd,
+                  uint8_t tag_item_idx, uint16_t n_byte, uint8_t *bytes,
+                  int error)
+{
+    neu_plugin_t *plugin = (neu_plugin_t *) ctx;
+
+    if (plugin->cache_ms > 0 && cmd != NULL && error == NEU_ERR_SUCCESS) {
+        int64_t now = neu_time_ms();
+
+        s7_cache_store(plugin->cache, &cmd->item[tag_item_idx], bytes, n_byte,
+                       now);
+        s7_group_read_set((struct s7_group_data *) user, now);
+    }
+    return s7_value_handle(ctx, user, cmd, tag_item_idx, n_byte, bytes, error);
+}
+
+int s7_value_handle(void *ctx, void *user, s7_read_cmd_t *cmd,
+                    uint8_t tag_item_idx, uint16_t n_byte, uint8_t *bytes,
+                    int error)
 {
     neu_plugin_t *            plugin = (neu_plugin_t *) ctx;
-    struct s7_group_data *gd = (struct s7_group_data *) plugin->plugin_group_data;
+    struct s7_group_data *gd = (struct s7_group_data *) user;
     if(gd == NULL)
     {
         return 0;
     }
 
-    uint16_t start_address = gd->cmd_sort->cmd[plugin->cmd_idx].item[tag_item_idx].start_address;
-    // uint16_t n_register    = gd->cmd_sort->cmd[plugin->cmd_idx].item[tag_item_idx].n_register;
+    //合并规划的成员各自上报断线
+    if (cmd == NULL && gd->members != NULL) {
+        return 0;
+    }
 
-    if (error == NEU_ERR_PLUGIN_DISCONNECTED) {
+    if (error == NEU_ERR_PLUGIN_DISCONNECTED && cmd == NULL) {
         neu_dvalue_t dvalue = { 0 };
 
         dvalue.type      = NEU_TYPE_ERROR;
@@ -377,87 +977,31 @@ int s7_value_handle(void *ctx, uint8_t tag_item_idx, uint16_t n_byte,
         plugin->common.adapter_callbacks->driver.update(
             plugin->common.adapter, gd->group, NULL, dvalue);
         return 0;
-    } else if (error != NEU_ERR_SUCCESS) {
-        utarray_foreach(gd->cmd_sort->cmd[plugin->cmd_idx].tags[tag_item_idx],
-                        s7_point_t **, p_tag)
-        {
-            neu_dvalue_t dvalue = { 0 };
-            dvalue.type         = NEU_TYPE_ERROR;
-            dvalue.value.i32    = error;
-            plugin->common.adapter_callbacks->driver.update(
-                plugin->common.adapter, gd->group, (*p_tag)->name, dvalue);
-        }
+    } else if (cmd == NULL) {
         return 0;
     }
 
-    utarray_foreach(gd->cmd_sort->cmd[plugin->cmd_idx].tags[tag_item_idx], s7_point_t **,
-                    p_tag)
-    {
-        neu_dvalue_t dvalue = { 0 };
-
-        if (n_byte >= ((*p_tag)->start_address - start_address) + (*p_tag)->n_register ) 
-        {
-            memcpy(dvalue.value.bytes.bytes,
-                    bytes +((*p_tag)->start_address - start_address),
-                    (*p_tag)->n_register);
-            dvalue.value.bytes.length = (*p_tag)->n_register;
-        }
+    const s7_read_item_t *item = &cmd->item[tag_item_idx];
+    const s7_decode_op_t *ops  = cmd->ops + item->first;
+    uint64_t *            raw  = cmd->raw + item->first;
 
-        dvalue.type = (*p_tag)->type;
-        switch ((*p_tag)->type) {
-        case NEU_TYPE_INT8:
-        case NEU_TYPE_UINT8:
-            dvalue.value.u8 = bytes[0];
-            break;
-        case NEU_TYPE_UINT16:
-        case NEU_TYPE_INT16:
-            dvalue.value.u16 = ntohs(dvalue.value.u16);
-            break;
-        case NEU_TYPE_FLOAT:
-        case NEU_TYPE_INT32:
-        case NEU_TYPE_UINT32:
-            dvalue.value.u32 = ntohl(dvalue.value.u32);
-            break;
-        case NEU_TYPE_DOUBLE:
-        case NEU_TYPE_INT64:
-        case NEU_TYPE_UINT64:
-            dvalue.value.u64 = neu_ntohll(dvalue.value.u64);
-            break;
-        case NEU_TYPE_BIT: {
-            uint16_t offset = (*p_tag)->start_address - start_address;
-            if (n_byte > offset) {
-                neu_value8_u u8 = { .value = bytes[offset] };
-                dvalue.value.u8 = neu_value8_get_bit(u8, (*p_tag)->option.bit.bit);
-            }
-            break;
-        }
-        case NEU_TYPE_STRING: {
-            switch ((*p_tag)->option.string.type) {
-            case NEU_DATATAG_STRING_TYPE_H:
-                break;
-            case NEU_DATATAG_STRING_TYPE_L:
-                neu_datatag_string_ltoh(dvalue.value.str,
-                                        strlen(dvalue.value.str));
-                break;
-            case NEU_DATATAG_STRING_TYPE_D:
-                break;
-            case NEU_DATATAG_STRING_TYPE_E:
-                break;
-            }
+    if (error == NEU_ERR_SUCCESS) {
+        s7_decode_exec(ops, item->n_point, bytes, n_byte, raw);
+    }
+    for (uint32_t i = 0; i < item->n_point; i++) {
+        s7_point_t * tag    = cmd->points[ops[i].slot];
+        neu_dvalue_t dvalue = { 0 };
+        int          ret    = error;
 
-            if (!neu_datatag_string_is_utf8(dvalue.value.str,
-                                            strlen(dvalue.value.str))) {
-                dvalue.value.str[0] = '?';
-                dvalue.value.str[1] = 0;
-            }
-            break;
+        if (ret == NEU_ERR_SUCCESS) {
+            ret = s7_decode_value(&ops[i], tag, raw[i], bytes, n_byte, &dvalue);
         }
-        default:
-            break;
+        if (ret != NEU_ERR_SUCCESS) {
+            dvalue.type      = NEU_TYPE_ERROR;
+            dvalue.value.i32 = ret;
         }
-
         plugin->common.adapter_callbacks->driver.update(
-            plugin->common.adapter, gd->group, (*p_tag)->name, dvalue);
+            plugin->common.adapter, s7_point_group(tag), tag->name, dvalue);
     }
     return 0;
 }
@@ -468,7 +1012,15 @@ int s7_write(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
     s7_point_t point = { 0 };
     int            ret   = s7_tag_to_point(tag, &point);
     assert(ret == 0);
-    uint8_t n_byte = 0;
+    uint16_t n_byte = 0;
+
+    //数组tag只支持读取
+    if (point.n_elem > 0) {
+        if (response) {
+            s7_write_resp(plugin, req, NEU_ERR_TAG_TYPE_NOT_SUPPORT);
+        }
+        return -1;
+    }
 
     switch (tag->type) {
     case NEU_TYPE_INT8:
@@ -477,21 +1029,14 @@ int s7_write(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
         break;
     case NEU_TYPE_UINT16:
     case NEU_TYPE_INT16:
-        value.u16 = htons(value.u16);
-        n_byte    = sizeof(uint16_t);
-        break;
     case NEU_TYPE_FLOAT:
     case NEU_TYPE_UINT32:
     case NEU_TYPE_INT32:
-        value.u32 = htonl(value.u32);
-        n_byte    = sizeof(uint32_t);
-        break;
-
     case NEU_TYPE_DOUBLE:
     case NEU_TYPE_INT64:
     case NEU_TYPE_UINT64:
-        value.u64 = neu_htonll(value.u64);
-        n_byte    = sizeof(uint64_t);
+        // 按tag的字节序后缀编码,与读取时的解码互逆
+        n_byte = s7_encode_value(&point, &value);
         break;
     case NEU_TYPE_BIT: {
         n_byte = sizeof(uint8_t);
@@ -521,17 +1066,65 @@ int s7_write(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
         break;
     }
 
-    uint16_t response_size = 0;
-    ret                    = s7_stack_write(
-        plugin->stack, req, point.dbnumber, point.area, point.start_address,
-        point.n_register, value.bytes.bytes, n_byte, &response_size, response);
-    if (ret > 0) {
-        process_protocol_buf(plugin, point.dbnumber, response_size);
+    if (plugin->session == NULL) {
+        if (response) {
+            s7_write_resp(plugin, req, NEU_ERR_PLUGIN_DISCONNECTED);
+        }
+        return -1;
     }
+    pthread_mutex_lock(&plugin->session->mtx);
+    ret = s7_write_submit(plugin, req, response, point.dbnumber, point.area,
+                          point.start_address, point.n_register,
+                          value.bytes.bytes, n_byte);
+    pthread_mutex_unlock(&plugin->session->mtx);
 
     return ret;
 }
 
+//有空闲job时直接发送,否则排队,由s7_stack_pump在job释放后发送
+static int s7_write_submit(neu_plugin_t *plugin, void *req, bool response,
+                           uint16_t dbnumber, s7_area_e area,
+                           uint16_t start_address, uint16_t n_register,
+                           uint8_t *bytes, uint16_t n_byte)
+{
+    s7_session_t *session = plugin->session;
+    s7_link_t *   link    = NULL;
+
+    if (s7_links_pdu_size(session) == 0) {
+        if (response) {
+            s7_write_resp(plugin, req, NEU_ERR_PLUGIN_DISCONNECTED);
+        }
+        return -1;
+    }
+
+    if ((link = s7_links_idle(session)) != NULL) {
+        uint16_t response_size = 0;
+        int      ret = s7_stack_write(link->stack, plugin, req, dbnumber, area,
+                                 start_address, n_register, bytes, n_byte,
+                                 &response_size, response);
+        if (ret <= 0 && ret != S7_STACK_ENCODE_ERR) {
+            s7_link_fail(link);
+        }
+        s7_session_flush(session);
+        return ret;
+    }
+
+    struct s7_write_pending w = {
+        .plugin        = plugin,
+        .req           = req,
+        .response      = response,
+        .dbnumber      = dbnumber,
+        .area          = area,
+        .start_address = start_address,
+        .n_register    = n_register,
+        .n_byte        = n_byte,
+        .bytes = calloc(n_register > n_byte ? n_register : n_byte, 1),
+    };
+    memcpy(w.bytes, bytes, n_byte);
+    utarray_push_back(session->writes, &w);
+    return n_byte;
+}
+
 int s7_write_tag(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
                      neu_value_u value)
 {
@@ -540,11 +1133,13 @@ int s7_write_tag(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
     return ret;
 }
 
+//每条写请求都带着batch发送,由s7_write_resp在最后一条有结果时应答
 int s7_write_tags(neu_plugin_t *plugin, void *req, UT_array *tags)
 {
     struct s7_write_tags_data *gtags = NULL;
+    struct s7_write_batch *        batch = NULL;
     int                            ret   = 0;
-    int                            rv    = 0;
+    int                            rv    = NEU_ERR_SUCCESS;
 
     gtags = calloc(1, sizeof(struct s7_write_tags_data));
 
@@ -555,58 +1150,81 @@ int s7_write_tags(neu_plugin_t *plugin, void *req, UT_array *tags)
         ret                     = s7_write_tag_to_point(tag, p);
         assert(ret == 0);
 
+        //数组tag只支持读取
+        if (p->point.n_elem > 0) {
+            rv = NEU_ERR_TAG_TYPE_NOT_SUPPORT;
+        }
         utarray_push_back(gtags->tags, &p);
     }
-    gtags->cmd_sort = s7_write_tags_sort(gtags->tags);
-    for (uint16_t i = 0; i < gtags->cmd_sort->n_cmd; i++) {
-        uint16_t response_size = 0;
+    if (rv == NEU_ERR_SUCCESS && plugin->session == NULL) {
+        rv = NEU_ERR_PLUGIN_DISCONNECTED;
+    }
 
-        ret = s7_stack_write(
-            plugin->stack, req, gtags->cmd_sort->cmd[i].dbnumber,
-            gtags->cmd_sort->cmd[i].area, gtags->cmd_sort->cmd[i].start_address,
-            gtags->cmd_sort->cmd[i].n_register, gtags->cmd_sort->cmd[i].bytes,
-            gtags->cmd_sort->cmd[i].n_byte, &response_size, false);
-        if (ret > 0) {
-            process_protocol_buf(plugin, gtags->cmd_sort->cmd[i].dbnumber,
-                                 response_size);
+    if (rv != NEU_ERR_SUCCESS) {
+        s7_write_resp(plugin, req, rv);
+        ret = -1;
+    } else {
+        gtags->cmd_sort = s7_write_tags_sort(gtags->tags);
+
+        pthread_mutex_lock(&plugin->session->mtx);
+        //多计一个,全部提交后再释放,提交中同步失败的请求不会提前应答
+        batch         = calloc(1, sizeof(struct s7_write_batch));
+        batch->req    = req;
+        batch->n_wait = gtags->cmd_sort->n_cmd + 1;
+        batch->error  = NEU_ERR_SUCCESS;
+        utarray_push_back(plugin->write_batches, &batch);
+        for (uint16_t i = 0; i < gtags->cmd_sort->n_cmd; i++) {
+            ret = s7_write_submit(plugin, batch, true,
+                                  gtags->cmd_sort->cmd[i].dbnumber,
+                                  gtags->cmd_sort->cmd[i].area,
+                                  gtags->cmd_sort->cmd[i].start_address,
+                                  gtags->cmd_sort->cmd[i].n_register,
+                                  gtags->cmd_sort->cmd[i].bytes,
+                                  gtags->cmd_sort->cmd[i].n_byte);
         }
+        s7_write_resp(plugin, batch, NEU_ERR_SUCCESS);
+        pthread_mutex_unlock(&plugin->session->mtx);
 
-        if (ret <= 0) {
-            rv = 1;
+        for (uint16_t i = 0; i < gtags->cmd_sort->n_cmd; i++) {
+            utarray_free(gtags->cmd_sort->cmd[i].tags);
+            free(gtags->cmd_sort->cmd[i].bytes);
         }
-        if (plugin->interval > 0) {
-            struct timespec t1 = { .tv_sec  = plugin->interval / 1000,
-                                   .tv_nsec = 1000 * 1000 *
-                                       (plugin->interval % 1000) };
-            struct timespec t2 = { 0 };
-            nanosleep(&t1, &t2);
-        }
-    }
-
-    if (rv == 0) {
-        plugin->common.adapter_callbacks->driver.write_response(
-            plugin->common.adapter, req, NEU_ERR_SUCCESS);
-    } else {
-        plugin->common.adapter_callbacks->driver.write_response(
-            plugin->common.adapter, req, NEU_ERR_PLUGIN_DISCONNECTED);
+        free(gtags->cmd_sort->cmd);
+        free(gtags->cmd_sort);
     }
 
-    for (uint16_t i = 0; i < gtags->cmd_sort->n_cmd; i++) {
-        utarray_free(gtags->cmd_sort->cmd[i].tags);
-        free(gtags->cmd_sort->cmd[i].bytes);
-    }
-    free(gtags->cmd_sort->cmd);
-    free(gtags->cmd_sort);
     utarray_foreach(gtags->tags, s7_point_write_t **, tag) { free(*tag); }
     utarray_free(gtags->tags);
     free(gtags);
     return ret;
 }
 
+//req是多tag写入的batch时计入batch,最后一条有结果时才应答neuron
 int s7_write_resp(void *ctx, void *req, int error)
 {
     neu_plugin_t *plugin = (neu_plugin_t *) ctx;
 
+    utarray_foreach(plugin->write_batches, struct s7_write_batch **, p_b)
+    {
+        struct s7_write_batch *batch = *p_b;
+
+        if (batch != req) {
+            continue;
+        }
+        if (batch->error == NEU_ERR_SUCCESS) {
+            batch->error = error;
+        }
+        if (--batch->n_wait > 0) {
+            return 0;
+        }
+        req   = batch->req;
+        error = batch->error;
+        utarray_erase(plugin->write_batches,
+                      utarray_eltidx(plugin->write_batches, p_b), 1);
+        free(batch);
+        break;
+    }
+
     plugin->common.adapter_callbacks->driver.write_response(
         plugin->common.adapter, req, error);
     return 0;
@@ -614,87 +1232,30 @@ int s7_write_resp(void *ctx, void *req, int error)
 
 static void plugin_group_free(neu_plugin_group_t *pgp)
 {
-    struct s7_group_data *gd = (struct s7_group_data *) pgp->user_data;
-
-    s7_tag_sort_free(gd->cmd_sort);
-
-    utarray_foreach(gd->tags, s7_point_t **, tag) { free(*tag); }
-
-    utarray_free(gd->tags);
-    free(gd->group);
-
-    free(gd);
-}
-
-static int process_protocol_buf(neu_plugin_t *plugin, uint8_t reserve_id,
-                                uint16_t response_size)
-{
-    uint8_t                   recv_buf[1024];
-    neu_protocol_unpack_buf_t pbuf     = { 0 };
-    ssize_t                   ret      = 0;
-
-    //nouse
-    // printf("reserve_id:%d,response_size:%d\n",reserve_id,response_size);
-
-    if (plugin->protocol == S7_PROTOCOL_TCP) {
-        if (plugin->is_server) {
-            ret = neu_conn_tcp_server_recv(plugin->conn, plugin->client_fd,
-                                           recv_buf,
-                                           sizeof(struct S7_TPTK));
-        } else {
-            ret = neu_conn_recv(plugin->conn, recv_buf,sizeof(struct S7_TPTK));
+    struct s7_group_data *gd      = (struct s7_group_data *) pgp->user_data;
+    s7_session_t *        session = gd->session;
+
+    //在途请求的应答到达时按未知Sequence丢弃
+    if (session != NULL) {
+        pthread_mutex_lock(&session->mtx);
+        for (uint8_t i = 0; i < session->n_link; i++) {
+            s7_stack_jobs_drop(session->links[i].stack, gd);
         }
-
-        if (ret == 0 || ret == -1) {
-            return 0;
-        }
-
-        if (ret == sizeof(struct S7_TPTK)) {
-            struct S7_TPTK *header = (struct S7_TPTK *) recv_buf;
-            int                   ret1   = 0;
-            //len 等于 header的HI_Lenght和LO_Lenght组合uint16 
-            int                   len    = (header->HI_Lenght << 8) | header->LO_Lenght;
-
-            //校验长度
-            // if (len != response_size) {
-            //     return -1;
-            // }
-
-            plog_recv_protocol(plugin, recv_buf, ret);
-            if (plugin->is_server) {
-                ret1 = neu_conn_tcp_server_recv(
-                    plugin->conn, plugin->client_fd,
-                    recv_buf + sizeof(struct S7_TPTK),
-                    len);
-            } else {
-                ret1 = neu_conn_recv(plugin->conn,
-                                     recv_buf + sizeof(struct S7_TPTK),
-                                     len - sizeof(struct S7_TPTK));
-            }
-            if (ret1 != (len - (int)sizeof(struct S7_TPTK))) {
-                return -1;
+        utarray_foreach(session->groups, struct s7_group_data **, p_gd)
+        {
+            if (*p_gd == gd) {
+                utarray_erase(session->groups,
+                              utarray_eltidx(session->groups, p_gd), 1);
+                break;
             }
-            ret += ret1;
-        } else {
-            return -1;
         }
+        s7_merge_drop(gd->plugin, gd);
+        pthread_mutex_unlock(&session->mtx);
+    } else {
+        s7_merge_drop(gd->plugin, gd);
+    }
 
-        if (ret > 0) {
-            if (ret < 512) {
-                plog_recv_protocol(plugin, recv_buf, ret);
-            }
-            neu_protocol_unpack_buf_init(&pbuf, recv_buf, ret);
-            int ret_s = s7_stack_recv(plugin->stack,&pbuf);
-            if (ret_s == S7_DEVICE_ERR) {
-                ret = ret_s;
-            } else {
-                // if (ret != response_size) {
-                //     ret = -1;
-                // } else {
-                    ret = ret_s;
-                // }
-            }
-        }
+    if (!s7_plan_retire(gd->plugin, gd)) {
+        s7_group_data_free(gd);
     }
-    return ret;
-}
\ No newline at end of file
+}
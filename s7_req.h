@@ -21,13 +21,67 @@
 
 #include <neuron.h>
 
+#include "s7_cache.h"
+#include "s7_decode.h"
 #include "s7_stack.h"
 #include "s7_point.h"
+#include "s7_session.h"
+
+// 因超时或group删除而丢弃的迟到应答数
+#define S7_METRIC_ORPHAN_RESPONSES "s7_orphan_responses"
+// 在新鲜期内直接使用其他group读到的数据、没有向PLC读取的item数
+#define S7_METRIC_CACHE_HITS "s7_cache_hits"
+// 数据复用新鲜期的上限,毫秒
+#define S7_DEDUP_WINDOW_MAX 60000
+// 编辑tag后暂存的旧规划在该时间内没有被group取回则释放
+#define S7_PLAN_RETIRE_MS 60000
+// 每个节点缓存的合并规划数
+#define S7_MERGE_CACHE 8
+// 按耗时模型检查规划是否需要调整的间隔
+#define S7_COST_REPLAN_MS 60000
 
 struct s7_group_data {
-    UT_array *              tags;
+    UT_array *              tags;    // s7_point_t *, 按名称排序
+    s7_point_t *            points;  // 创建group时一次分配的point
+    uint32_t                n_point;
     char *                  group;
     s7_read_cmd_sort_t *cmd_sort;
+    uint16_t            plan_pdu_size; // cmd_sort规划时的PDU大小
+    uint16_t            plan_gap;      // cmd_sort规划时的跨空洞上限
+    uint8_t             plan_split;    // cmd_sort规划时的应答容量拆分
+    int64_t             cost_ms;       // 最近一次按耗时模型检查规划的时间
+
+    neu_plugin_t *plugin;
+    s7_session_t *session;  // 当前所在的会话,节点退出会话后为NULL
+    bool          busy;     // 本周期还有请求未完成
+    uint16_t      next_cmd; // 本周期下一个待发送的cmd
+    int64_t       cycle_ms; // 本周期开始时间
+    int64_t       rtt;      // 上一个完整周期的耗时
+    int64_t       retire_ms; // 暂存的时间
+
+    // 合并读取:同一会话tick内到期的group用一个合并规划读取
+    bool                  due;     // 已到期,等会话tick下发
+    UT_array *            members; // struct s7_group_data *, 合并规划的成员,普通group为NULL
+    struct s7_group_data *merged;  // 本周期由哪个合并规划代为读取
+    int64_t               used_ms; // 合并规划最近一次使用的时间
+
+    s7_read_cmd_t *residual; // 每个cmd去掉缓存命中的item后剩下的部分
+    uint16_t       n_residual;
+    s7_read_cmd_t *next_read; // next_cmd查过缓存后待发送的部分,NULL表示还没有查
+    int64_t        read_ms;   // 最近一次从PLC收到本group数据的时间
+};
+
+// 并行job已满时排队等待发送的写请求
+struct s7_write_pending {
+    neu_plugin_t *plugin;
+    void *    req;
+    bool      response;
+    uint16_t  dbnumber;
+    s7_area_e area;
+    uint16_t  start_address;
+    uint16_t  n_register;
+    uint16_t  n_byte;
+    uint8_t * bytes; // 按n_register分配,发送或丢弃后释放
 };
 
 struct s7_write_tags_data {
@@ -35,41 +89,54 @@ struct s7_write_tags_data {
     s7_write_cmd_sort_t *cmd_sort;
 };
 
+// 多tag写入拆成的多条写请求共用neuron的一个请求,全部确认(或失败)后按第一个错误应答
+struct s7_write_batch {
+    void *   req;
+    uint16_t n_wait; // 还没有结果的写请求数
+    int      error;
+};
+
 struct neu_plugin {
     neu_plugin_common_t common;
 
-    neu_conn_t *    conn;
-    s7_stack_t *stack;
-
-    void *   plugin_group_data;
-    uint16_t cmd_idx;
+    // 连接、group队列和写请求队列由同一PLC上的节点共享
+    s7_session_t *session;
+    bool          started;
 
-    neu_event_io_t *tcp_server_io;
-    bool            is_server;
-    bool            is_serial;
-    int             client_fd;
-    neu_events_t *  events;
+    UT_array *write_batches; // struct s7_write_batch *, 等待应答的多tag写入
 
     s7_protocol_e protocol;
+    uint16_t      read_gap; // 同一DB中相距不超过read_gap字节的tag合并读取
+
+    // neuron编辑tag后会释放group并重建,旧规划暂存在这里,重建时只重排变化的部分
+    // add_tags/load_tags/del_tags在adapter线程中调用,与group timer互斥
+    pthread_mutex_t plan_mtx;
+    UT_array *      plan_edited;  // char *, 编辑过tag的group
+    int64_t         plan_edit_ms; // 最近一次del_tags,不带group名称
+    UT_array *      plan_retired; // struct s7_group_data *
+
+    bool      group_merge; // 同时到期的group合并读取
+    UT_array *merges;      // struct s7_group_data *, 缓存的合并规划
 
-    uint16_t interval;
-    uint16_t retry_interval;
-    uint16_t max_retries;
+    s7_cache_t *cache;      // 节点内各group读到的地址段数据
+    uint32_t    cache_ms;   // 新鲜期,0表示不复用
+    uint64_t    cache_hits;
 };
 
-void s7_conn_connected(void *data, int fd);
-void s7_conn_disconnected(void *data, int fd);
-void s7_tcp_server_listen(void *data, int fd);
-void s7_tcp_server_stop(void *data, int fd);
-int  s7_tcp_server_io_callback(enum neu_event_io_type type, int fd,
-                                   void *usr_data);
-int s7_stack_connect(neu_plugin_t *plugin) ;
-int64_t s7_stack_datacom(neu_plugin_t *plugin,struct s7_group_data *gd);
+void s7_stack_pump(s7_session_t *session);
+void s7_cycles_abort(s7_session_t *session, int error);
+void s7_groups_dispatch(s7_session_t *session);
 int s7_group_sort(neu_plugin_t *plugin,neu_plugin_group_t *group,struct s7_group_data **gd);
+void s7_plan_init(neu_plugin_t *plugin);
+void s7_plan_uninit(neu_plugin_t *plugin);
+void s7_plan_edited(neu_plugin_t *plugin, const char *group);
 int s7_group_timer(neu_plugin_t *plugin, neu_plugin_group_t *group);
-int s7_send_msg(void *ctx, uint16_t n_byte, uint8_t *bytes);
-int s7_value_handle(void *ctx, uint8_t tag_item_idx, uint16_t n_byte,
-                        uint8_t *bytes, int error);
+int s7_value_recv(void *ctx, void *user, s7_read_cmd_t *cmd,
+                  uint8_t tag_item_idx, uint16_t n_byte, uint8_t *bytes,
+                  int error);
+int s7_value_handle(void *ctx, void *user, s7_read_cmd_t *cmd,
+                    uint8_t tag_item_idx, uint16_t n_byte, uint8_t *bytes,
+                    int error);
 int s7_write(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
                  neu_value_u value, bool response);
 int s7_write_tag(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
@@ -0,0 +1,829 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "s7_req.h"
+#include "s7_session.h"
+#ifdef S7_IO_URING
+#include "s7_uring.h"
+#endif
+
+//进程内所有S7会话,按host/port/rack/slot共享
+//s7_events_barrier等待的标记
+struct s7_barrier {
+    pthread_mutex_t mtx;
+    pthread_cond_t  cond;
+    bool            done;
+};
+
+static pthread_mutex_t s7_sessions_mtx = PTHREAD_MUTEX_INITIALIZER;
+static UT_array *      s7_sessions     = NULL; // s7_session_t *
+
+//共享reactor:固定数量的events线程,按挂接的会话数分配,无会话时关闭
+static struct {
+    neu_events_t *events;
+    int           refs;
+} s7_reactors[S7_REACTOR_THREADS];
+
+static neu_events_t *s7_reactor_get(void)
+{
+    int idx = 0;
+    for (int i = 1; i < S7_REACTOR_THREADS; i++) {
+        if (s7_reactors[i].refs < s7_reactors[idx].refs) {
+            idx = i;
+        }
+    }
+    if (s7_reactors[idx].refs++ == 0) {
+        s7_reactors[idx].events = neu_event_new();
+    }
+    return s7_reactors[idx].events;
+}
+
+static void s7_reactor_put(neu_events_t *events)
+{
+    for (int i = 0; i < S7_REACTOR_THREADS; i++) {
+        if (s7_reactors[i].refs > 0 && s7_reactors[i].events == events) {
+            if (--s7_reactors[i].refs == 0) {
+                neu_event_close(events);
+                s7_reactors[i].events = NULL;
+            }
+            return;
+        }
+    }
+}
+
+//在途请求超时由events线程检查,不依赖group的采集周期
+static int s7_session_tick(void *usr_data)
+{
+    s7_session_t *session = (s7_session_t *) usr_data;
+    int64_t       now     = neu_time_ms();
+
+    pthread_mutex_lock(&session->mtx);
+    if (session->closing) {
+        pthread_mutex_unlock(&session->mtx);
+        return 0;
+    }
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        s7_stack_jobs_expire(session->links[i].stack, now);
+    }
+    s7_groups_dispatch(session);
+    s7_stack_pump(session);
+    pthread_mutex_unlock(&session->mtx);
+    return 0;
+}
+
+static void s7_session_link_state(s7_session_t *session, int state)
+{
+    utarray_foreach(session->plugins, neu_plugin_t **, p_plugin)
+    {
+        (*p_plugin)->common.link_state = state;
+    }
+}
+
+static int s7_barrier_cb(void *usr_data)
+{
+    struct s7_barrier *barrier = (struct s7_barrier *) usr_data;
+
+    pthread_mutex_lock(&barrier->mtx);
+    barrier->done = true;
+    pthread_cond_signal(&barrier->cond);
+    pthread_mutex_unlock(&barrier->mtx);
+    return 0;
+}
+
+//等待events线程执行完已经取出的回调.neu_event_del_io不等待正在执行的io回调,
+//新加的timer只会在之后的epoll_wait中触发,此时之前取出的回调都已返回
+static void s7_events_barrier(neu_events_t *events)
+{
+    struct s7_barrier barrier = {
+        .mtx  = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    neu_event_timer_param_t param = {
+        .second      = 0,
+        .millisecond = 1,
+        .cb          = s7_barrier_cb,
+        .usr_data    = (void *) &barrier,
+        .type        = NEU_EVENT_TIMER_NOBLOCK,
+    };
+    neu_event_timer_t *timer = neu_event_add_timer(events, param);
+
+    pthread_mutex_lock(&barrier.mtx);
+    while (!barrier.done) {
+        pthread_cond_wait(&barrier.cond, &barrier.mtx);
+    }
+    pthread_mutex_unlock(&barrier.mtx);
+
+    neu_event_del_timer(events, timer);
+    pthread_cond_destroy(&barrier.cond);
+    pthread_mutex_destroy(&barrier.mtx);
+}
+
+//io回调可能正在等会话锁,拿到锁后发现link->io为NULL即返回,不会用到已释放的stack
+static void s7_link_close(s7_link_t *link)
+{
+#ifdef S7_IO_URING
+    if (link->session->uring != NULL) {
+        s7_uring_detach(link->session->uring, link);
+    }
+#endif
+    if (link->io != NULL) {
+        neu_event_del_io(link->session->events, link->io);
+        link->io = NULL;
+    }
+    if (link->conn != NULL) {
+        neu_conn_destory(link->conn);
+        link->conn = NULL;
+    }
+    if (link->stack != NULL) {
+        s7_stack_reset(link->stack);
+        s7_stack_destroy(link->stack);
+        link->stack = NULL;
+    }
+    link->connected = false;
+}
+
+//块信息应答,ctx为会话,持会话锁调用
+static void s7_db_size_handle(void *ctx, uint16_t dbnumber, int32_t size)
+{
+    s7_session_t *session = (s7_session_t *) ctx;
+
+    utarray_foreach(session->db_sizes, s7_db_size_t *, db)
+    {
+        if (db->dbnumber == dbnumber) {
+            db->size = size > 0 ? size : -1;
+            break;
+        }
+    }
+
+    if (size > 0) {
+        plog_notice(session->log, "DB%hu size: %d", dbnumber, size);
+    } else {
+        plog_warn(session->log,
+                  "DB%hu size unavailable, no gap merge for this DB",
+                  dbnumber);
+    }
+}
+
+//按配置调整连接池大小,已有连接保持不动,避免影响共享会话的其他节点
+//请求的PDU大小在各连接下次握手时生效
+static void s7_links_config(s7_session_t *session, neu_conn_param_t *param,
+                            uint8_t n_link, uint8_t rack, uint8_t slot,
+                            uint16_t pdu_size)
+{
+    for (uint8_t i = n_link; i < session->n_link; i++) {
+        s7_link_close(&session->links[i]);
+    }
+
+    for (uint8_t i = 0; i < n_link; i++) {
+        s7_link_t *link = &session->links[i];
+
+        if (link->stack != NULL) {
+            link->stack->proto.PDURequest = pdu_size;
+            continue;
+        }
+        link->session = session;
+        link->index   = i;
+        link->stack =
+            s7_stack_create((void *) session->log, S7_PROTOCOL_TCP,
+                            s7_send_msg, s7_value_recv, s7_write_resp);
+        link->stack->link       = link;
+        link->stack->timeout_ms = param->params.tcp_client.timeout;
+        link->stack->block_info = s7_db_size_handle;
+        s7_proto_ctx_init(&link->stack->proto, rack, slot);
+        link->stack->proto.PDURequest = pdu_size;
+
+        link->conn = neu_conn_new(param, (void *) link, s7_conn_connected,
+                                  s7_conn_disconnected);
+        if (session->started > 0) {
+            neu_conn_start(link->conn);
+        }
+    }
+    session->n_link = n_link;
+}
+
+s7_session_t *s7_session_get(neu_plugin_t *plugin, neu_conn_param_t *param,
+                             uint8_t n_link, uint8_t rack, uint8_t slot,
+                             uint16_t pdu_size, s7_transport_e transport,
+                             s7_reactor_mode_e reactor)
+{
+    static UT_icd write_icd   = { sizeof(struct s7_write_pending), NULL, NULL,
+                                NULL };
+    static UT_icd db_size_icd = { sizeof(s7_db_size_t), NULL, NULL, NULL };
+    s7_session_t *session   = NULL;
+    char          key[128]  = { 0 };
+
+    snprintf(key, sizeof(key), "%s:%hu:%hhu:%hhu", param->params.tcp_client.ip,
+             param->params.tcp_client.port, rack, slot);
+
+    pthread_mutex_lock(&s7_sessions_mtx);
+    if (s7_sessions == NULL) {
+        utarray_new(s7_sessions, &ut_ptr_icd);
+    }
+    utarray_foreach(s7_sessions, s7_session_t **, p_session)
+    {
+        if (strcmp((*p_session)->key, key) == 0) {
+            session = *p_session;
+            break;
+        }
+    }
+
+    if (session == NULL) {
+        pthread_mutexattr_t attr;
+
+        session = calloc(1, sizeof(s7_session_t));
+        strcpy(session->key, key);
+        //连接回调可能在持锁时重入
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&session->mtx, &attr);
+        pthread_mutexattr_destroy(&attr);
+        //共享会话的reactor和收发方式由创建会话的节点决定
+        session->reactor = reactor;
+        session->events  = reactor == S7_REACTOR_SHARED ? s7_reactor_get()
+                                                        : neu_event_new();
+        session->log     = plugin;
+        utarray_new(session->plugins, &ut_ptr_icd);
+        utarray_new(session->groups, &ut_ptr_icd);
+        utarray_new(session->writes, &write_icd);
+        utarray_new(session->db_sizes, &db_size_icd);
+        utarray_push_back(s7_sessions, &session);
+
+        neu_event_timer_param_t tick = {
+            .second      = 0,
+            .millisecond = S7_SESSION_TICK_MS,
+            .cb          = s7_session_tick,
+            .usr_data    = (void *) session,
+            .type        = NEU_EVENT_TIMER_NOBLOCK,
+        };
+        session->tick = neu_event_add_timer(session->events, tick);
+
+        if (transport == S7_TRANSPORT_IO_URING) {
+#ifdef S7_IO_URING
+            session->uring = s7_uring_new(session);
+#endif
+            if (session->uring == NULL) {
+                plog_warn(plugin, "io_uring transport unavailable, use epoll");
+            }
+        }
+    }
+
+    pthread_mutex_lock(&session->mtx);
+    bool attached = false;
+    utarray_foreach(session->plugins, neu_plugin_t **, p_plugin)
+    {
+        attached = attached || *p_plugin == plugin;
+    }
+    if (!attached) {
+        utarray_push_back(session->plugins, &plugin);
+        session->refs++;
+    }
+
+    //共享会话的连接数取各节点配置的最大值
+    if (session->refs > 1 && session->n_link > n_link) {
+        n_link = session->n_link;
+    }
+    s7_links_config(session, param, n_link, rack, slot, pdu_size);
+
+    plugin->common.link_state = s7_links_connected(session)
+        ? NEU_NODE_LINK_STATE_CONNECTED
+        : NEU_NODE_LINK_STATE_DISCONNECTED;
+    pthread_mutex_unlock(&session->mtx);
+    pthread_mutex_unlock(&s7_sessions_mtx);
+
+    plog_notice(plugin, "s7 session %s, nodes: %d, connections: %d", key,
+                session->refs, session->n_link);
+    return session;
+}
+
+//节点退出会话,丢弃它的group/写请求;最后一个节点退出时关闭连接
+void s7_session_put(s7_session_t *session, neu_plugin_t *plugin)
+{
+    pthread_mutex_lock(&s7_sessions_mtx);
+    pthread_mutex_lock(&session->mtx);
+
+    utarray_foreach(session->plugins, neu_plugin_t **, p_plugin)
+    {
+        if (*p_plugin == plugin) {
+            utarray_erase(session->plugins,
+                          utarray_eltidx(session->plugins, p_plugin), 1);
+            session->refs--;
+            break;
+        }
+    }
+
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        s7_stack_jobs_drop_owner(session->links[i].stack, plugin);
+    }
+    for (unsigned i = 0; i < utarray_len(session->groups);) {
+        struct s7_group_data *gd =
+            *(struct s7_group_data **) utarray_eltptr(session->groups, i);
+        if (gd->plugin == plugin) {
+            gd->session = NULL;
+            utarray_erase(session->groups, i, 1);
+        } else {
+            i++;
+        }
+    }
+    for (unsigned i = 0; i < utarray_len(session->writes);) {
+        struct s7_write_pending *w =
+            (struct s7_write_pending *) utarray_eltptr(session->writes, i);
+        if (w->plugin == plugin) {
+            free(w->bytes);
+            utarray_erase(session->writes, i, 1);
+        } else {
+            i++;
+        }
+    }
+
+    if (session->refs > 0) {
+        if (session->log == plugin) {
+            session->log = *(neu_plugin_t **) utarray_front(session->plugins);
+            for (uint8_t i = 0; i < session->n_link; i++) {
+                session->links[i].stack->ctx = session->log;
+            }
+        }
+        pthread_mutex_unlock(&session->mtx);
+        pthread_mutex_unlock(&s7_sessions_mtx);
+        return;
+    }
+
+    utarray_foreach(s7_sessions, s7_session_t **, p_session)
+    {
+        if (*p_session == session) {
+            utarray_erase(s7_sessions, utarray_eltidx(s7_sessions, p_session),
+                          1);
+            break;
+        }
+    }
+    neu_event_io_t *ios[S7_MAX_CONNECTIONS] = { NULL };
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        ios[i]                = session->links[i].io;
+        session->links[i].io = NULL;
+    }
+    session->closing = true;
+    pthread_mutex_unlock(&session->mtx);
+
+    //不能持会话锁删除io和timer,回调可能正在等锁;
+    //连接要在删除io之后关闭,否则fd可能已被复用
+    for (uint8_t i = 0; i < S7_MAX_CONNECTIONS; i++) {
+        if (ios[i] != NULL) {
+            neu_event_del_io(session->events, ios[i]);
+        }
+    }
+    neu_event_del_timer(session->events, session->tick);
+    //独占的events线程退出即不再有回调,共享的要等已取出的回调返回后才能释放会话
+    if (session->reactor == S7_REACTOR_DEDICATED) {
+        neu_event_close(session->events);
+    } else {
+        s7_events_barrier(session->events);
+    }
+
+    pthread_mutex_lock(&session->mtx);
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        s7_link_close(&session->links[i]);
+    }
+    session->n_link = 0;
+    pthread_mutex_unlock(&session->mtx);
+
+    if (session->reactor == S7_REACTOR_SHARED) {
+        s7_reactor_put(session->events);
+    }
+    pthread_mutex_unlock(&s7_sessions_mtx);
+
+#ifdef S7_IO_URING
+    if (session->uring != NULL) {
+        s7_uring_free(session->uring);
+    }
+#endif
+    pthread_mutex_destroy(&session->mtx);
+    utarray_free(session->plugins);
+    utarray_free(session->groups);
+    utarray_free(session->writes);
+    utarray_free(session->db_sizes);
+    free(session);
+}
+
+//第一个节点start时建立连接,最后一个节点stop时断开
+void s7_session_start(s7_session_t *session)
+{
+    pthread_mutex_lock(&session->mtx);
+    if (session->started++ == 0) {
+        for (uint8_t i = 0; i < session->n_link; i++) {
+            neu_conn_start(session->links[i].conn);
+        }
+    }
+    pthread_mutex_unlock(&session->mtx);
+}
+
+void s7_session_stop(s7_session_t *session)
+{
+    pthread_mutex_lock(&session->mtx);
+    if (session->started > 0 && --session->started == 0) {
+        for (uint8_t i = 0; i < session->n_link; i++) {
+            neu_conn_stop(session->links[i].conn);
+        }
+    }
+    pthread_mutex_unlock(&session->mtx);
+}
+
+//提交io_uring中积攒的发送,epoll方式下发送已在s7_send_msg中完成
+void s7_session_flush(s7_session_t *session)
+{
+#ifdef S7_IO_URING
+    if (session->uring != NULL) {
+        s7_uring_flush(session->uring);
+    }
+#else
+    (void) session;
+#endif
+}
+
+//已知的DB字节数,未查询或无法获取时返回<=0
+int32_t s7_session_db_size(s7_session_t *session, uint16_t dbnumber)
+{
+    utarray_foreach(session->db_sizes, s7_db_size_t *, db)
+    {
+        if (db->dbnumber == dbnumber) {
+            return db->size;
+        }
+    }
+    return 0;
+}
+
+//登记points中用到的DB,全部DB都已有查询结果时返回true
+bool s7_session_db_discover(s7_session_t *session, UT_array *points)
+{
+    bool done = true;
+
+    //points中存放的是s7_point_t指针
+    utarray_foreach(points, s7_point_t **, pp)
+    {
+        const s7_point_t *point = *pp;
+        bool              found = false;
+
+        if (point->area != S7AreaDB) {
+            continue;
+        }
+        utarray_foreach(session->db_sizes, s7_db_size_t *, db)
+        {
+            if (db->dbnumber == point->dbnumber) {
+                found = true;
+                done  = done && db->size != 0;
+                break;
+            }
+        }
+        if (!found) {
+            s7_db_size_t db = { .dbnumber = point->dbnumber };
+            utarray_push_back(session->db_sizes, &db);
+            done = false;
+        }
+    }
+
+    return done;
+}
+
+//在空闲连接上发出尚未发送的块信息查询,返回发出的数量
+int s7_session_db_query(s7_session_t *session)
+{
+    int n = 0;
+
+    utarray_foreach(session->db_sizes, s7_db_size_t *, db)
+    {
+        if (db->sent) {
+            continue;
+        }
+
+        s7_link_t *link = s7_links_idle(session);
+        if (link == NULL) {
+            break;
+        }
+
+        int ret = s7_stack_block_info_req(link->stack, session, db->dbnumber);
+        if (ret == S7_STACK_ENCODE_ERR) {
+            db->sent = true;
+            db->size = -1;
+        } else if (ret <= 0) {
+            s7_link_fail(link);
+        } else {
+            db->sent = true;
+            n += 1;
+        }
+    }
+
+    return n;
+}
+
+//连接池中任意一条连接可用即认为节点已连接
+bool s7_links_connected(s7_session_t *session)
+{
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        if (session->links[i].connected) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//完成S7握手的连接中协商得到的最小PDU,没有可用连接时返回0
+uint16_t s7_links_pdu_size(s7_session_t *session)
+{
+    uint16_t pdu_size = 0;
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        s7_stack_t *stack = session->links[i].stack;
+        if (stack->s7com_is_connected &&
+            (pdu_size == 0 || stack->pdu_size < pdu_size)) {
+            pdu_size = stack->pdu_size;
+        }
+    }
+    return pdu_size;
+}
+
+//取样本最多的已连接连接的耗时模型,parallel为各连接可并行的job数之和
+const s7_cost_t *s7_links_cost(s7_session_t *session, uint16_t *parallel)
+{
+    const s7_cost_t *cost = NULL;
+
+    *parallel = 0;
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        s7_stack_t *stack = session->links[i].stack;
+        if (!stack->s7com_is_connected) {
+            continue;
+        }
+        *parallel += stack->parallel_jobs;
+        if (cost == NULL || stack->cost.n_sample > cost->n_sample) {
+            cost = &stack->cost;
+        }
+    }
+    return cost;
+}
+
+//取在途job最少的可发送连接,慢连接自然少分到cmd
+s7_link_t *s7_links_idle(s7_session_t *session)
+{
+    s7_link_t *idle = NULL;
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        s7_link_t *link = &session->links[i];
+        if (s7_stack_can_send(link->stack) &&
+            (idle == NULL || link->stack->n_jobs < idle->stack->n_jobs)) {
+            idle = link;
+        }
+    }
+    return idle;
+}
+
+int s7_links_jobs_count(s7_session_t *session, void *user)
+{
+    int n = 0;
+    for (uint8_t i = 0; i < session->n_link; i++) {
+        n += s7_stack_jobs_count(session->links[i].stack, user);
+    }
+    return n;
+}
+
+//发送失败时断开连接,该连接在重连并握手前不再领取请求
+void s7_link_fail(s7_link_t *link)
+{
+    neu_conn_disconnect(link->conn);
+    s7_stack_reset(link->stack);
+}
+
+//把收到的字节流写入stack接收缓冲,数据可能跨越多个TPKT帧
+int s7_link_feed(s7_link_t *link, const uint8_t *data, uint32_t len)
+{
+    while (len > 0) {
+        uint16_t n_byte = 0;
+        uint8_t *buf    = s7_stack_recv_buf(link->stack, &n_byte);
+
+        if (n_byte > len) {
+            n_byte = len;
+        }
+        memcpy(buf, data, n_byte);
+        link->recv_bytes += n_byte;
+        if (s7_stack_recv_commit(link->stack, n_byte) < 0) {
+            return -1;
+        }
+        data += n_byte;
+        len -= n_byte;
+    }
+    return 0;
+}
+
+void s7_conn_connected(void *data, int fd)
+{
+    s7_link_t *          link    = (s7_link_t *) data;
+    s7_session_t *       session = link->session;
+    neu_event_io_param_t param   = {
+        .cb       = s7_conn_io_callback,
+        .fd       = fd,
+        .usr_data = (void *) link,
+    };
+
+    pthread_mutex_lock(&session->mtx);
+    if (session->closing) {
+        pthread_mutex_unlock(&session->mtx);
+        return;
+    }
+    s7_session_link_state(session, NEU_NODE_LINK_STATE_CONNECTED);
+    link->connected = true;
+    link->fd        = fd;
+
+#ifdef S7_IO_URING
+    if (session->uring != NULL && !session->is_server &&
+        s7_uring_attach(session->uring, link, fd) == 0) {
+        pthread_mutex_unlock(&session->mtx);
+        return;
+    }
+#endif
+
+    //应答由events线程异步接收,group timer不再阻塞在socket上
+    if (link->io != NULL) {
+        neu_event_del_io(session->events, link->io);
+    }
+    link->io = neu_event_add_io(session->events, param);
+    pthread_mutex_unlock(&session->mtx);
+}
+
+void s7_conn_disconnected(void *data, int fd)
+{
+    s7_link_t *   link    = (s7_link_t *) data;
+    s7_session_t *session = link->session;
+    (void) fd;
+
+    pthread_mutex_lock(&session->mtx);
+    link->connected = false;
+#ifdef S7_IO_URING
+    if (session->uring != NULL) {
+        s7_uring_detach(session->uring, link);
+    }
+#endif
+    if (link->io != NULL) {
+        neu_event_del_io(session->events, link->io);
+        link->io = NULL;
+    }
+    if (link->stack != NULL) {
+        s7_stack_reset(link->stack);
+    }
+
+    //其余连接仍可用时周期继续,由它们接手未发送的cmd
+    if (!s7_links_connected(session)) {
+        s7_session_link_state(session, NEU_NODE_LINK_STATE_DISCONNECTED);
+        s7_cycles_abort(session, NEU_ERR_PLUGIN_DISCONNECTED);
+    }
+    pthread_mutex_unlock(&session->mtx);
+}
+
+//每次尽量读满接收缓冲,一次recv可带回多个应答帧;不会阻塞events线程
+static void s7_conn_recv(s7_link_t *link, int fd)
+{
+    neu_plugin_t *plugin = link->session->log;
+
+    while (link->io != NULL) {
+        uint16_t n_byte = 0;
+        uint8_t *buf    = s7_stack_recv_buf(link->stack, &n_byte);
+        ssize_t  ret    = recv(fd, buf, n_byte, MSG_DONTWAIT);
+
+        if (ret > 0) {
+            link->recv_bytes += ret;
+            if (s7_stack_recv_commit(link->stack, ret) < 0) {
+                plog_error(plugin, "s7 link %d stream out of sync, reconnect",
+                           link->index);
+                neu_conn_disconnect(link->conn);
+                break;
+            }
+            //没有读满说明socket已读空,省去一次返回EAGAIN的recv
+            if (ret < n_byte) {
+                break;
+            }
+        } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (ret < 0 && errno == EINTR) {
+            continue;
+        } else {
+            plog_warn(plugin, "s7 link %d recv: %zd, errno: %d, fd: %d",
+                      link->index, ret, errno, fd);
+            neu_conn_disconnect(link->conn);
+            break;
+        }
+    }
+}
+
+int s7_conn_io_callback(enum neu_event_io_type type, int fd, void *usr_data)
+{
+    s7_link_t *   link    = (s7_link_t *) usr_data;
+    s7_session_t *session = link->session;
+
+    pthread_mutex_lock(&session->mtx);
+    //等锁期间连接已关闭或会话正在释放
+    if (link->io == NULL || session->closing) {
+        pthread_mutex_unlock(&session->mtx);
+        return 0;
+    }
+    switch (type) {
+    case NEU_EVENT_IO_READ:
+        s7_conn_recv(link, fd);
+        s7_stack_pump(session);
+        break;
+    case NEU_EVENT_IO_CLOSED:
+    case NEU_EVENT_IO_HUP:
+        plog_warn(session->log, "s7 link %d recv: %d, conn closed, fd: %d",
+                  link->index, type, fd);
+        neu_conn_disconnect(link->conn);
+        break;
+    }
+    pthread_mutex_unlock(&session->mtx);
+
+    return 0;
+}
+
+void s7_tcp_server_listen(void *data, int fd)
+{
+    s7_session_t *       session = (s7_session_t *) data;
+    neu_event_io_param_t param   = {
+        .cb       = s7_tcp_server_io_callback,
+        .fd       = fd,
+        .usr_data = (void *) session,
+    };
+
+    session->tcp_server_io = neu_event_add_io(session->events, param);
+}
+
+void s7_tcp_server_stop(void *data, int fd)
+{
+    s7_session_t *session = (s7_session_t *) data;
+    (void) fd;
+
+    neu_event_del_io(session->events, session->tcp_server_io);
+}
+
+//server模式只使用连接池中的第一条连接
+int s7_tcp_server_io_callback(enum neu_event_io_type type, int fd,
+                              void *usr_data)
+{
+    s7_session_t *session = (s7_session_t *) usr_data;
+    s7_link_t *   link    = &session->links[0];
+
+    switch (type) {
+    case NEU_EVENT_IO_READ: {
+        int client_fd = neu_conn_tcp_server_accept(link->conn);
+        if (client_fd > 0) {
+            session->client_fd = client_fd;
+            s7_conn_connected(link, client_fd);
+        }
+
+        break;
+    }
+    case NEU_EVENT_IO_CLOSED:
+    case NEU_EVENT_IO_HUP:
+        plog_warn(session->log, "tcp server recv: %d, conn closed, fd: %d",
+                  type, fd);
+        neu_event_del_io(session->events, session->tcp_server_io);
+        neu_conn_disconnect(link->conn);
+        break;
+    }
+
+    return 0;
+}
+
+int s7_send_msg(void *ctx, void *data, uint16_t n_byte, uint8_t *bytes)
+{
+    neu_plugin_t *plugin  = (neu_plugin_t *) ctx;
+    s7_link_t *   link    = (s7_link_t *) data;
+    s7_session_t *session = link->session;
+    int           ret     = 0;
+
+    plog_send_protocol(plugin, bytes, n_byte);
+
+    if (session->is_server) {
+        ret = neu_conn_tcp_server_send(link->conn, session->client_fd, bytes,
+                                       n_byte);
+#ifdef S7_IO_URING
+    } else if (session->uring != NULL && link->uring_armed) {
+        //连接建立前的首次发送仍由neu_conn负责建连
+        ret = s7_uring_send(session->uring, link, bytes, n_byte);
+#endif
+    } else {
+        ret = neu_conn_send(link->conn, bytes, n_byte);
+    }
+
+    return ret;
+}
@@ -0,0 +1,134 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#ifndef _NEU_M_PLUGIN_S7_SESSION_H_
+#define _NEU_M_PLUGIN_S7_SESSION_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <neuron.h>
+
+#include "s7_stack.h"
+
+// 每个会话到PLC的最大连接数
+#define S7_MAX_CONNECTIONS 8
+// 共享reactor的events线程数,所有选择共享的会话分摊到这些线程
+#define S7_REACTOR_THREADS 4
+// 会话定时检查在途请求超时的周期
+#define S7_SESSION_TICK_MS 100
+
+typedef struct s7_session s7_session_t;
+
+// 收发方式,io_uring需编译时打开S7_WITH_IO_URING,否则退回epoll
+typedef enum s7_transport {
+    S7_TRANSPORT_EPOLL    = 0,
+    S7_TRANSPORT_IO_URING = 1,
+} s7_transport_e;
+
+// 会话的socket和超时由独占的events线程还是进程内共享的线程池驱动
+typedef enum s7_reactor_mode {
+    S7_REACTOR_DEDICATED = 0,
+    S7_REACTOR_SHARED    = 1,
+} s7_reactor_mode_e;
+
+// 连接池中的一条连接,各自完成COTP/S7握手,共同领取group的cmd
+typedef struct s7_link {
+    s7_session_t *  session;
+    uint8_t         index;
+    neu_conn_t *    conn;
+    s7_stack_t *    stack;
+    neu_event_io_t *io;
+    bool            connected;
+    uint64_t        recv_bytes;
+    uint64_t        send_bytes; // io_uring发送的字节数,不经过neu_conn统计
+
+    int      fd;
+    uint32_t uring_gen; // 每次挂接/撤销加1,丢弃旧连接的完成事件
+    bool     uring_armed;
+} s7_link_t;
+
+// 通过块信息查询得到的DB大小,用于限制跨空洞合并的读取范围
+typedef struct s7_db_size {
+    uint16_t dbnumber;
+    int32_t  size; // 0: 查询中, >0: DB字节数, <0: PLC不支持或DB不存在
+    bool     sent;
+} s7_db_size_t;
+
+// 同一PLC(host/port/rack/slot)上的多个节点共享一个S7会话
+// 各节点的group和写请求进入同一队列,应答按PDU Sequence回到发起的节点
+struct s7_session {
+    char key[128];
+    int  refs;
+
+    // io回调运行在events线程,与各节点的group timer/写请求互斥
+    pthread_mutex_t    mtx;
+    neu_events_t *     events;
+    s7_reactor_mode_e  reactor;
+    neu_event_timer_t *tick; // 在events线程中检查超时
+    neu_plugin_t *  log;     // 会话日志输出到的节点
+    UT_array *      plugins; // neu_plugin_t *
+    int             started; // 已start的节点数
+    bool            closing; // 最后一个节点已退出,回调不再处理
+
+    uint8_t   n_link;
+    s7_link_t links[S7_MAX_CONNECTIONS];
+
+    struct s7_uring *uring; // 为NULL时使用neu_events收发
+
+    UT_array *groups; // struct s7_group_data *, 所有节点的group
+    UT_array *writes;   // struct s7_write_pending
+    UT_array *db_sizes; // s7_db_size_t
+
+    neu_event_io_t *tcp_server_io;
+    bool            is_server;
+    int             client_fd;
+};
+
+s7_session_t *s7_session_get(neu_plugin_t *plugin, neu_conn_param_t *param,
+                             uint8_t n_link, uint8_t rack, uint8_t slot,
+                             uint16_t pdu_size, s7_transport_e transport,
+                             s7_reactor_mode_e reactor);
+void          s7_session_put(s7_session_t *session, neu_plugin_t *plugin);
+void          s7_session_start(s7_session_t *session);
+void          s7_session_stop(s7_session_t *session);
+void          s7_session_flush(s7_session_t *session);
+
+int32_t s7_session_db_size(s7_session_t *session, uint16_t dbnumber);
+bool    s7_session_db_discover(s7_session_t *session, UT_array *points);
+int     s7_session_db_query(s7_session_t *session);
+
+bool       s7_links_connected(s7_session_t *session);
+uint16_t   s7_links_pdu_size(s7_session_t *session);
+s7_link_t *s7_links_idle(s7_session_t *session);
+const s7_cost_t *s7_links_cost(s7_session_t *session, uint16_t *parallel);
+int        s7_links_jobs_count(s7_session_t *session, void *user);
+void       s7_link_fail(s7_link_t *link);
+int        s7_link_feed(s7_link_t *link, const uint8_t *data, uint32_t len);
+
+void s7_conn_connected(void *data, int fd);
+void s7_conn_disconnected(void *data, int fd);
+void s7_tcp_server_listen(void *data, int fd);
+void s7_tcp_server_stop(void *data, int fd);
+int  s7_tcp_server_io_callback(enum neu_event_io_type type, int fd,
+                               void *usr_data);
+int  s7_conn_io_callback(enum neu_event_io_type type, int fd, void *usr_data);
+int  s7_send_msg(void *ctx, void *data, uint16_t n_byte, uint8_t *bytes);
+
+#endif
@@ -17,6 +17,7 @@
  * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  **/
 #include <assert.h>
+#include <inttypes.h>
 
 #include <neuron.h>
 
@@ -45,23 +46,267 @@ s7_stack_t *s7_stack_create(void *ctx, s7_protocol_e protocol,
     stack->value_fn   = value_fn;
     stack->write_resp = write_resp;
     stack->protocol   = protocol;
+    s7_proto_ctx_init(&stack->proto, 0, 0);
 
-    stack->buf_size = 256;
+    stack->buf_size = S7_STACK_BUF_MIN;
     stack->buf      = calloc(stack->buf_size, 1);
 
+    stack->ring.size = S7_RECV_RING_SIZE;
+    stack->ring.buf  = calloc(stack->ring.size, 1);
+
     stack->cotp_is_connected = false;
     stack->s7com_is_connected = false;
-    stack->pdu_size = -1;
+    stack->pdu_size = 0;
+    stack->parallel_jobs = 1;
+    stack->timeout_ms    = 3000;
+    s7_cost_init(&stack->cost);
 
     return stack;
 }
 
 void s7_stack_destroy(s7_stack_t *stack)
 {
+    free(stack->ring.buf);
     free(stack->buf);
     free(stack);
 }
 
+//连接断开后需要重新握手,未应答的请求全部按断线上报
+void s7_stack_reset(s7_stack_t *stack)
+{
+    stack->cotp_is_connected  = false;
+    stack->s7com_is_connected = false;
+    stack->parallel_jobs      = 1;
+    stack->pdu_size           = 0;
+    stack->handshake_ms       = 0;
+    stack->ring.head          = 0;
+    stack->ring.tail          = 0;
+    s7_stack_jobs_fail(stack, NEU_ERR_PLUGIN_DISCONNECTED);
+}
+
+//发送缓冲按协商的PDU加TPKT/COTP头分配,之后的请求直接编码进去
+//只在PDU变大时重新分配
+static void s7_stack_buf_fit(s7_stack_t *stack)
+{
+    uint16_t size = stack->pdu_size + sizeof(TTPKT) + sizeof(S7_TCOTP_DT);
+
+    if (size > stack->buf_size) {
+        free(stack->buf);
+        stack->buf      = calloc(size, 1);
+        stack->buf_size = size;
+    }
+}
+
+static s7_stack_job_t *s7_stack_job_add(s7_stack_t *stack, s7_job_kind_e kind,
+                                        uint16_t seq, s7_read_cmd_t *cmd,
+                                        void *owner, void *user)
+{
+    for (int i = 0; i < S7_MAX_PARALLEL_JOBS; i++) {
+        if (!stack->jobs[i].used) {
+            stack->jobs[i].used    = true;
+            stack->jobs[i].kind    = kind;
+            stack->jobs[i].seq     = seq;
+            stack->jobs[i].cmd     = cmd;
+            stack->jobs[i].owner   = owner;
+            stack->jobs[i].user    = user;
+            stack->jobs[i].send_ms = neu_time_ms();
+            stack->jobs[i].send_us = s7_time_us();
+            stack->n_jobs++;
+            return &stack->jobs[i];
+        }
+    }
+    return NULL;
+}
+
+//按应答Sequence取出对应的请求,找不到返回false
+static bool s7_stack_job_take(s7_stack_t *stack, uint16_t seq,
+                              s7_stack_job_t *job)
+{
+    for (int i = 0; i < S7_MAX_PARALLEL_JOBS; i++) {
+        if (stack->jobs[i].used && stack->jobs[i].seq == seq) {
+            *job                = stack->jobs[i];
+            stack->jobs[i].used = false;
+            stack->n_jobs--;
+            return true;
+        }
+    }
+    return false;
+}
+
+//读应答的rtt按请求的item数和字节数计入耗时模型
+static void s7_stack_cost_sample(s7_stack_t *stack, const s7_stack_job_t *job)
+{
+    uint32_t n_byte = 0;
+
+    for (uint8_t i = 0; i < job->cmd->item_num; i++) {
+        n_byte += job->cmd->item[i].n_register;
+    }
+    s7_cost_update(&stack->cost, job->cmd->item_num, n_byte,
+                   s7_time_us() - job->send_us);
+}
+
+//应答找不到对应的请求:请求已超时上报或所属group已删除,丢弃并计数
+static void s7_stack_orphan(s7_stack_t *stack, const char *what, uint16_t seq)
+{
+    stack->orphans++;
+    plog_warn((neu_plugin_t *) stack->ctx,
+              "s7 %s response with unknown sequence:0x%X, dropped(%" PRIu64 ")",
+              what, seq, stack->orphans);
+}
+
+static void s7_stack_job_error(s7_stack_t *stack, s7_stack_job_t *job,
+                               int error)
+{
+    if (job->kind == S7_JOB_WRITE) {
+        if (job->user != NULL) {
+            stack->write_resp(job->owner, job->user, error);
+        }
+        return;
+    }
+    if (job->kind == S7_JOB_BLOCK_INFO) {
+        stack->block_info(job->owner, job->dbnumber, -1);
+        return;
+    }
+
+    for (uint8_t i = 0; i < job->cmd->item_num; i++) {
+        stack->value_fn(job->owner, job->user, job->cmd, i, 0, NULL, error);
+    }
+}
+
+void s7_stack_jobs_clear(s7_stack_t *stack)
+{
+    memset(stack->jobs, 0, sizeof(stack->jobs));
+    stack->n_jobs = 0;
+}
+
+//未应答的请求全部按error上报
+void s7_stack_jobs_fail(s7_stack_t *stack, int error)
+{
+    s7_stack_job_t jobs[S7_MAX_PARALLEL_JOBS];
+
+    memcpy(jobs, stack->jobs, sizeof(jobs));
+    s7_stack_jobs_clear(stack);
+    for (int i = 0; i < S7_MAX_PARALLEL_JOBS; i++) {
+        if (jobs[i].used) {
+            s7_stack_job_error(stack, &jobs[i], error);
+        }
+    }
+}
+
+//丢弃属于user的请求,不再上报,应答到达时按未知Sequence处理
+void s7_stack_jobs_drop(s7_stack_t *stack, void *user)
+{
+    for (int i = 0; i < S7_MAX_PARALLEL_JOBS; i++) {
+        if (stack->jobs[i].used && stack->jobs[i].user == user) {
+            stack->jobs[i].used = false;
+            stack->n_jobs--;
+        }
+    }
+}
+
+//节点退出共享连接时丢弃它的全部请求
+void s7_stack_jobs_drop_owner(s7_stack_t *stack, void *owner)
+{
+    for (int i = 0; i < S7_MAX_PARALLEL_JOBS; i++) {
+        if (stack->jobs[i].used && stack->jobs[i].owner == owner) {
+            stack->jobs[i].used = false;
+            stack->n_jobs--;
+        }
+    }
+}
+
+int s7_stack_jobs_count(s7_stack_t *stack, void *user)
+{
+    int n = 0;
+    for (int i = 0; i < S7_MAX_PARALLEL_JOBS; i++) {
+        if (stack->jobs[i].used && stack->jobs[i].user == user) {
+            n++;
+        }
+    }
+    return n;
+}
+
+//超时未应答的请求按设备无应答上报
+void s7_stack_jobs_expire(s7_stack_t *stack, int64_t now)
+{
+    for (int i = 0; i < S7_MAX_PARALLEL_JOBS; i++) {
+        if (stack->jobs[i].used &&
+            now - stack->jobs[i].send_ms >= stack->timeout_ms) {
+            s7_stack_job_t job  = stack->jobs[i];
+            stack->jobs[i].used = false;
+            stack->n_jobs--;
+            plog_warn((neu_plugin_t *) stack->ctx,
+                      "s7 request timeout, sequence:0x%X", job.seq);
+            s7_stack_job_error(stack, &job,
+                               NEU_ERR_PLUGIN_DEVICE_NOT_RESPONSE);
+        }
+    }
+}
+
+bool s7_stack_can_send(s7_stack_t *stack)
+{
+    return stack->cotp_is_connected && stack->s7com_is_connected &&
+        stack->n_jobs < stack->parallel_jobs;
+}
+
+//返回接收缓冲的空闲空间,n_byte为可写入的字节数
+uint8_t *s7_stack_recv_buf(s7_stack_t *stack, uint16_t *n_byte)
+{
+    s7_recv_ring_t *ring = &stack->ring;
+
+    if (ring->head > 0 && ring->size - ring->tail < sizeof(TIsoDataPDU)) {
+        memmove(ring->buf, ring->buf + ring->head, ring->tail - ring->head);
+        ring->tail -= ring->head;
+        ring->head = 0;
+    }
+    *n_byte = ring->size - ring->tail;
+    return ring->buf + ring->tail;
+}
+
+//收到n_byte字节,依次解析其中所有完整的帧. 返回<0表示数据流已无法同步
+int s7_stack_recv_commit(s7_stack_t *stack, uint16_t n_byte)
+{
+    s7_recv_ring_t *ring = &stack->ring;
+
+    ring->tail += n_byte;
+    while (ring->tail - ring->head >= sizeof(struct S7_TPTK)) {
+        uint8_t *       frame  = ring->buf + ring->head;
+        struct S7_TPTK *header = (struct S7_TPTK *) frame;
+        uint16_t        len = (header->HI_Lenght << 8) | header->LO_Lenght;
+
+        if (header->Version != isoTcpVersion ||
+            len < sizeof(struct S7_TPTK) + 3 || len > sizeof(TIsoDataPDU)) {
+            plog_warn((neu_plugin_t *) stack->ctx,
+                      "s7 invalid tpkt, version:%d, len:%d", header->Version,
+                      len);
+            ring->head = 0;
+            ring->tail = 0;
+            return -1;
+        }
+        if (ring->tail - ring->head < len) {
+            break;
+        }
+        ring->head += len;
+
+        neu_protocol_unpack_buf_t pbuf = { 0 };
+
+        plog_recv_protocol((neu_plugin_t *) stack->ctx, frame, len);
+        neu_protocol_unpack_buf_init(&pbuf, frame, len);
+
+        //单帧解析失败不影响后续帧的同步
+        int ret = s7_stack_recv(stack, &pbuf);
+        if (ret < 0) {
+            plog_warn((neu_plugin_t *) stack->ctx, "s7 frame dropped:%d", ret);
+        }
+    }
+
+    if (ring->head == ring->tail) {
+        ring->head = 0;
+        ring->tail = 0;
+    }
+    return 0;
+}
+
 //数据包 协议iso on tcp. 以TPKT开头. 0x03 0x00 0x00 0x16
 int s7_stack_tpkt_check(neu_protocol_unpack_buf_t *buf)
 {
@@ -82,9 +327,40 @@ int s7_stack_tpkt_check(neu_protocol_unpack_buf_t *buf)
     return 0;
 }
 
+//userdata应答,目前只有DB块信息查询
+static int s7_stack_recv_userdata(s7_stack_t *stack,neu_protocol_unpack_buf_t *buf)
+{
+    TS7ResHeader17 s7res_header;
+    s7_stack_job_t job;
+
+    if (s7_res_header17_unwrap(buf, &s7res_header) != 0) {
+        return -1;
+    }
+    if (!s7_stack_job_take(stack, s7res_header.Sequence, &job)) {
+        s7_stack_orphan(stack, "userdata", s7res_header.Sequence);
+        return neu_protocol_unpack_buf_used_size(buf);
+    }
+    if (job.kind != S7_JOB_BLOCK_INFO) {
+        s7_stack_orphan(stack, "userdata", s7res_header.Sequence);
+        s7_stack_job_error(stack, &job, NEU_ERR_PLUGIN_PROTOCOL_DECODE_FAILURE);
+        return -1;
+    }
+
+    int size = s7_res_blockinfo_unwrap(buf);
+    if (size < 0) {
+        plog_warn((neu_plugin_t *) stack->ctx, "s7 DB%hu block info fail:%d",
+                  job.dbnumber, size);
+    } else {
+        plog_notice((neu_plugin_t *) stack->ctx, "s7 DB%hu size:%d",
+                    job.dbnumber, size);
+    }
+    stack->block_info(job.owner, job.dbnumber, size);
+    return neu_protocol_unpack_buf_used_size(buf);
+}
+
 int s7_stack_recv(s7_stack_t *stack,neu_protocol_unpack_buf_t *buf)
 {
-    if(stack->protocol != S7_PROTOCOL_TCP) 
+    if(stack->protocol != S7_PROTOCOL_TCP)
         return -1;
 
     int ret = s7_stack_tpkt_check(buf);
@@ -103,15 +379,18 @@ int s7_stack_recv(s7_stack_t *stack,neu_protocol_unpack_buf_t *buf)
                 int co_ret = s7_cotp_co_unwrap(buf,&cotp_co);
                 if(co_ret == 0){
                     stack->cotp_is_connected = true;
+                    stack->handshake_ms      = 0;
+                    //COTP连接成功,继续S7协商
+                    s7_stack_Handshake(stack);
                 }else{
                     plog_notice((neu_plugin_t *) stack->ctx,"s7 cotp_co unwrap fail:%d",co_ret);
                     return -1;
                 }
                 break;
             }
-        case S7_COTP_DT_DATA: 
+        case S7_COTP_DT_DATA:
             {
-    
+
                 S7_TCOTP_DT cotp_dt;
                 int co_ret = s7_cotp_dt_unwrap(buf,&cotp_dt);
                 if(co_ret != 0 )
@@ -119,65 +398,115 @@ int s7_stack_recv(s7_stack_t *stack,neu_protocol_unpack_buf_t *buf)
                     plog_notice((neu_plugin_t *) stack->ctx,"s7 cotp_dt unwrap fail:%d",co_ret);
                     return -1;
                 }
-                
+
+                //userdata应答头没有Error字段,单独解析
+                if (neu_protocol_unpack_buf_unused_size(buf) >= 2 &&
+                    buf->base[buf->offset + 1] == PduTp_userdata) {
+                    return s7_stack_recv_userdata(stack, buf);
+                }
+
                 //解析s7协议header,判断是否有错误
                 TS7ResHeader23 s7res_header;
+                s7_stack_job_t job;
                 int header_ret = s7_res_header23_unwrap(buf,&s7res_header);
                 if(header_ret != 0)
                 {
-                    printf("s7 com err:0x%X\n",s7res_header.Error);
                     plog_warn((neu_plugin_t *) stack->ctx,"s7 com err:0x%X",s7res_header.Error);
+                    stack->proto.LastIsoError = s7res_header.Error;
+                    if (s7_stack_job_take(stack, s7res_header.Sequence, &job)) {
+                        s7_stack_job_error(stack, &job, job.kind == S7_JOB_WRITE
+                                               ? NEU_ERR_PLUGIN_WRITE_FAILURE
+                                               : NEU_ERR_PLUGIN_READ_FAILURE);
+                    } else if (stack->s7com_is_connected) {
+                        s7_stack_orphan(stack, "error", s7res_header.Sequence);
+                    }
                     return -1;
                 }
 
-                //解析不同应答类型,0x3响应job,0x2简单确认             
+                //解析不同应答类型,0x3响应job,0x2简单确认
                 if(s7res_header.PDUType == PduTp_response){
                     byte funcode = s7_res_funcode_get(buf);
                     if(funcode  == s7Negotiate)
                     {
-                        TResFunNegotiateParams s7res_param;   
+                        TResFunNegotiateParams s7res_param;
                         s7_res_nego_param_unwrap(buf,&s7res_param);
                         //S7 COM 握手成功
                         stack->s7com_is_connected = true;
-                        stack->pdu_size = s7res_param.PDULength;
-                        plog_notice((neu_plugin_t *) stack->ctx,"pdu size:%d,ParallelJobs_1:%d,ParallelJobs_2:%d",
-                            s7res_param.PDULength,s7res_param.ParallelJobs_1,s7res_param.ParallelJobs_2);
+                        stack->handshake_ms       = 0;
+                        stack->pdu_size = s7res_param.PDULength < IsoPayload_Size ?
+                            s7res_param.PDULength : IsoPayload_Size;
+                        stack->proto.IsoPDUSize = stack->pdu_size;
+                        s7_stack_buf_fit(stack);
+                        //并行job数取双方最小值
+                        uint16_t jobs = s7res_param.ParallelJobs_1 < s7res_param.ParallelJobs_2 ?
+                            s7res_param.ParallelJobs_1 : s7res_param.ParallelJobs_2;
+                        if (jobs > S7_MAX_PARALLEL_JOBS) {
+                            jobs = S7_MAX_PARALLEL_JOBS;
+                        }
+                        stack->parallel_jobs = jobs > 0 ? jobs : 1;
+                        plog_notice((neu_plugin_t *) stack->ctx,"pdu size:%d(request:%d),ParallelJobs_1:%d,ParallelJobs_2:%d",
+                            s7res_param.PDULength,stack->proto.PDURequest,s7res_param.ParallelJobs_1,s7res_param.ParallelJobs_2);
                     }
                     else if(funcode == s7FuncRead)
                     {
-                        TResFunReadParams s7res_param;
-                        s7_res_read_param_unwrap(buf,&s7res_param);
-                        plog_notice((neu_plugin_t *) stack->ctx,"s7 receive func:0x%X data:%d",s7res_param.FunRead,s7res_param.ItemCount);
-                        for (size_t i = 0; i < s7res_param.ItemCount; i++)
+                        //按Sequence匹配发出的读请求,不依赖发送顺序
+                        if (!s7_stack_job_take(stack, s7res_header.Sequence, &job)) {
+                            s7_stack_orphan(stack, "read", s7res_header.Sequence);
+                            return neu_protocol_unpack_buf_used_size(buf);
+                        }
+                        if (job.kind != S7_JOB_READ) {
+                            s7_stack_orphan(stack, "read", s7res_header.Sequence);
+                            s7_stack_job_error(stack, &job, NEU_ERR_PLUGIN_PROTOCOL_DECODE_FAILURE);
+                            return neu_protocol_unpack_buf_used_size(buf);
+                        }
+                        s7_read_cmd_t *cmd = job.cmd;
+                        s7_stack_cost_sample(stack, &job);
+
+                        //整条应答校验通过后再上报,item数据直接指向接收缓冲
+                        s7_read_res_t  res  = { 0 };
+                        s7_read_view_t view = { 0 };
+                        int            ret  = s7_res_read_check(buf, cmd, &res);
+                        if (ret != 0) {
+                            plog_warn((neu_plugin_t *) stack->ctx,
+                                      "s7 read response invalid:%d, items:%d", ret,
+                                      cmd->item_num);
+                            s7_stack_job_error(stack, &job, NEU_ERR_PLUGIN_PROTOCOL_DECODE_FAILURE);
+                            return -1;
+                        }
+                        for (uint8_t i = 0; s7_res_read_next(&res, &view); i++)
                         {
-                            TResFunReadItem s7res_item;
-                            s7_res_read_item_unwrap(buf,&s7res_item);
-                            plog_notice((neu_plugin_t *) stack->ctx,"s7 receive err:0x%X func:0x%X,len:%d data[0]:0x%X",
-                                s7res_item.ReturnCode,s7res_item.TransportSize,s7res_item.DataLength>>3,s7res_item.Data[0]);
-                            
                             int err = NEU_ERR_SUCCESS;
-                            if(s7res_item.ReturnCode != 0xFF)
+                            if(view.ret != 0xFF)
                             {
-                                plog_warn((neu_plugin_t *) stack->ctx,"s7 com ReturnCode err:0x%X",s7res_item.ReturnCode);
+                                plog_warn((neu_plugin_t *) stack->ctx,"s7 com ReturnCode err:0x%X",view.ret);
                                 err = NEU_ERR_PLUGIN_READ_FAILURE;
                             }
-
-                            //对tag数据进行赋值
-                            struct s7_data data = { 0 };
-                            data.n_byte = s7res_item.DataLength>>3;
-                            stack->value_fn(stack->ctx, i, data.n_byte, s7res_item.Data, err);
+                            stack->value_fn(job.owner, job.user, cmd, i, view.n_byte, view.data, err);
                         }
 
                     }else if(funcode == s7FuncWrite)
                     {
+                        bool known = s7_stack_job_take(stack, s7res_header.Sequence, &job);
+                        if (known && job.kind != S7_JOB_WRITE) {
+                            s7_stack_job_error(stack, &job, NEU_ERR_PLUGIN_PROTOCOL_DECODE_FAILURE);
+                            known = false;
+                        }
+                        if (!known) {
+                            s7_stack_orphan(stack, "write", s7res_header.Sequence);
+                        }
+
                         TResFunReadParams s7res_param;
                         s7_res_read_param_unwrap(buf,&s7res_param);
 
                         byte wret_Data[MaxVars];
-                        int w_ret = s7_res_write_item_unwrap(buf,wret_Data,s7res_param.ItemCount);
+                        int w_ret = s7res_param.ItemCount > MaxVars ? -1 :
+                            s7_res_write_item_unwrap(buf,wret_Data,s7res_param.ItemCount);
                         if(w_ret != 0)
                         {
                             plog_warn((neu_plugin_t *) stack->ctx,"s7 res write item unwrap fail:%d",w_ret);
+                            if (known) {
+                                s7_stack_job_error(stack, &job, NEU_ERR_PLUGIN_PROTOCOL_DECODE_FAILURE);
+                            }
                             return -1;
                         }
                         else
@@ -188,9 +517,14 @@ int s7_stack_recv(s7_stack_t *stack,neu_protocol_unpack_buf_t *buf)
                                 if(wret_Data[i] != 0xFF)
                                 {
                                     plog_warn((neu_plugin_t *) stack->ctx,"s7 res write item fail:%d",wret_Data[i]);
-                                    w_failed = true;                              
+                                    w_failed = true;
                                 }
                             }
+                            if (known) {
+                                s7_stack_job_error(stack, &job, w_failed
+                                                       ? NEU_ERR_PLUGIN_WRITE_FAILURE
+                                                       : NEU_ERR_SUCCESS);
+                            }
                             if(w_failed)
                                 return S7_DEVICE_ERR;
                         }
@@ -227,53 +561,91 @@ int s7_stack_recv(s7_stack_t *stack,neu_protocol_unpack_buf_t *buf)
     return neu_protocol_unpack_buf_used_size(buf);
 }
 
+//非阻塞握手:每次调用只发送当前阶段的请求,应答由s7_stack_recv推进
+//返回0握手完成,>0等待应答,<0发送失败或应答超时
 int s7_stack_Handshake(s7_stack_t *stack)
 {
-    static __thread uint8_t                 buf[1024] = { 0 };
-    static __thread neu_protocol_pack_buf_t pbuf    = { 0 };
-    int                                     ret     = 0;
-    neu_protocol_pack_buf_init(&pbuf, buf, sizeof(buf));
+    neu_protocol_pack_buf_t pbuf = { 0 };
+    int                     ret  = 0;
+    neu_protocol_pack_buf_init(&pbuf, stack->buf, stack->buf_size);
 
     //判断连接是否成功
-    if(!stack->cotp_is_connected) {
-        s7_cotp_con_warap(&pbuf,buf);
-    }
-    if(stack->cotp_is_connected && !stack->s7com_is_connected){
-        s7_s7com_con_warap(&pbuf, buf);
-    }
     if(stack->cotp_is_connected && stack->s7com_is_connected){
         return 0;
     }
+    if (stack->handshake_ms > 0) {
+        if (neu_time_ms() - stack->handshake_ms < stack->timeout_ms) {
+            return 1;
+        }
+        plog_warn((neu_plugin_t *) stack->ctx, "s7 handshake timeout");
+        stack->handshake_ms = 0;
+        return -1;
+    }
 
-    ret = stack->send_fn(stack->ctx, neu_protocol_pack_buf_used_size(&pbuf),
+    if(!stack->cotp_is_connected) {
+        s7_cotp_con_warap(&stack->proto, &pbuf, stack->buf);
+    } else {
+        s7_s7com_con_warap(&stack->proto, &pbuf, stack->buf);
+    }
+
+    ret = stack->send_fn(stack->ctx, stack->link, neu_protocol_pack_buf_used_size(&pbuf),
                          neu_protocol_pack_buf_get(&pbuf));
     if (ret <= 0) {
-        stack->value_fn(stack->ctx, 0, 0, NULL, NEU_ERR_PLUGIN_DISCONNECTED);
+        stack->value_fn(stack->ctx, NULL, NULL, 0, 0, NULL, NEU_ERR_PLUGIN_DISCONNECTED);
         return -1;
     }
 
+    stack->handshake_ms = neu_time_ms();
     return ret;
 }
 
-int s7_stack_read(s7_stack_t *stack, s7_read_cmd_t *cmd, uint16_t *response_size)
+//规划时已编码的cmd只填写Sequence后直接发送请求帧,否则编码到发送缓冲
+int s7_stack_read(s7_stack_t *stack, void *owner, s7_read_cmd_t *cmd,
+                  void *user, uint16_t *response_size)
 {
-    static __thread uint8_t                 buf[1024] = { 0 };
-    static __thread neu_protocol_pack_buf_t pbuf    = { 0 };
-    int                                     ret     = 0;
-    *response_size                                  = 0;
-
-    neu_protocol_pack_buf_init(&pbuf, buf, sizeof(buf));
+    neu_protocol_pack_buf_t pbuf  = { 0 };
+    int                     ret   = 0;
+    uint8_t *               frame = cmd->req;
+    uint16_t                size  = cmd->n_req;
+    *response_size                = 0;
 
-    if(stack->cotp_is_connected && stack->s7com_is_connected){
-        s7_s7com_multiread_warap(&pbuf, buf,cmd,stack->pdu_size);
-    }else
+    if (!s7_stack_can_send(stack)) {
         return -1;
+    }
+    //应答超出PDU时PLC会拒绝整个请求,不发送
+    uint32_t res_size = S7_READ_RES_HEADER_SIZE;
+    for (uint8_t i = 0; i < cmd->item_num; i++) {
+        res_size += S7_READ_RES_ITEM_SIZE + cmd->item[i].n_register +
+            (cmd->item[i].n_register & 1);
+    }
+    if (res_size > stack->pdu_size) {
+        plog_error((neu_plugin_t *) stack->ctx,
+                   "read res exceeds pdu:%" PRIu32 ", %hhu!%hu, pdu size:%hu",
+                   res_size, cmd->reserve_id, cmd->item_num, stack->pdu_size);
+        return S7_STACK_ENCODE_ERR;
+    }
+    if (frame != NULL && size - S7_ISO_DT_HEADER_SIZE <= stack->pdu_size) {
+        s7_pdu_sequence_set(frame, GetNextWord(&stack->proto));
+    } else {
+        neu_protocol_pack_buf_init(&pbuf, stack->buf, stack->buf_size);
+        ret = s7_s7com_multiread_warap(&stack->proto, &pbuf, stack->buf, cmd,
+                                       stack->pdu_size);
+        if (ret < 0) {
+            plog_error((neu_plugin_t *) stack->ctx,
+                       "encode read req fail:%d, %hhu!%hu, pdu size:%hu", ret,
+                       cmd->reserve_id, cmd->item_num, stack->pdu_size);
+            return S7_STACK_ENCODE_ERR;
+        }
+        frame = neu_protocol_pack_buf_get(&pbuf);
+        size  = neu_protocol_pack_buf_used_size(&pbuf);
+    }
 
-    ret = stack->send_fn(stack->ctx, neu_protocol_pack_buf_used_size(&pbuf),
-                         neu_protocol_pack_buf_get(&pbuf));
+    ret = stack->send_fn(stack->ctx, stack->link, size, frame);
+    if (ret > 0) {
         *response_size = ret;
-    if (ret <= 0) {
-        stack->value_fn(stack->ctx, 0, 0, NULL, NEU_ERR_PLUGIN_DISCONNECTED);
+        s7_stack_job_add(stack, S7_JOB_READ, s7_pdu_sequence_get(frame), cmd,
+                         owner, user);
+    } else {
         plog_warn((neu_plugin_t *) stack->ctx, "send read req fail, %hhu!%hu",
                   cmd->reserve_id, cmd->item_num);
     }
@@ -281,38 +653,79 @@ int s7_stack_read(s7_stack_t *stack, s7_read_cmd_t *cmd, uint16_t *response_size
     return ret;
 }
 
-int s7_stack_write(s7_stack_t *stack, void *req, uint16_t dbnumber,
+//查询DB大小,应答(或超时)时通过block_info返回
+int s7_stack_block_info_req(s7_stack_t *stack, void *owner, uint16_t dbnumber)
+{
+    neu_protocol_pack_buf_t pbuf = { 0 };
+    int                     ret  = 0;
+
+    neu_protocol_pack_buf_init(&pbuf, stack->buf, stack->buf_size);
+
+    if (!s7_stack_can_send(stack)) {
+        return -1;
+    }
+    ret = s7_s7com_blockinfo_warap(&stack->proto, &pbuf, stack->buf, dbnumber);
+    if (ret < 0) {
+        return S7_STACK_ENCODE_ERR;
+    }
+
+    ret = stack->send_fn(stack->ctx, stack->link,
+                         neu_protocol_pack_buf_used_size(&pbuf),
+                         neu_protocol_pack_buf_get(&pbuf));
+    if (ret > 0) {
+        s7_stack_job_t *job =
+            s7_stack_job_add(stack, S7_JOB_BLOCK_INFO,
+                             s7_pdu_sequence_get(stack->buf), NULL, owner, NULL);
+        job->dbnumber = dbnumber;
+    }
+    return ret;
+}
+
+//写请求发出后登记job,PLC应答(或超时)时再通过write_resp返回结果
+int s7_stack_write(s7_stack_t *stack, void *owner, void *req,
+                       uint16_t dbnumber,
                        enum s7_area area, uint16_t start_address,
-                       uint16_t n_reg, uint8_t *bytes, uint8_t n_byte,
+                       uint16_t n_reg, uint8_t *bytes, uint16_t n_byte,
                        uint16_t *response_size, bool response)
 {
-    static __thread neu_protocol_pack_buf_t pbuf     = { 0 };
+    neu_protocol_pack_buf_t pbuf = { 0 };
+    int                     ret  = 0;
+    (void) n_byte;
 
-    memset(stack->buf, 0, stack->buf_size);
     neu_protocol_pack_buf_init(&pbuf, stack->buf, stack->buf_size);
 
-    if(stack->cotp_is_connected && stack->s7com_is_connected){
-        s7_s7com_mutilwrite_warap(&pbuf, stack->buf,dbnumber, area, start_address, n_reg, bytes, stack->buf_size);
-    }else
+    if (!s7_stack_can_send(stack)) {
         return -1;
+    }
+    //数据超出协商的PDU时整条写请求失败,连接保持
+    ret = s7_s7com_mutilwrite_warap(&stack->proto, &pbuf, stack->buf, dbnumber,
+                                    area, start_address, n_reg, bytes,
+                                    stack->pdu_size);
+    if (ret < 0) {
+        plog_error((neu_plugin_t *) stack->ctx,
+                   "encode write req fail:%d, %hu!%hu, n_reg:%hu, pdu size:%hu",
+                   ret, dbnumber, start_address, n_reg, stack->pdu_size);
+        if (response) {
+            stack->write_resp(owner, req, NEU_ERR_PLUGIN_WRITE_FAILURE);
+        }
+        return S7_STACK_ENCODE_ERR;
+    }
 
     *response_size += sizeof(struct s7_code);
 
-    int ret = stack->send_fn(stack->ctx, neu_protocol_pack_buf_used_size(&pbuf),
+    ret = stack->send_fn(stack->ctx, stack->link, neu_protocol_pack_buf_used_size(&pbuf),
                              neu_protocol_pack_buf_get(&pbuf));
     if (ret > 0) {
-        if (response) {
-            stack->write_resp(stack->ctx, req, NEU_ERR_SUCCESS);
-            plog_notice((neu_plugin_t *) stack->ctx, "send write req, %hu!%hu",
-                        dbnumber, start_address);
-        }
+        s7_stack_job_add(stack, S7_JOB_WRITE, s7_pdu_sequence_get(stack->buf),
+                         NULL, owner, response ? req : NULL);
+        plog_notice((neu_plugin_t *) stack->ctx, "send write req, %hu!%hu",
+                    dbnumber, start_address);
     } else {
         if (response) {
-            stack->write_resp(stack->ctx, req, NEU_ERR_PLUGIN_DISCONNECTED);
+            stack->write_resp(owner, req, NEU_ERR_PLUGIN_DISCONNECTED);
             plog_warn((neu_plugin_t *) stack->ctx,
                       "send write req fail, %hu!%hu", dbnumber, start_address);
         }
     }
     return ret;
 }
-
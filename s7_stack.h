@@ -24,33 +24,92 @@
 #include <neuron.h>
 
 #include "s7.h"
+#include "s7_cost.h"
 
-typedef int (*s7_stack_send)(void *ctx, uint16_t n_byte, uint8_t *bytes);
-typedef int (*s7_stack_value)(void *ctx, uint16_t dbnumber, uint16_t n_byte,
-                                  uint8_t *bytes, int error);
+typedef int (*s7_stack_send)(void *ctx, void *link, uint16_t n_byte,
+                             uint8_t *bytes);
+typedef int (*s7_stack_value)(void *ctx, void *user, s7_read_cmd_t *cmd,
+                              uint8_t item_idx, uint16_t n_byte,
+                              uint8_t *bytes, int error);
 typedef int (*s7_stack_write_resp)(void *ctx, void *req, int error);
+// DB块信息应答,size<0表示查询失败
+typedef void (*s7_stack_block_info)(void *ctx, uint16_t dbnumber,
+                                    int32_t size);
 
 typedef enum s7_protocol {
     S7_PROTOCOL_TCP = 1,
     S7_PROTOCOL_300 = 2,
 } s7_protocol_e;
 
+typedef enum s7_job_kind {
+    S7_JOB_READ  = 0,
+    S7_JOB_WRITE      = 1,
+    S7_JOB_BLOCK_INFO = 2,
+} s7_job_kind_e;
+
+// 已发送未应答的请求,按PDU Sequence匹配应答
+// 读请求 user 为发起读的group,写请求 user 为待应答的req(可为NULL)
+// 块信息请求 owner 为会话,dbnumber 为查询的DB
+// owner 为发起请求的节点,应答通过它上报;多个节点共享连接时各不相同
+typedef struct s7_stack_job {
+    bool           used;
+    s7_job_kind_e  kind;
+    uint16_t       seq;
+    s7_read_cmd_t *cmd;
+    void *         owner;
+    void *         user;
+    uint16_t       dbnumber;
+    int64_t        send_ms;
+    int64_t        send_us; // 读请求耗时模型的采样起点
+} s7_stack_job_t;
+
+// 协商PDU之前发送缓冲的大小,足够容纳COTP/S7握手请求
+#define S7_STACK_BUF_MIN 64
+// 请求超出PDU或发送缓冲,无法编码;不是连接错误
+#define S7_STACK_ENCODE_ERR -100
+
+// 每个连接的接收缓冲,可容纳多个最大长度的TPKT帧
+#define S7_RECV_RING_SIZE 16384
+
+// 接收环形缓冲:socket数据尽量一次读满,完整的TPKT帧在缓冲内原地解析
+// [head, tail)为未解析数据,尾部空间不足一个最大帧时把残帧移回开头
+typedef struct s7_recv_ring {
+    uint8_t *buf;
+    uint16_t size;
+    uint16_t head;
+    uint16_t tail;
+} s7_recv_ring_t;
+
 struct s7_stack {
     void *                  ctx;
+    void *                  link; // 发送所用的连接,原样传给send_fn
     s7_stack_send       send_fn;
     s7_stack_value      value_fn;
     s7_stack_write_resp write_resp;
+    s7_stack_block_info block_info;
 
     s7_protocol_e protocol;
+    s7_proto_ctx_t proto; // TSAP/PDU Sequence等协议状态,每个连接独立
     uint16_t          read_seq;
     uint16_t          write_seq;
 
-    uint8_t *buf;
+    uint8_t *buf; // 发送缓冲,大小随协商的PDU增长
     uint16_t buf_size;
 
     bool cotp_is_connected; // COTP connection status
     bool s7com_is_connected; // TPKT connection status
-    uint16_t pdu_size;
+    uint16_t pdu_size; // PLC应答的PDU大小,握手完成前为0
+    uint16_t parallel_jobs; // 协商得到的并行job数
+    int64_t  handshake_ms;  // 最近一次握手请求的发送时间,0表示未在握手
+    int64_t  timeout_ms;    // 请求应答超时
+
+    s7_recv_ring_t ring;
+
+    uint16_t       n_jobs;
+    s7_stack_job_t jobs[S7_MAX_PARALLEL_JOBS];
+    uint64_t       orphans; // 找不到对应请求(超时/已取消)而丢弃的应答数
+
+    s7_cost_t cost; // 由读请求rtt拟合的耗时模型,重连后保留
 };
 
 typedef struct s7_stack s7_stack_t;
@@ -60,13 +119,28 @@ s7_stack_t *s7_stack_create(void *ctx, s7_protocol_e protocol,
                                     s7_stack_value      value_fn,
                                     s7_stack_write_resp write_resp);
 void            s7_stack_destroy(s7_stack_t *stack);
+void            s7_stack_reset(s7_stack_t *stack);
+void            s7_stack_jobs_clear(s7_stack_t *stack);
+void            s7_stack_jobs_fail(s7_stack_t *stack, int error);
+void            s7_stack_jobs_drop(s7_stack_t *stack, void *user);
+void            s7_stack_jobs_drop_owner(s7_stack_t *stack, void *owner);
+int             s7_stack_jobs_count(s7_stack_t *stack, void *user);
+void            s7_stack_jobs_expire(s7_stack_t *stack, int64_t now);
+bool            s7_stack_can_send(s7_stack_t *stack);
+
+uint8_t *s7_stack_recv_buf(s7_stack_t *stack, uint16_t *n_byte);
+int      s7_stack_recv_commit(s7_stack_t *stack, uint16_t n_byte);
 
 int s7_stack_recv(s7_stack_t *stack,neu_protocol_unpack_buf_t *buf);
 int s7_stack_Handshake(s7_stack_t *stack);
-int  s7_stack_read(s7_stack_t *stack, s7_read_cmd_t *cmd, uint16_t *response_size);
-int  s7_stack_write(s7_stack_t *stack, void *req, uint16_t dbnumber,
+int  s7_stack_read(s7_stack_t *stack, void *owner, s7_read_cmd_t *cmd,
+                   void *user, uint16_t *response_size);
+int  s7_stack_block_info_req(s7_stack_t *stack, void *owner,
+                             uint16_t dbnumber);
+int  s7_stack_write(s7_stack_t *stack, void *owner, void *req,
+                        uint16_t dbnumber,
                         enum s7_area area, uint16_t start_address,
-                        uint16_t n_reg, uint8_t *bytes, uint8_t n_byte,
+                        uint16_t n_reg, uint8_t *bytes, uint16_t n_byte,
                         uint16_t *response_size, bool response);
 
 #endif
\ No newline at end of file
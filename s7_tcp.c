@@ -43,6 +43,11 @@ static int driver_group_timer(neu_plugin_t *plugin, neu_plugin_group_t *group);
 static int driver_write(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
                         neu_value_u value);
 static int driver_write_tags(neu_plugin_t *plugin, void *req, UT_array *tags);
+static int driver_load_tags(neu_plugin_t *plugin, const char *group,
+                            neu_datatag_t *tags, int n_tag);
+static int driver_add_tags(neu_plugin_t *plugin, const char *group,
+                           neu_datatag_t *tags, int n_tag);
+static int driver_del_tags(neu_plugin_t *plugin, int n_tag);
 
 static const neu_plugin_intf_funs_t plugin_intf_funs = {
     .open    = driver_open,
@@ -59,9 +64,9 @@ static const neu_plugin_intf_funs_t plugin_intf_funs = {
     .driver.write_tag     = driver_write,
     .driver.tag_validator = driver_tag_validator,
     .driver.write_tags    = driver_write_tags,
-    .driver.add_tags      = NULL,
-    .driver.load_tags     = NULL,
-    .driver.del_tags      = NULL,
+    .driver.add_tags      = driver_add_tags,
+    .driver.load_tags     = driver_load_tags,
+    .driver.del_tags      = driver_del_tags,
 };
 
 const neu_plugin_module_t neu_plugin_module = {
@@ -84,12 +89,14 @@ static neu_plugin_t *driver_open(void)
     neu_plugin_t *plugin = calloc(1, sizeof(neu_plugin_t));
 
     neu_plugin_common_init(&plugin->common);
+    s7_plan_init(plugin);
 
     return plugin;
 }
 
 static int driver_close(neu_plugin_t *plugin)
 {
+    s7_plan_uninit(plugin);
     free(plugin);
 
     return 0;
@@ -99,10 +106,16 @@ static int driver_init(neu_plugin_t *plugin, bool load)
 {
     (void) load;
     plugin->protocol = S7_PROTOCOL_TCP;
-    plugin->events   = neu_event_new();
-    plugin->stack    = s7_stack_create((void *) plugin, S7_PROTOCOL_TCP,
-                                        s7_send_msg, s7_value_handle,
-                                        s7_write_resp);
+    utarray_new(plugin->write_batches, &ut_ptr_icd);
+
+    plugin->common.adapter_callbacks->register_metric(
+        plugin->common.adapter, S7_METRIC_ORPHAN_RESPONSES,
+        "Responses dropped for unknown PDU reference", NEU_METRIC_TYPE_COUNTER,
+        0);
+    plugin->common.adapter_callbacks->register_metric(
+        plugin->common.adapter, S7_METRIC_CACHE_HITS,
+        "Read items served from data another group read within dedup_window",
+        NEU_METRIC_TYPE_COUNTER, 0);
 
     plog_notice(plugin, "%s init success", plugin->common.name);
     return 0;
@@ -111,15 +124,20 @@ static int driver_init(neu_plugin_t *plugin, bool load)
 static int driver_uninit(neu_plugin_t *plugin)
 {
     plog_notice(plugin, "%s uninit start", plugin->common.name);
-    if (plugin->conn != NULL) {
-        neu_conn_destory(plugin->conn);
+    if (plugin->session != NULL) {
+        if (plugin->started) {
+            s7_session_stop(plugin->session);
+            plugin->started = false;
+        }
+        s7_session_put(plugin->session, plugin);
+        plugin->session = NULL;
     }
-
-    if (plugin->stack) {
-        s7_stack_destroy(plugin->stack);
+    //节点退出会话时丢弃的写请求不会再有结果
+    utarray_foreach(plugin->write_batches, struct s7_write_batch **, p_b)
+    {
+        free(*p_b);
     }
-
-    neu_event_close(plugin->events);
+    utarray_free(plugin->write_batches);
 
     plog_notice(plugin, "%s uninit success", plugin->common.name);
 
@@ -128,14 +146,20 @@ static int driver_uninit(neu_plugin_t *plugin)
 
 static int driver_start(neu_plugin_t *plugin)
 {
-    neu_conn_start(plugin->conn);
+    if (!plugin->started && plugin->session != NULL) {
+        s7_session_start(plugin->session);
+        plugin->started = true;
+    }
     plog_notice(plugin, "%s start success", plugin->common.name);
     return 0;
 }
 
 static int driver_stop(neu_plugin_t *plugin)
 {
-    neu_conn_stop(plugin->conn);
+    if (plugin->started && plugin->session != NULL) {
+        s7_session_stop(plugin->session);
+        plugin->started = false;
+    }
     plog_notice(plugin, "%s stop success", plugin->common.name);
     return 0;
 }
@@ -152,7 +176,14 @@ static int driver_config(neu_plugin_t *plugin, const char *config)
     neu_json_elem_t  module    = { .name = "module", .t = NEU_JSON_INT };
     neu_json_elem_t  rack      = { .name = "rack", .t = NEU_JSON_INT };
     neu_json_elem_t  slot      = { .name = "slot", .t = NEU_JSON_INT };
-    neu_json_elem_t  interval  = { .name = "interval", .t = NEU_JSON_INT };
+    neu_json_elem_t  connections = { .name = "connections",
+                                    .t    = NEU_JSON_INT };
+    neu_json_elem_t  transport   = { .name = "transport", .t = NEU_JSON_INT };
+    neu_json_elem_t  reactor     = { .name = "reactor", .t = NEU_JSON_INT };
+    neu_json_elem_t  read_gap    = { .name = "read_gap", .t = NEU_JSON_INT };
+    neu_json_elem_t  group_merge = { .name = "group_merge", .t = NEU_JSON_INT };
+    neu_json_elem_t  dedup_window = { .name = "dedup_window",
+                                     .t    = NEU_JSON_INT };
     neu_conn_param_t param = { 0 };
 
 
@@ -167,27 +198,102 @@ static int driver_config(neu_plugin_t *plugin, const char *config)
         return -1;
     }
 
+    //connections为可选项,老配置默认单连接
+    ret = neu_parse_param((char *) config, NULL, 1, &connections);
+    if (ret != 0) {
+        connections.v.val_int = 1;
+    }
+    if (connections.v.val_int < 1 ||
+        connections.v.val_int > S7_MAX_CONNECTIONS) {
+        plog_error(plugin, "config: invalid connections: %" PRId64,
+                   connections.v.val_int);
+        free(host.v.val_str);
+        return -1;
+    }
+
+    //transport为可选项,默认epoll
+    ret = neu_parse_param((char *) config, NULL, 1, &transport);
+    if (ret != 0) {
+        transport.v.val_int = S7_TRANSPORT_EPOLL;
+    }
+    //reactor为可选项,默认每个会话独占一个events线程
+    ret = neu_parse_param((char *) config, NULL, 1, &reactor);
+    if (ret != 0) {
+        reactor.v.val_int = S7_REACTOR_DEDICATED;
+    }
+    //read_gap为可选项,默认只合并相邻的tag
+    ret = neu_parse_param((char *) config, NULL, 1, &read_gap);
+    if (ret != 0) {
+        read_gap.v.val_int = 0;
+    }
+    if (read_gap.v.val_int < 0 || read_gap.v.val_int > S7_READ_GAP_MAX) {
+        plog_error(plugin, "config: invalid read_gap: %" PRId64,
+                   read_gap.v.val_int);
+        free(host.v.val_str);
+        return -1;
+    }
+    //group_merge为可选项,默认各group独立读取
+    ret = neu_parse_param((char *) config, NULL, 1, &group_merge);
+    if (ret != 0) {
+        group_merge.v.val_int = 0;
+    }
+    //dedup_window为可选项,默认每个group都从PLC读取
+    ret = neu_parse_param((char *) config, NULL, 1, &dedup_window);
+    if (ret != 0) {
+        dedup_window.v.val_int = 0;
+    }
+    if (dedup_window.v.val_int < 0 ||
+        dedup_window.v.val_int > S7_DEDUP_WINDOW_MAX) {
+        plog_error(plugin, "config: invalid dedup_window: %" PRId64,
+                   dedup_window.v.val_int);
+        free(host.v.val_str);
+        return -1;
+    }
+
     param.log              = plugin->common.log;
-    plugin->interval       = interval.v.val_int;
+
+    //S7-200 没有rack/slot配置,使用默认TSAP 0x0100
+    if (module.v.val_int != 0) {
+        rack.v.val_int = 0;
+        slot.v.val_int = 0;
+    }
 
     param.type                      = NEU_CONN_TCP_CLIENT;
     param.params.tcp_client.ip      = host.v.val_str;
     param.params.tcp_client.port    = port.v.val_int;
     param.params.tcp_client.timeout = 3000;
-    plugin->is_server               = false;
 
     plog_notice(plugin,
-                "config: host: %s, port: %" PRId64 ", module: %" PRId64 "",
-                host.v.val_str, port.v.val_int, module.v.val_int);
-
-    if (plugin->conn != NULL) {
-        plugin->conn = neu_conn_reconfig(plugin->conn, &param);
-    } else {
-        plugin->common.link_state = NEU_NODE_LINK_STATE_DISCONNECTED;
-        plugin->conn =
-            neu_conn_new(&param, (void *) plugin, s7_conn_connected,
-                         s7_conn_disconnected);
+                "config: host: %s, port: %" PRId64 ", pdu_size: %" PRId64
+                ", module: %" PRId64 ", connections: %" PRId64 ", transport: %" PRId64 ", reactor: %" PRId64
+                ", read_gap: %" PRId64 ", group_merge: %" PRId64
+                ", dedup_window: %" PRId64 "",
+                host.v.val_str, port.v.val_int, pdu_size.v.val_int,
+                module.v.val_int, connections.v.val_int, transport.v.val_int,
+                reactor.v.val_int, read_gap.v.val_int, group_merge.v.val_int,
+                dedup_window.v.val_int);
+
+    //同一PLC的节点共享会话;地址变化时切换到新的会话
+    s7_session_t *session = s7_session_get(
+        plugin, &param, connections.v.val_int, rack.v.val_int, slot.v.val_int,
+        pdu_size.v.val_int,
+        transport.v.val_int == S7_TRANSPORT_IO_URING ? S7_TRANSPORT_IO_URING
+                                                     : S7_TRANSPORT_EPOLL,
+        reactor.v.val_int == S7_REACTOR_SHARED ? S7_REACTOR_SHARED
+                                               : S7_REACTOR_DEDICATED);
+    if (plugin->session != session) {
+        if (plugin->session != NULL) {
+            if (plugin->started) {
+                s7_session_stop(plugin->session);
+                s7_session_start(session);
+            }
+            s7_session_put(plugin->session, plugin);
+        }
+        plugin->session = session;
     }
+    plugin->read_gap    = (uint16_t) read_gap.v.val_int;
+    plugin->group_merge = group_merge.v.val_int != 0;
+    plugin->cache_ms    = (uint32_t) dedup_window.v.val_int;
 
     free(host.v.val_str);
     return 0;
@@ -248,4 +354,32 @@ static int driver_write(neu_plugin_t *plugin, void *req, neu_datatag_t *tag,
 static int driver_write_tags(neu_plugin_t *plugin, void *req, UT_array *tags)
 {
     return s7_write_tags(plugin, req, tags);
-}
\ No newline at end of file
+}
+
+//tag变化后neuron会释放group并在下次timer时重建,这里只记录哪个group有变化,
+//重建时沿用旧规划,只重排变化的tag附近(read_gap加一个PDU以内)的cmd
+static int driver_load_tags(neu_plugin_t *plugin, const char *group,
+                            neu_datatag_t *tags, int n_tag)
+{
+    (void) tags;
+    (void) n_tag;
+    s7_plan_edited(plugin, group);
+    return 0;
+}
+
+static int driver_add_tags(neu_plugin_t *plugin, const char *group,
+                           neu_datatag_t *tags, int n_tag)
+{
+    (void) tags;
+    plog_debug(plugin, "group %s: %d tags added", group, n_tag);
+    s7_plan_edited(plugin, group);
+    return 0;
+}
+
+//删除时没有group名称,之后一段时间内被释放的group都暂存规划
+static int driver_del_tags(neu_plugin_t *plugin, int n_tag)
+{
+    plog_debug(plugin, "%d tags deleted", n_tag);
+    s7_plan_edited(plugin, NULL);
+    return 0;
+}
@@ -0,0 +1,455 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#include <errno.h>
+#include <liburing.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "s7_req.h"
+#include "s7_uring.h"
+
+#define S7_URING_ENTRIES 256
+#define S7_URING_RECV_BUFS 64 // provided buffer数量,必须是2的幂
+#define S7_URING_RECV_BUF_SIZE 4096
+// 每条连接的在途请求不超过并行job数,发送槽按两倍准备,正常情况下不会耗尽
+#define S7_URING_SEND_SLOTS (S7_MAX_CONNECTIONS * S7_MAX_PARALLEL_JOBS * 2)
+#define S7_URING_NO_SLOT 0xFFFF
+#define S7_URING_SEND_SLOT_SIZE sizeof(TIsoDataPDU)
+#define S7_URING_BGID 0
+
+enum s7_uring_op {
+    S7_URING_RECV   = 1,
+    S7_URING_SEND   = 2,
+    S7_URING_CANCEL = 3,
+    S7_URING_STOP   = 4,
+};
+
+// user_data: bit0-7 op, bit8-15 连接序号, bit16-31 发送槽, bit32-63 连接代数
+// 连接断开重连后代数变化,旧的完成事件直接忽略
+#define S7_URING_DATA(op, idx, slot, gen)                           \
+    ((uint64_t)(op) | ((uint64_t)(idx) << 8) | ((uint64_t)(slot) << 16) | \
+     ((uint64_t)(gen) << 32))
+#define S7_URING_OP(data) ((data) &0xFF)
+#define S7_URING_IDX(data) (((data) >> 8) & 0xFF)
+#define S7_URING_SLOT(data) (((data) >> 16) & 0xFFFF)
+#define S7_URING_GEN(data) ((uint32_t)((data) >> 32))
+
+struct s7_uring {
+    s7_session_t *            session;
+    struct io_uring           ring;
+    struct io_uring_buf_ring *br;
+    uint8_t *                 recv_bufs;
+    uint8_t *                 send_bufs;
+    uint16_t                  send_len[S7_URING_SEND_SLOTS];
+    uint16_t                  send_off[S7_URING_SEND_SLOTS]; // 已发出的字节数
+    uint16_t                  send_next[S7_URING_SEND_SLOTS]; // 同一连接排队的下一帧
+    uint16_t                  send_free[S7_URING_SEND_SLOTS];
+    uint16_t                  n_send_free;
+    // 每条连接同时只有一个发送sqe在途,其余帧按顺序排队,
+    // 保证TPKT帧不会因为部分发送或完成顺序而交错
+    uint16_t queue_head[S7_MAX_CONNECTIONS];
+    uint16_t queue_tail[S7_MAX_CONNECTIONS];
+    bool     sending[S7_MAX_CONNECTIONS];
+    bool                      fixed;   // 发送缓冲已注册,使用write_fixed
+    bool                      pending; // 有未提交的sqe
+    pthread_t                 thread;
+};
+
+static struct io_uring_sqe *s7_uring_sqe(s7_uring_t *uring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+    if (sqe == NULL) {
+        io_uring_submit(&uring->ring);
+        uring->pending = false;
+        sqe            = io_uring_get_sqe(&uring->ring);
+    }
+    return sqe;
+}
+
+static int s7_uring_arm(s7_uring_t *uring, s7_link_t *link)
+{
+    struct io_uring_sqe *sqe = s7_uring_sqe(uring);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    io_uring_prep_recv_multishot(sqe, link->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = S7_URING_BGID;
+    io_uring_sqe_set_data64(
+        sqe, S7_URING_DATA(S7_URING_RECV, link->index, 0, link->uring_gen));
+    io_uring_submit(&uring->ring);
+    uring->pending     = false;
+    link->uring_armed = true;
+    return 0;
+}
+
+//为槽中尚未发出的部分准备发送sqe
+static int s7_uring_send_prep(s7_uring_t *uring, s7_link_t *link,
+                              uint16_t slot)
+{
+    struct io_uring_sqe *sqe = s7_uring_sqe(uring);
+    uint8_t *buf = uring->send_bufs + slot * S7_URING_SEND_SLOT_SIZE +
+        uring->send_off[slot];
+    uint16_t len = uring->send_len[slot] - uring->send_off[slot];
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    if (uring->fixed) {
+        io_uring_prep_write_fixed(sqe, link->fd, buf, len, 0, slot);
+    } else {
+        io_uring_prep_send(sqe, link->fd, buf, len, MSG_NOSIGNAL);
+    }
+    io_uring_sqe_set_data64(
+        sqe, S7_URING_DATA(S7_URING_SEND, link->index, slot, link->uring_gen));
+    uring->sending[link->index] = true;
+    uring->pending              = true;
+    return 0;
+}
+
+//上一帧发完后发出连接上排队的下一帧
+static void s7_uring_send_next(s7_uring_t *uring, s7_link_t *link)
+{
+    uint16_t slot = uring->queue_head[link->index];
+
+    if (slot == S7_URING_NO_SLOT) {
+        return;
+    }
+    uring->queue_head[link->index] = uring->send_next[slot];
+    if (uring->queue_head[link->index] == S7_URING_NO_SLOT) {
+        uring->queue_tail[link->index] = S7_URING_NO_SLOT;
+    }
+    if (s7_uring_send_prep(uring, link, slot) < 0) {
+        uring->send_free[uring->n_send_free++] = slot;
+        neu_conn_disconnect(link->conn);
+    }
+}
+
+//丢弃连接上排队未发的帧,在途的sqe完成时自行归还发送槽
+static void s7_uring_send_drop(s7_uring_t *uring, s7_link_t *link)
+{
+    uint16_t slot = uring->queue_head[link->index];
+
+    while (slot != S7_URING_NO_SLOT) {
+        uint16_t next                          = uring->send_next[slot];
+        uring->send_free[uring->n_send_free++] = slot;
+        slot                                   = next;
+    }
+    uring->queue_head[link->index] = S7_URING_NO_SLOT;
+    uring->queue_tail[link->index] = S7_URING_NO_SLOT;
+    uring->sending[link->index]    = false;
+}
+
+static void s7_uring_recv_done(s7_uring_t *uring, s7_link_t *link, int res,
+                               unsigned flags)
+{
+    s7_session_t *session = uring->session;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t *buf = uring->recv_bufs + bid * S7_URING_RECV_BUF_SIZE;
+
+        if (link != NULL && res > 0 && s7_link_feed(link, buf, res) < 0) {
+            plog_error(session->log, "s7 link %d stream out of sync, reconnect",
+                       link->index);
+            neu_conn_disconnect(link->conn);
+            link = NULL;
+        }
+        io_uring_buf_ring_add(uring->br, buf, S7_URING_RECV_BUF_SIZE, bid,
+                              io_uring_buf_ring_mask(S7_URING_RECV_BUFS), 0);
+        io_uring_buf_ring_advance(uring->br, 1);
+    }
+
+    if (link == NULL) {
+        return;
+    }
+    if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+        plog_warn(session->log, "s7 link %d uring recv: %d, fd: %d",
+                  link->index, res, link->fd);
+        neu_conn_disconnect(link->conn);
+        return;
+    }
+    //缓冲耗尽或内核结束了multishot,重新挂接收
+    if (!(flags & IORING_CQE_F_MORE)) {
+        link->uring_armed = false;
+        s7_uring_arm(uring, link);
+    }
+}
+
+static void s7_uring_complete(s7_uring_t *uring, uint64_t data, int res,
+                              unsigned flags)
+{
+    s7_session_t *session = uring->session;
+    s7_link_t *   link    = NULL;
+    uint8_t       idx     = S7_URING_IDX(data);
+
+    if (idx < session->n_link && session->links[idx].uring_armed &&
+        session->links[idx].uring_gen == S7_URING_GEN(data)) {
+        link = &session->links[idx];
+    }
+
+    switch (S7_URING_OP(data)) {
+    case S7_URING_RECV:
+        s7_uring_recv_done(uring, link, res, flags);
+        break;
+    case S7_URING_SEND: {
+        uint16_t slot = S7_URING_SLOT(data);
+
+        if (link == NULL) {
+            uring->send_free[uring->n_send_free++] = slot;
+            break;
+        }
+        if (res <= 0) {
+            plog_warn(session->log, "s7 link %d uring send: %d/%hu",
+                      link->index, res, uring->send_len[slot]);
+            uring->send_free[uring->n_send_free++] = slot;
+            s7_uring_send_drop(uring, link);
+            neu_conn_disconnect(link->conn);
+            break;
+        }
+        link->send_bytes += res;
+        uring->send_off[slot] += res;
+        //部分发送时从已发出处续发,发完之前不发同一连接的下一帧
+        if (uring->send_off[slot] < uring->send_len[slot]) {
+            if (s7_uring_send_prep(uring, link, slot) < 0) {
+                uring->send_free[uring->n_send_free++] = slot;
+                s7_uring_send_drop(uring, link);
+                neu_conn_disconnect(link->conn);
+            }
+            break;
+        }
+        uring->send_free[uring->n_send_free++] = slot;
+        uring->sending[link->index]            = false;
+        s7_uring_send_next(uring, link);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+//完成事件在独立线程中批量处理,处理期间持有会话锁
+static void *s7_uring_reaper(void *arg)
+{
+    s7_uring_t *  uring   = (s7_uring_t *) arg;
+    s7_session_t *session = uring->session;
+    bool          stop    = false;
+
+    while (!stop) {
+        struct io_uring_cqe *cqe  = NULL;
+        unsigned             head = 0;
+        unsigned             n    = 0;
+        int                  ret  = io_uring_wait_cqe(&uring->ring, &cqe);
+
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&session->mtx);
+        io_uring_for_each_cqe(&uring->ring, head, cqe)
+        {
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            n++;
+            if (S7_URING_OP(data) == S7_URING_STOP) {
+                stop = true;
+                continue;
+            }
+            s7_uring_complete(uring, data, cqe->res, cqe->flags);
+        }
+        io_uring_cq_advance(&uring->ring, n);
+
+        s7_stack_pump(session);
+        //完成事件中续发、接着发送的sqe
+        s7_uring_flush(uring);
+        pthread_mutex_unlock(&session->mtx);
+    }
+
+    return NULL;
+}
+
+s7_uring_t *s7_uring_new(s7_session_t *session)
+{
+    s7_uring_t * uring = calloc(1, sizeof(s7_uring_t));
+    struct iovec iov[S7_URING_SEND_SLOTS];
+    int          ret = 0;
+
+    uring->session = session;
+    ret = io_uring_queue_init(S7_URING_ENTRIES, &uring->ring, 0);
+    if (ret < 0) {
+        plog_warn(session->log, "io_uring init fail: %d", ret);
+        free(uring);
+        return NULL;
+    }
+
+    uring->br = io_uring_setup_buf_ring(&uring->ring, S7_URING_RECV_BUFS,
+                                        S7_URING_BGID, 0, &ret);
+    if (uring->br == NULL) {
+        plog_warn(session->log, "io_uring buf ring setup fail: %d", ret);
+        io_uring_queue_exit(&uring->ring);
+        free(uring);
+        return NULL;
+    }
+    uring->recv_bufs = calloc(S7_URING_RECV_BUFS, S7_URING_RECV_BUF_SIZE);
+    for (uint16_t i = 0; i < S7_URING_RECV_BUFS; i++) {
+        io_uring_buf_ring_add(uring->br,
+                              uring->recv_bufs + i * S7_URING_RECV_BUF_SIZE,
+                              S7_URING_RECV_BUF_SIZE, i,
+                              io_uring_buf_ring_mask(S7_URING_RECV_BUFS), i);
+    }
+    io_uring_buf_ring_advance(uring->br, S7_URING_RECV_BUFS);
+
+    //注册发送缓冲失败(如memlock限制)时退回普通send
+    uring->send_bufs = calloc(S7_URING_SEND_SLOTS, S7_URING_SEND_SLOT_SIZE);
+    for (uint16_t i = 0; i < S7_URING_SEND_SLOTS; i++) {
+        iov[i].iov_base = uring->send_bufs + i * S7_URING_SEND_SLOT_SIZE;
+        iov[i].iov_len  = S7_URING_SEND_SLOT_SIZE;
+        uring->send_free[uring->n_send_free++] = i;
+    }
+    for (uint8_t i = 0; i < S7_MAX_CONNECTIONS; i++) {
+        uring->queue_head[i] = S7_URING_NO_SLOT;
+        uring->queue_tail[i] = S7_URING_NO_SLOT;
+    }
+    uring->fixed =
+        io_uring_register_buffers(&uring->ring, iov, S7_URING_SEND_SLOTS) == 0;
+
+    pthread_create(&uring->thread, NULL, s7_uring_reaper, uring);
+    plog_notice(session->log, "io_uring transport enabled, fixed buffers: %d",
+                uring->fixed);
+    return uring;
+}
+
+//调用时不能持有会话锁,reaper线程退出前需要拿锁处理剩余事件
+void s7_uring_free(s7_uring_t *uring)
+{
+    struct io_uring_sqe *sqe = NULL;
+
+    pthread_mutex_lock(&uring->session->mtx);
+    sqe = s7_uring_sqe(uring);
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data64(sqe, S7_URING_DATA(S7_URING_STOP, 0, 0, 0));
+    io_uring_submit(&uring->ring);
+    pthread_mutex_unlock(&uring->session->mtx);
+
+    pthread_join(uring->thread, NULL);
+
+    io_uring_free_buf_ring(&uring->ring, uring->br, S7_URING_RECV_BUFS,
+                           S7_URING_BGID);
+    io_uring_queue_exit(&uring->ring);
+    free(uring->recv_bufs);
+    free(uring->send_bufs);
+    free(uring);
+}
+
+int s7_uring_attach(s7_uring_t *uring, s7_link_t *link, int fd)
+{
+    link->fd = fd;
+    link->uring_gen++;
+    s7_uring_send_drop(uring, link);
+    return s7_uring_arm(uring, link);
+}
+
+void s7_uring_detach(s7_uring_t *uring, s7_link_t *link)
+{
+    struct io_uring_sqe *sqe = NULL;
+
+    if (!link->uring_armed) {
+        return;
+    }
+    link->uring_armed = false;
+    s7_uring_send_drop(uring, link);
+
+    sqe = s7_uring_sqe(uring);
+    if (sqe != NULL) {
+        io_uring_prep_cancel64(
+            sqe, S7_URING_DATA(S7_URING_RECV, link->index, 0, link->uring_gen),
+            0);
+        io_uring_sqe_set_data64(sqe,
+                                S7_URING_DATA(S7_URING_CANCEL, 0, 0, 0));
+        io_uring_submit(&uring->ring);
+        uring->pending = false;
+    }
+    link->uring_gen++;
+}
+
+//只准备sqe,由s7_uring_flush统一提交;连接上已有在途的发送时排队,按顺序发出
+//没有空闲发送槽时,只有连接上没有在途和排队的帧才能直接send,否则会越过前面的帧;
+//直接send只发出部分时返回-1
+int s7_uring_send(s7_uring_t *uring, s7_link_t *link, uint8_t *bytes,
+                  uint16_t n_byte)
+{
+    uint8_t idx  = link->index;
+    bool    idle = !uring->sending[idx] &&
+        uring->queue_head[idx] == S7_URING_NO_SLOT;
+
+    if (n_byte > S7_URING_SEND_SLOT_SIZE || uring->n_send_free == 0) {
+        if (!idle) {
+            plog_error(uring->session->log,
+                       "s7 link %d uring send slots exhausted", idx);
+            return -1;
+        }
+        int ret = send(link->fd, bytes, n_byte, MSG_NOSIGNAL);
+        if (ret > 0) {
+            link->send_bytes += ret;
+        }
+        //只发出部分时流中已是残帧,按发送失败处理,由调用者断开重连
+        if (ret >= 0 && ret < n_byte) {
+            plog_error(uring->session->log, "s7 link %d short send: %d/%hu",
+                       idx, ret, n_byte);
+            return -1;
+        }
+        return ret;
+    }
+
+    uint16_t slot = uring->send_free[--uring->n_send_free];
+
+    memcpy(uring->send_bufs + slot * S7_URING_SEND_SLOT_SIZE, bytes, n_byte);
+    uring->send_len[slot]  = n_byte;
+    uring->send_off[slot]  = 0;
+    uring->send_next[slot] = S7_URING_NO_SLOT;
+
+    if (!idle) {
+        if (uring->queue_tail[idx] == S7_URING_NO_SLOT) {
+            uring->queue_head[idx] = slot;
+        } else {
+            uring->send_next[uring->queue_tail[idx]] = slot;
+        }
+        uring->queue_tail[idx] = slot;
+        return n_byte;
+    }
+    if (s7_uring_send_prep(uring, link, slot) < 0) {
+        uring->send_free[uring->n_send_free++] = slot;
+        return -1;
+    }
+    return n_byte;
+}
+
+void s7_uring_flush(s7_uring_t *uring)
+{
+    if (uring->pending) {
+        io_uring_submit(&uring->ring);
+        uring->pending = false;
+    }
+}
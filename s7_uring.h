@@ -0,0 +1,38 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+#ifndef _NEU_M_PLUGIN_S7_URING_H_
+#define _NEU_M_PLUGIN_S7_URING_H_
+
+#include <stdint.h>
+
+#include "s7_session.h"
+
+// io_uring传输,编译时打开S7_WITH_IO_URING才可用
+// 每个会话一个ring:批量提交发送,注册的发送缓冲,multishot接收
+typedef struct s7_uring s7_uring_t;
+
+s7_uring_t *s7_uring_new(s7_session_t *session);
+void        s7_uring_free(s7_uring_t *uring);
+int         s7_uring_attach(s7_uring_t *uring, s7_link_t *link, int fd);
+void        s7_uring_detach(s7_uring_t *uring, s7_link_t *link);
+int  s7_uring_send(s7_uring_t *uring, s7_link_t *link, uint8_t *bytes,
+                   uint16_t n_byte);
+void s7_uring_flush(s7_uring_t *uring);
+
+#endif
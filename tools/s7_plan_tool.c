@@ -0,0 +1,634 @@
+/**
+ * NEURON IIoT System for Industry 4.0
+ * Copyright (C) 2020-2022 EMQ Technologies Co., Ltd All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ **/
+
+// 离线读规划:用插件的规划算法对导出的tag表做规划,打印每个group需要的PDU、
+// item和读取字节,按给定的rtt估算一个周期的耗时,并与其他规划方式对比.
+// 部署前用来调整group划分和DB布局
+//
+//   s7-plan [-p pdu_size] [-g gap] [-t rtt_ms] [-j parallel]
+//           [-m fixed,item,byte] [-v] tags.csv|tags.json
+//
+// CSV第一行为表头,按名称识别name/group/address/type列,没有表头时按
+// name,address,type;JSON为neuron导出的tag列表 {"tags":[...]},
+// 或按group组织的 {"groups":[{"name":..,"tags":[...]}]}.
+// type可以是neuron的类型编号或名称(INT16/FLOAT/...).
+// -m为耗时模型系数(微秒),给出时按模型估算每个PDU的耗时,否则每个PDU按rtt计
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <jansson.h>
+#include <neuron.h>
+
+#include "s7_point.h"
+
+#define TOOL_LINE_MAX 1024
+
+struct tool_group {
+    char *    name;
+    UT_array *tags; // s7_point_t *
+};
+
+struct tool_ctx {
+    struct tool_group *groups;
+    uint32_t           n_group;
+
+    uint16_t pdu_size;
+    uint16_t gap;
+    double   rtt_ms;
+    uint16_t parallel;
+    bool     model;
+    double   coef[3]; // 固定开销、每item、每字节,微秒
+    bool     verbose;
+};
+
+// 规划结果中一个PDU的规模
+struct tool_pdu {
+    uint32_t n_item;
+    uint32_t n_byte;
+};
+
+struct tool_plan {
+    const char *     name;
+    struct tool_pdu *pdus;
+    uint32_t         n_pdu;
+    uint32_t         n_item;
+    uint64_t         n_read;
+};
+
+static const struct {
+    const char *name;
+    neu_type_e  type;
+} tool_types[] = {
+    { "INT8", NEU_TYPE_INT8 },     { "UINT8", NEU_TYPE_UINT8 },
+    { "INT16", NEU_TYPE_INT16 },   { "UINT16", NEU_TYPE_UINT16 },
+    { "INT32", NEU_TYPE_INT32 },   { "UINT32", NEU_TYPE_UINT32 },
+    { "INT64", NEU_TYPE_INT64 },   { "UINT64", NEU_TYPE_UINT64 },
+    { "FLOAT", NEU_TYPE_FLOAT },   { "DOUBLE", NEU_TYPE_DOUBLE },
+    { "BIT", NEU_TYPE_BIT },       { "BOOL", NEU_TYPE_BOOL },
+    { "STRING", NEU_TYPE_STRING }, { "BYTES", NEU_TYPE_BYTES },
+#ifdef S7_ARRAY_TAG
+    { "ARRAY_INT8", NEU_TYPE_ARRAY_INT8 },
+    { "ARRAY_UINT8", NEU_TYPE_ARRAY_UINT8 },
+    { "ARRAY_INT16", NEU_TYPE_ARRAY_INT16 },
+    { "ARRAY_UINT16", NEU_TYPE_ARRAY_UINT16 },
+    { "ARRAY_INT32", NEU_TYPE_ARRAY_INT32 },
+    { "ARRAY_UINT32", NEU_TYPE_ARRAY_UINT32 },
+    { "ARRAY_INT64", NEU_TYPE_ARRAY_INT64 },
+    { "ARRAY_UINT64", NEU_TYPE_ARRAY_UINT64 },
+    { "ARRAY_FLOAT", NEU_TYPE_ARRAY_FLOAT },
+    { "ARRAY_DOUBLE", NEU_TYPE_ARRAY_DOUBLE },
+#endif
+};
+
+static int tool_type(const char *s)
+{
+    if (isdigit((unsigned char) s[0])) {
+        return atoi(s);
+    }
+    for (size_t i = 0; i < sizeof(tool_types) / sizeof(tool_types[0]); i++) {
+        if (strcasecmp(s, tool_types[i].name) == 0) {
+            return tool_types[i].type;
+        }
+    }
+    return -1;
+}
+
+static struct tool_group *tool_group_get(struct tool_ctx *ctx, const char *name)
+{
+    for (uint32_t i = 0; i < ctx->n_group; i++) {
+        if (strcmp(ctx->groups[i].name, name) == 0) {
+            return &ctx->groups[i];
+        }
+    }
+
+    ctx->groups = realloc(ctx->groups, (ctx->n_group + 1) * sizeof(*ctx->groups));
+    struct tool_group *g = &ctx->groups[ctx->n_group++];
+    g->name              = strdup(name);
+    utarray_new(g->tags, &ut_ptr_icd);
+    return g;
+}
+
+//按插件的地址解析规则转换,不支持的tag跳过并提示
+static void tool_tag_add(struct tool_ctx *ctx, const char *group,
+                         const char *name, const char *address, int type)
+{
+    neu_datatag_t tag   = { 0 };
+    s7_point_t *  point = calloc(1, sizeof(s7_point_t));
+
+    tag.name      = (char *) name;
+    tag.address   = (char *) address;
+    tag.attribute = NEU_ATTRIBUTE_READ;
+    tag.type      = type;
+
+    int ret = type < 0 ? NEU_ERR_TAG_TYPE_NOT_SUPPORT
+                       : s7_tag_to_point(&tag, point);
+    if (ret != NEU_ERR_SUCCESS) {
+        fprintf(stderr, "skip tag %s (%s): error %d\n", name, address, ret);
+        free(point);
+        return;
+    }
+    utarray_push_back(tool_group_get(ctx, group)->tags, &point);
+}
+
+static char *tool_trim(char *s)
+{
+    while (isspace((unsigned char) *s) || *s == '"') {
+        s++;
+    }
+    char *e = s + strlen(s);
+    while (e > s && (isspace((unsigned char) e[-1]) || e[-1] == '"')) {
+        *--e = '\0';
+    }
+    return s;
+}
+
+static int tool_load_csv(struct tool_ctx *ctx, const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    char  line[TOOL_LINE_MAX];
+    int   col_name = 0, col_group = -1, col_addr = 1, col_type = 2;
+    bool  first    = true;
+
+    if (fp == NULL) {
+        perror(file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *cols[16] = { 0 };
+        int   n_col    = 0;
+
+        char *s = line;
+        char *c = NULL;
+        while (n_col < 16 && (c = strsep(&s, ",")) != NULL) {
+            cols[n_col++] = tool_trim(c);
+        }
+        if (n_col == 0 || cols[0][0] == '\0' || cols[0][0] == '#') {
+            continue;
+        }
+
+        if (first) {
+            first = false;
+            if (strcasecmp(cols[0], "name") == 0) {
+                col_addr = col_type = -1;
+                for (int i = 0; i < n_col; i++) {
+                    if (strcasecmp(cols[i], "name") == 0) {
+                        col_name = i;
+                    } else if (strcasecmp(cols[i], "group") == 0) {
+                        col_group = i;
+                    } else if (strcasecmp(cols[i], "address") == 0) {
+                        col_addr = i;
+                    } else if (strcasecmp(cols[i], "type") == 0) {
+                        col_type = i;
+                    }
+                }
+                if (col_addr < 0 || col_type < 0) {
+                    fprintf(stderr, "%s: need address and type columns\n", file);
+                    fclose(fp);
+                    return -1;
+                }
+                continue;
+            }
+        }
+
+        if (col_name >= n_col || col_addr >= n_col || col_type >= n_col) {
+            continue;
+        }
+        tool_tag_add(ctx,
+                     col_group >= 0 && col_group < n_col ? cols[col_group]
+                                                         : "default",
+                     cols[col_name], cols[col_addr], tool_type(cols[col_type]));
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static void tool_json_tags(struct tool_ctx *ctx, const char *group,
+                           json_t *tags)
+{
+    size_t  i   = 0;
+    json_t *tag = NULL;
+
+    json_array_foreach(tags, i, tag)
+    {
+        const char *name    = json_string_value(json_object_get(tag, "name"));
+        const char *address = json_string_value(json_object_get(tag, "address"));
+        json_t *    type    = json_object_get(tag, "type");
+        json_t *    g       = json_object_get(tag, "group");
+
+        if (name == NULL || address == NULL || type == NULL) {
+            continue;
+        }
+        tool_tag_add(ctx, json_is_string(g) ? json_string_value(g) : group,
+                     name, address,
+                     json_is_integer(type)
+                         ? (int) json_integer_value(type)
+                         : tool_type(json_string_value(type) != NULL
+                                         ? json_string_value(type)
+                                         : ""));
+    }
+}
+
+static int tool_load_json(struct tool_ctx *ctx, const char *file)
+{
+    json_error_t error;
+    json_t *     root = json_load_file(file, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "%s:%d: %s\n", file, error.line, error.text);
+        return -1;
+    }
+
+    json_t *groups = json_object_get(root, "groups");
+    if (json_is_array(groups)) {
+        size_t  i = 0;
+        json_t *g = NULL;
+
+        json_array_foreach(groups, i, g)
+        {
+            const char *name = json_string_value(json_object_get(g, "name"));
+            if (name == NULL) {
+                name = json_string_value(json_object_get(g, "group"));
+            }
+            tool_json_tags(ctx, name != NULL ? name : "default",
+                           json_object_get(g, "tags"));
+        }
+    } else {
+        tool_json_tags(ctx, "default", json_object_get(root, "tags"));
+    }
+
+    json_decref(root);
+    return 0;
+}
+
+//与s7_point.c的规划使用相同的PDU开销
+static uint16_t tool_res_cost(uint32_t n_byte)
+{
+    return S7_READ_RES_ITEM_SIZE + n_byte + (n_byte & 1);
+}
+
+static uint16_t tool_max_items(uint16_t pdu_size)
+{
+    uint16_t req_space = pdu_size - S7_READ_REQ_HEADER_SIZE;
+    uint16_t res_space = pdu_size - S7_READ_RES_HEADER_SIZE;
+    uint16_t max_items = req_space / S7_READ_REQ_ITEM_SIZE;
+
+    if (max_items > res_space / tool_res_cost(1)) {
+        max_items = res_space / tool_res_cost(1);
+    }
+    return max_items > UINT8_MAX ? UINT8_MAX : max_items;
+}
+
+//按给定顺序依次装入当前PDU,装不下就开新的PDU
+static void tool_next_fit(struct tool_plan *plan, const uint32_t *n_bytes,
+                          uint32_t n, uint16_t pdu_size)
+{
+    uint16_t res_space = pdu_size - S7_READ_RES_HEADER_SIZE;
+    uint16_t max_items = tool_max_items(pdu_size);
+    uint32_t res_used  = 0;
+
+    plan->pdus = calloc(n + 1, sizeof(struct tool_pdu));
+    for (uint32_t i = 0; i < n; i++) {
+        struct tool_pdu *pdu = plan->n_pdu > 0 ? &plan->pdus[plan->n_pdu - 1] : NULL;
+        uint32_t         cost = tool_res_cost(n_bytes[i]);
+
+        if (pdu == NULL || pdu->n_item >= max_items ||
+            res_used + cost > res_space) {
+            pdu      = &plan->pdus[plan->n_pdu++];
+            res_used = 0;
+        }
+        pdu->n_item++;
+        pdu->n_byte += n_bytes[i];
+        res_used += cost;
+        plan->n_item++;
+        plan->n_read += n_bytes[i];
+    }
+}
+
+static void tool_plan_from_sort(struct tool_plan *plan, s7_read_cmd_sort_t *cs)
+{
+    plan->pdus  = calloc(cs->n_cmd + 1, sizeof(struct tool_pdu));
+    plan->n_pdu = cs->n_cmd;
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        plan->pdus[i].n_item = cs->cmd[i].item_num;
+        for (uint8_t j = 0; j < cs->cmd[i].item_num; j++) {
+            plan->pdus[i].n_byte += cs->cmd[i].item[j].n_register;
+        }
+        plan->n_item += plan->pdus[i].n_item;
+        plan->n_read += plan->pdus[i].n_byte;
+    }
+}
+
+//一个周期的耗时:PDU按顺序每parallel个一轮并行发出,一轮的耗时取其中最慢的
+static double tool_cycle_ms(const struct tool_ctx *ctx,
+                            const struct tool_plan *plan)
+{
+    double total = 0;
+
+    for (uint32_t i = 0; i < plan->n_pdu; i += ctx->parallel) {
+        double round = 0;
+        for (uint32_t k = i; k < i + ctx->parallel && k < plan->n_pdu; k++) {
+            double t = ctx->rtt_ms;
+            if (ctx->model) {
+                t = (ctx->coef[0] + ctx->coef[1] * plan->pdus[k].n_item +
+                     ctx->coef[2] * plan->pdus[k].n_byte) /
+                    1000.0;
+            }
+            if (t > round) {
+                round = t;
+            }
+        }
+        total += round;
+    }
+    return total;
+}
+
+static int tool_point_cmp(const void *a, const void *b)
+{
+    const s7_point_t *p1 = *(s7_point_t *const *) a;
+    const s7_point_t *p2 = *(s7_point_t *const *) b;
+
+    if (p1->area != p2->area) {
+        return p1->area < p2->area ? -1 : 1;
+    }
+    if (p1->dbnumber != p2->dbnumber) {
+        return p1->dbnumber < p2->dbnumber ? -1 : 1;
+    }
+    return p1->start_address < p2->start_address
+        ? -1
+        : p1->start_address > p2->start_address;
+}
+
+//tag实际用到的字节,重叠的地址只计一次
+static uint64_t tool_bytes_used(UT_array *tags)
+{
+    uint32_t     n      = utarray_len(tags);
+    s7_point_t **sorted = calloc(n + 1, sizeof(s7_point_t *));
+    uint64_t     used   = 0;
+    uint32_t     end    = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        sorted[i] = *(s7_point_t **) utarray_eltptr(tags, i);
+    }
+    qsort(sorted, n, sizeof(s7_point_t *), tool_point_cmp);
+    for (uint32_t i = 0; i < n; i++) {
+        s7_point_t *p     = sorted[i];
+        uint32_t    start = p->start_address;
+        uint32_t    e     = start + p->n_register;
+
+        if (i > 0 &&
+            (sorted[i - 1]->area != p->area ||
+             sorted[i - 1]->dbnumber != p->dbnumber)) {
+            end = 0;
+        }
+        if (start < end) {
+            start = end;
+        }
+        if (e > start) {
+            used += e - start;
+            end = e;
+        }
+    }
+    free(sorted);
+    return used;
+}
+
+static int tool_item_cmp(const void *a, const void *b)
+{
+    const s7_read_item_t *i1 = a;
+    const s7_read_item_t *i2 = b;
+
+    if (i1->area != i2->area) {
+        return i1->area < i2->area ? -1 : 1;
+    }
+    if (i1->dbnumber != i2->dbnumber) {
+        return i1->dbnumber < i2->dbnumber ? -1 : 1;
+    }
+    return i1->start_address < i2->start_address
+        ? -1
+        : i1->start_address > i2->start_address;
+}
+
+//离线没有DB大小,按可寻址的最大值计,跨空洞合并只受gap限制
+static int32_t tool_db_size(void *ctx, uint16_t dbnumber)
+{
+    (void) ctx;
+    (void) dbnumber;
+    return 65535;
+}
+
+static void tool_plan_print(const struct tool_ctx *ctx,
+                            const struct tool_plan *plan, uint64_t used)
+{
+    printf("  %-14s %6" PRIu32 " %7" PRIu32 " %11" PRIu64 " %6.1f %10.1f\n",
+           plan->name, plan->n_pdu, plan->n_item, plan->n_read,
+           plan->n_read > 0 ? 100.0 * used / plan->n_read : 0.0,
+           tool_cycle_ms(ctx, plan));
+}
+
+static void tool_sort_print(s7_read_cmd_sort_t *cs)
+{
+    for (uint16_t i = 0; i < cs->n_cmd; i++) {
+        s7_read_cmd_t *cmd    = &cs->cmd[i];
+        uint32_t       n_byte = 0;
+
+        for (uint8_t j = 0; j < cmd->item_num; j++) {
+            n_byte += cmd->item[j].n_register;
+        }
+        printf("    pdu %u: %u items, %" PRIu32 " bytes%s\n", i,
+               cmd->item_num, n_byte,
+               cmd->oversize ? ", exceeds pdu, not read" : "");
+        for (uint8_t j = 0; j < cmd->item_num; j++) {
+            printf("      DB%u %u+%u, %u tags\n", cmd->item[j].dbnumber,
+                   cmd->item[j].start_address, cmd->item[j].n_register,
+                   cmd->item[j].n_point);
+        }
+    }
+}
+
+static void tool_group_run(struct tool_ctx *ctx, struct tool_group *g)
+{
+    uint32_t         n_tag  = utarray_len(g->tags);
+    uint64_t         used   = tool_bytes_used(g->tags);
+    uint32_t *       bytes  = calloc(n_tag + 1, sizeof(uint32_t));
+    struct tool_plan plan   = { 0 };
+    s7_plan_param_t  param  = { .pdu_size = ctx->pdu_size,
+                               .db_size  = tool_db_size,
+                               .split    = 1 };
+
+    printf("group %s: %" PRIu32 " tags, %" PRIu64 " bytes used\n", g->name,
+           n_tag, used);
+    printf("  %-14s %6s %7s %11s %6s %10s\n", "plan", "pdus", "items",
+           "bytes read", "used%", "cycle ms");
+
+    //每个tag一个item,按配置顺序装入PDU
+    plan.name = "per-tag";
+    for (uint32_t i = 0; i < n_tag; i++) {
+        bytes[i] = (*(s7_point_t **) utarray_eltptr(g->tags, i))->n_register;
+    }
+    tool_next_fit(&plan, bytes, n_tag, ctx->pdu_size);
+    tool_plan_print(ctx, &plan, used);
+    free(plan.pdus);
+
+    //连续地址合并后按地址顺序装入PDU
+    s7_read_cmd_sort_t *cs = s7_tag_sort(g->tags, &param);
+    s7_read_item_t *    items =
+        calloc(n_tag + 1, sizeof(s7_read_item_t));
+    uint32_t n_item = cs->n_item;
+    memcpy(items, cs->items, n_item * sizeof(s7_read_item_t));
+    qsort(items, n_item, sizeof(s7_read_item_t), tool_item_cmp);
+    for (uint32_t i = 0; i < n_item; i++) {
+        bytes[i] = items[i].n_register;
+    }
+    plan = (struct tool_plan) { .name = "next-fit" };
+    tool_next_fit(&plan, bytes, n_item, ctx->pdu_size);
+    tool_plan_print(ctx, &plan, used);
+    free(plan.pdus);
+    free(items);
+
+    //插件的规划: 连续地址合并后first-fit-decreasing装箱
+    plan = (struct tool_plan) { .name = "ffd" };
+    tool_plan_from_sort(&plan, cs);
+    tool_plan_print(ctx, &plan, used);
+    free(plan.pdus);
+    if (ctx->verbose && ctx->gap == 0) {
+        tool_sort_print(cs);
+    }
+    s7_tag_sort_free(cs);
+
+    //跨空洞合并
+    if (ctx->gap > 0) {
+        char name[32] = { 0 };
+
+        param.gap = ctx->gap;
+        cs        = s7_tag_sort(g->tags, &param);
+        snprintf(name, sizeof(name), "ffd gap %u", ctx->gap);
+        plan = (struct tool_plan) { .name = name };
+        tool_plan_from_sort(&plan, cs);
+        tool_plan_print(ctx, &plan, used);
+        free(plan.pdus);
+        if (ctx->verbose) {
+            tool_sort_print(cs);
+        }
+        s7_tag_sort_free(cs);
+    }
+
+    //按耗时模型估算时,并行job有空闲可以拆成更小的PDU
+    for (uint8_t k = 2; ctx->model && k <= 4; k++) {
+        char name[32] = { 0 };
+
+        param.split = k;
+        cs          = s7_tag_sort(g->tags, &param);
+        snprintf(name, sizeof(name), "ffd split %u", k);
+        plan = (struct tool_plan) { .name = name };
+        tool_plan_from_sort(&plan, cs);
+        tool_plan_print(ctx, &plan, used);
+        free(plan.pdus);
+        s7_tag_sort_free(cs);
+    }
+
+    free(bytes);
+}
+
+static void tool_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-p pdu_size] [-g gap] [-t rtt_ms] [-j parallel] "
+            "[-m fixed,item,byte] [-v] tags.csv|tags.json\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct tool_ctx ctx = { .pdu_size = 960, .rtt_ms = 10, .parallel = 1 };
+    int             opt = 0;
+
+    while ((opt = getopt(argc, argv, "p:g:t:j:m:v")) != -1) {
+        switch (opt) {
+        case 'p':
+            ctx.pdu_size = atoi(optarg);
+            break;
+        case 'g':
+            ctx.gap = atoi(optarg);
+            break;
+        case 't':
+            ctx.rtt_ms = atof(optarg);
+            break;
+        case 'j':
+            ctx.parallel = atoi(optarg);
+            break;
+        case 'm':
+            ctx.model = sscanf(optarg, "%lf,%lf,%lf", &ctx.coef[0],
+                               &ctx.coef[1], &ctx.coef[2]) == 3;
+            if (!ctx.model) {
+                tool_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'v':
+            ctx.verbose = true;
+            break;
+        default:
+            tool_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        tool_usage(argv[0]);
+        return 1;
+    }
+    if (ctx.pdu_size < 240 || ctx.gap > S7_READ_GAP_MAX || ctx.parallel == 0) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    const char *file = argv[optind];
+    const char *ext  = strrchr(file, '.');
+    int         ret  = ext != NULL && strcasecmp(ext, ".json") == 0
+                 ? tool_load_json(&ctx, file)
+                 : tool_load_csv(&ctx, file);
+    if (ret != 0) {
+        return 1;
+    }
+
+    printf("pdu %u, gap %u, parallel %u, ", ctx.pdu_size, ctx.gap,
+           ctx.parallel);
+    if (ctx.model) {
+        printf("model %.0f + %.1f/item + %.2f/byte us\n", ctx.coef[0],
+               ctx.coef[1], ctx.coef[2]);
+    } else {
+        printf("rtt %.1f ms\n", ctx.rtt_ms);
+    }
+
+    for (uint32_t i = 0; i < ctx.n_group; i++) {
+        tool_group_run(&ctx, &ctx.groups[i]);
+        utarray_foreach(ctx.groups[i].tags, s7_point_t **, p) { free(*p); }
+        utarray_free(ctx.groups[i].tags);
+        free(ctx.groups[i].name);
+    }
+    free(ctx.groups);
+    return 0;
+}